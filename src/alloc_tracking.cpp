@@ -0,0 +1,154 @@
+#include "alloc_tracking.h"
+
+#if MIDI2UGE_ALLOC_TRACKING
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+// Each block is preceded by its size; the header keeps malloc's alignment
+constexpr size_t HEADER_BYTES = alignof(std::max_align_t) > sizeof(size_t) ? alignof(std::max_align_t) : sizeof(size_t);
+
+std::atomic<uint64_t> g_count{0};
+std::atomic<uint64_t> g_bytes{0};
+std::atomic<int64_t> g_live{0};
+std::atomic<int64_t> g_peak{0};
+
+// Trivially initialized, so safe to touch from operator new at any time
+thread_local AllocCounters* t_stage = nullptr;
+thread_local int64_t t_live = 0;
+
+void countAlloc(size_t size) {
+    g_count.fetch_add(1, std::memory_order_relaxed);
+    g_bytes.fetch_add(size, std::memory_order_relaxed);
+    int64_t live = g_live.fetch_add(size, std::memory_order_relaxed) + size;
+    int64_t peak = g_peak.load(std::memory_order_relaxed);
+    while (live > peak && !g_peak.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+    t_live += size;
+    if (AllocCounters* stage = t_stage) {
+        stage->count++;
+        stage->bytes += size;
+        stage->peak = std::max(stage->peak, t_live - stage->start_live);
+    }
+}
+
+void countFree(size_t size) {
+    g_live.fetch_sub(size, std::memory_order_relaxed);
+    t_live -= size;
+}
+
+void* trackedAlloc(size_t size) {
+    void* block = std::malloc(size + HEADER_BYTES);
+    if (!block) return nullptr;
+    *static_cast<size_t*>(block) = size;
+    countAlloc(size);
+    return static_cast<char*>(block) + HEADER_BYTES;
+}
+
+void trackedFree(void* ptr) {
+    if (!ptr) return;
+    void* block = static_cast<char*>(ptr) - HEADER_BYTES;
+    countFree(*static_cast<size_t*>(block));
+    std::free(block);
+}
+
+// Over-aligned blocks (std::pmr resources ask for them by alignment) keep
+// the size and the start of the malloc block in the two words before them
+void* trackedAllocAligned(size_t size, std::align_val_t alignment) {
+    size_t align = std::max(static_cast<size_t>(alignment), alignof(std::max_align_t));
+    void* block = std::malloc(size + align + 2 * sizeof(size_t));
+    if (!block) return nullptr;
+    uintptr_t start = reinterpret_cast<uintptr_t>(block) + 2 * sizeof(size_t);
+    uintptr_t user = (start + align - 1) & ~(uintptr_t(align) - 1);
+    size_t* header = reinterpret_cast<size_t*>(user) - 2;
+    header[0] = size;
+    header[1] = reinterpret_cast<uintptr_t>(block);
+    countAlloc(size);
+    return reinterpret_cast<void*>(user);
+}
+
+void trackedFreeAligned(void* ptr) {
+    if (!ptr) return;
+    size_t* header = static_cast<size_t*>(ptr) - 2;
+    countFree(header[0]);
+    std::free(reinterpret_cast<void*>(header[1]));
+}
+
+} // namespace
+
+void beginAllocStage(AllocCounters& stage) {
+    stage = AllocCounters{};
+    stage.start_live = t_live;
+    stage.parent = t_stage;
+    t_stage = &stage;
+}
+
+void endAllocStage(AllocCounters& stage) {
+    t_stage = stage.parent;
+    if (AllocCounters* parent = stage.parent) {
+        parent->peak = std::max(parent->peak, stage.start_live - parent->start_live + stage.peak);
+    }
+}
+
+AllocTotals allocTotals() {
+    AllocTotals totals;
+    totals.count = g_count.load(std::memory_order_relaxed);
+    totals.bytes = g_bytes.load(std::memory_order_relaxed);
+    totals.live = g_live.load(std::memory_order_relaxed);
+    totals.peak = g_peak.load(std::memory_order_relaxed);
+    return totals;
+}
+
+// --- Global operator new/delete ---
+
+void* operator new(size_t size) {
+    void* ptr = trackedAlloc(size);
+    if (!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new[](size_t size) {
+    void* ptr = trackedAlloc(size);
+    if (!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return trackedAlloc(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return trackedAlloc(size); }
+
+void operator delete(void* ptr) noexcept { trackedFree(ptr); }
+void operator delete[](void* ptr) noexcept { trackedFree(ptr); }
+void operator delete(void* ptr, size_t) noexcept { trackedFree(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { trackedFree(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { trackedFree(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { trackedFree(ptr); }
+
+void* operator new(size_t size, std::align_val_t alignment) {
+    void* ptr = trackedAllocAligned(size, alignment);
+    if (!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+    void* ptr = trackedAllocAligned(size, alignment);
+    if (!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return trackedAllocAligned(size, alignment); }
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return trackedAllocAligned(size, alignment); }
+
+void operator delete(void* ptr, std::align_val_t) noexcept { trackedFreeAligned(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { trackedFreeAligned(ptr); }
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept { trackedFreeAligned(ptr); }
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { trackedFreeAligned(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { trackedFreeAligned(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { trackedFreeAligned(ptr); }
+
+#endif
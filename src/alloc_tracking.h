@@ -0,0 +1,38 @@
+#pragma once
+#include <cstdint>
+
+// Allocation accounting for --profile. Configure with
+// -DMIDI2UGE_ALLOC_TRACKING=ON to replace the global operator new/delete
+// with counting versions; every profiled stage then reports the
+// allocations made while it ran and its high-water mark.
+#ifndef MIDI2UGE_ALLOC_TRACKING
+#define MIDI2UGE_ALLOC_TRACKING 0
+#endif
+
+#if MIDI2UGE_ALLOC_TRACKING
+
+// Allocations of one stage on one thread. Nested stages count their own
+// allocations only; their peak is carried up to the enclosing stage.
+struct AllocCounters {
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+    int64_t start_live = 0; // live bytes on this thread when the stage began
+    int64_t peak = 0;       // most bytes live above start_live while it ran
+    AllocCounters* parent = nullptr;
+};
+
+// Makes stage the one this thread's allocations are counted in
+void beginAllocStage(AllocCounters& stage);
+// Restores the enclosing stage
+void endAllocStage(AllocCounters& stage);
+
+struct AllocTotals {
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+    int64_t live = 0;
+    int64_t peak = 0; // process-wide high-water mark of live bytes
+};
+
+AllocTotals allocTotals();
+
+#endif
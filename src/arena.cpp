@@ -0,0 +1,35 @@
+#include "arena.h"
+#include <algorithm>
+#include <new>
+
+// The arena asks for nothing over-aligned, so the plain operator new serves
+void* ConversionArena::CountingResource::do_allocate(size_t bytes, size_t alignment) {
+    allocated += bytes;
+    if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) return ::operator new(bytes, std::align_val_t(alignment));
+    return ::operator new(bytes);
+}
+
+void ConversionArena::CountingResource::do_deallocate(void* p, size_t, size_t alignment) {
+    if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) ::operator delete(p, std::align_val_t(alignment));
+    else ::operator delete(p);
+}
+
+ConversionArena::ConversionArena(size_t initial_bytes)
+    : buffer_(new std::byte[initial_bytes]), capacity_(initial_bytes) {
+    arena_.emplace(buffer_.get(), capacity_, &upstream_);
+}
+
+void ConversionArena::reset() {
+    arena_->release();
+    if (upstream_.allocated == 0) return;
+    // Grow to what the last conversion used in all, so the next one fits,
+    // but no further than MAX_BYTES: one huge file must not pin its memory
+    // for the rest of a batch or server run
+    size_t wanted = std::min(capacity_ + upstream_.allocated, std::max(capacity_, MAX_BYTES));
+    upstream_.allocated = 0;
+    if (wanted == capacity_) return;
+    capacity_ = wanted;
+    arena_.reset();
+    buffer_.reset(new std::byte[capacity_]);
+    arena_.emplace(buffer_.get(), capacity_, &upstream_);
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <utility>
+
+// Scratch memory for conversions: the row grids, effect lanes, note
+// tracking maps and the like come from one monotonic buffer that is freed
+// all at once between files instead of piece by piece. The buffer is kept
+// and grows to the largest conversion seen (up to MAX_BYTES), so converting
+// a batch of similar files soon stops calling the global allocator for
+// scratch data. Not thread-safe: use one arena per converting thread.
+//
+// Nothing is freed before the reset, so search loops that build and drop
+// trial data (ROM budget steps, split probes) give each iteration its own
+// IterationScratch instead.
+class ConversionArena {
+public:
+    explicit ConversionArena(size_t initial_bytes = DEFAULT_BYTES);
+    ConversionArena(const ConversionArena&) = delete;
+    ConversionArena& operator=(const ConversionArena&) = delete;
+
+    std::pmr::memory_resource* resource() { return &*arena_; }
+
+    // Frees everything allocated since the last reset. Nothing allocated
+    // from resource() may be used afterwards.
+    void reset();
+
+    size_t capacity() const { return capacity_; }
+    // Bytes taken from the heap since the last reset, beyond the retained buffer
+    size_t overflowBytes() const { return upstream_.allocated; }
+
+    static constexpr size_t DEFAULT_BYTES = 1 << 20;
+    static constexpr size_t MAX_BYTES = 32 << 20; // retained between conversions
+
+private:
+    // Heap fallback once the buffer is used up; counts what it hands out
+    class CountingResource : public std::pmr::memory_resource {
+    public:
+        size_t allocated = 0;
+
+    private:
+        void* do_allocate(size_t bytes, size_t alignment) override;
+        void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+    };
+
+    CountingResource upstream_;
+    std::unique_ptr<std::byte[]> buffer_;
+    size_t capacity_ = 0;
+    std::optional<std::pmr::monotonic_buffer_resource> arena_;
+};
+
+// Scratch of one search-loop iteration: a monotonic buffer on the heap that
+// is returned when the iteration ends
+class IterationScratch {
+public:
+    explicit IterationScratch(size_t initial_bytes) : buffer_(std::max<size_t>(initial_bytes, 1), std::pmr::new_delete_resource()) {}
+    std::pmr::memory_resource* resource() { return &buffer_; }
+
+private:
+    std::pmr::monotonic_buffer_resource buffer_;
+};
+
+template <typename Container, size_t... I>
+std::array<Container, sizeof...(I)> arenaArrayImpl(std::pmr::memory_resource* resource, std::index_sequence<I...>) {
+    return {{((void)I, Container(resource))...}};
+}
+
+// std::array of N pmr containers that all allocate from resource (the
+// default constructor would give each one the default resource)
+template <typename Container, size_t N>
+std::array<Container, N> arenaArray(std::pmr::memory_resource* resource) {
+    return arenaArrayImpl<Container>(resource, std::make_index_sequence<N>());
+}
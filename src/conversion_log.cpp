@@ -0,0 +1,33 @@
+#include "conversion_log.h"
+
+namespace {
+
+thread_local ConversionLog t_log;
+
+// Swallows dropped lines; one per thread, as writes set its state bits
+std::ostream& nullStream() {
+    thread_local std::ostream null(nullptr);
+    return null;
+}
+
+} // namespace
+
+std::ostream& debugLog() { return t_log.debug ? *t_log.debug : nullStream(); }
+
+std::ostream& warningLog() { return t_log.warning ? *t_log.warning : nullStream(); }
+
+ConversionLogScope::ConversionLogScope(const ConversionLog& log) : previous_(t_log) { t_log = log; }
+
+ConversionLogScope::~ConversionLogScope() { t_log = previous_; }
+
+std::string hexString(uint64_t value, int width, bool uppercase) {
+    // By hand: the writer logs offsets even when the debug log is dropped
+    const char* digits = uppercase ? "0123456789ABCDEF" : "0123456789abcdef";
+    std::string text;
+    do {
+        text.insert(text.begin(), digits[value & 0xF]);
+        value >>= 4;
+    } while (value);
+    if (int(text.size()) < width) text.insert(0, width - text.size(), '0');
+    return text;
+}
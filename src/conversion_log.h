@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+#include <iostream>
+#include <ostream>
+#include <string>
+
+// Where a conversion's output goes: the [UGE DEBUG] lines and progress
+// messages, and the [UGE WARNING] lines and errors. A null stream drops
+// them. The converter writes to the log of the conversion running on the
+// current thread (see ConversionLogScope), so conversions on different
+// threads only share a stream if they are given the same one.
+struct ConversionLog {
+    std::ostream* debug = &std::cout;
+    std::ostream* warning = &std::cerr;
+};
+
+// This thread's debug and warning streams; std::cout and std::cerr outside
+// any ConversionLogScope
+std::ostream& debugLog();
+std::ostream& warningLog();
+
+// Sends this thread's log to log until the scope ends. Scopes nest.
+class ConversionLogScope {
+public:
+    explicit ConversionLogScope(const ConversionLog& log);
+    ~ConversionLogScope();
+    ConversionLogScope(const ConversionLogScope&) = delete;
+    ConversionLogScope& operator=(const ConversionLogScope&) = delete;
+
+private:
+    ConversionLog previous_;
+};
+
+// value in hex, zero-padded to width digits, for the log lines. Log streams
+// may be shared between threads (std::cout by default), so lines must not
+// change their formatting flags with std::hex and the like.
+std::string hexString(uint64_t value, int width = 0, bool uppercase = false);
@@ -0,0 +1,324 @@
+#include "effects.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <map>
+
+EffectLanes::EffectLanes(std::pmr::memory_resource* resource)
+    : values(arenaArray<std::pmr::vector<int>, NUM_EFFECT_LANES>(resource)),
+      bend(resource), modulation(resource), volume(resource), expression(resource) {}
+
+void EffectLanes::resize(int rows) {
+    for (auto& lane : values) lane.assign(rows, EFFECT_NONE);
+    bend.assign(rows, CONTROLLER_NONE);
+    modulation.assign(rows, CONTROLLER_NONE);
+    volume.assign(rows, CONTROLLER_NONE);
+    expression.assign(rows, CONTROLLER_NONE);
+}
+
+// Rows apart two events may be and still count as one ramp
+static constexpr int RAMP_MAX_GAP = 2;
+
+// --- Pitch curve analysis ---
+
+static constexpr int MIN_VIBRATO_TURNS = 3;      // direction changes before a run counts as vibrato
+static constexpr uint8_t MODULATION_VIBRATO_SPEED = 4;
+
+// Game Boy channel period register value for a (fractional) MIDI pitch
+static double gbPeriod(double midi_pitch) {
+    double freq = 440.0 * std::pow(2.0, (midi_pitch - 69.0) / 12.0);
+    return std::clamp(2048.0 - 131072.0 / freq, 0.0, 2047.0);
+}
+
+static double bendSemitones(int bend) {
+    return double(bend) / BEND_UNITS_PER_SEMITONE;
+}
+
+// Note sounding on a row, or the last one before it (-1 if none)
+static int noteAt(const UgeRowGrid& grid, int ch, int row) {
+    for (int r = row; r >= 0; --r) {
+        if (grid.notes[ch][r] != UGE_EMPTY_NOTE) return grid.notes[ch][r];
+    }
+    return -1;
+}
+
+static bool isNoteOnset(const UgeRowGrid& grid, int ch, int row) {
+    return grid.notes[ch][row] != UGE_EMPTY_NOTE && (row == 0 || grid.notes[ch][row - 1] != grid.notes[ch][row]);
+}
+
+// Runs of controller events no more than RAMP_MAX_GAP rows apart; a new
+// note starts a new run so every note gets its own effect
+static std::pmr::vector<std::pmr::vector<int>> controllerRuns(const std::pmr::vector<int>& curve, const UgeRowGrid& grid, int ch) {
+    std::pmr::vector<std::pmr::vector<int>> runs(curve.get_allocator());
+    int last = -RAMP_MAX_GAP - 1;
+    bool onset = false;
+    for (int row = 0; row < (int)curve.size(); ++row) {
+        onset = onset || isNoteOnset(grid, ch, row);
+        if (curve[row] == CONTROLLER_NONE) continue;
+        if (runs.empty() || row - last > RAMP_MAX_GAP || onset) runs.emplace_back();
+        onset = false;
+        runs.back().push_back(row);
+        last = row;
+    }
+    return runs;
+}
+
+static void analyzeBendRun(EffectLanes& lanes, UgeRowGrid& grid, int ch, const std::pmr::vector<int>& rows, int held_bend, int ticks_per_row, PitchCurveReport& report) {
+    // Points of the curve: the bend held before the run, then every event
+    std::pmr::memory_resource* scratch = rows.get_allocator().resource();
+    std::pmr::vector<int> at_row(1, rows.front(), scratch);
+    std::pmr::vector<int> value(1, held_bend, scratch);
+    for (int row : rows) {
+        at_row.push_back(row);
+        value.push_back(lanes.bend[row]);
+    }
+    // Indices where the curve turns around, plus both ends
+    std::pmr::vector<size_t> turns(1, 0, scratch);
+    int dir = 0;
+    for (size_t i = 1; i < value.size(); ++i) {
+        int step = value[i] - value[i - 1];
+        int step_dir = (step > 0) - (step < 0);
+        if (step_dir == 0) continue;
+        if (dir != 0 && step_dir != dir) turns.push_back(i - 1);
+        dir = step_dir;
+    }
+    turns.push_back(value.size() - 1);
+
+    int& start_cell = lanes.values[LANE_PITCH_BEND][rows.front()];
+    int note = noteAt(grid, ch, rows.front());
+    if (note < 0) return; // bending silence
+
+    const int inner_turns = turns.size() - 2;
+    if (inner_turns >= MIN_VIBRATO_TURNS) {
+        // --- Oscillation: one vibrato for the whole run ---
+        auto [lo, hi] = std::minmax_element(value.begin() + 1, value.end());
+        double amplitude = bendSemitones(*hi - *lo) / 2.0;
+        int depth = std::lround(std::abs(gbPeriod(note + amplitude) - gbPeriod(note)));
+        double half_cycle_rows = double(rows.back() - rows.front()) / (inner_turns + 1);
+        int speed = std::lround(half_cycle_rows * ticks_per_row) - 1;
+        start_cell = effectCell(0x4, (std::clamp(speed, 1, 15) << 4) | std::clamp(depth, 1, 15));
+        ++report.vibratos;
+        return;
+    }
+
+    // --- Monotonic glides between turning points ---
+    for (size_t t = 0; t + 1 < turns.size(); ++t) {
+        size_t a = turns[t], b = turns[t + 1];
+        int start_row = at_row[std::max<size_t>(a, 1)];
+        int end_row = at_row[b];
+        double from = note + bendSemitones(value[a]);
+        double to = note + bendSemitones(value[b]);
+        double delta = gbPeriod(to) - gbPeriod(from);
+        if (std::abs(delta) < 1.0) continue;
+        int ticks = std::max(1, end_row - start_row + 1) * ticks_per_row;
+        int speed = std::clamp((int)std::ceil(std::abs(delta) / ticks), 1, 255);
+
+        // A glide that lands on the next note is a slide into it
+        int target_row = -1;
+        for (int r = end_row + 1; r <= end_row + RAMP_MAX_GAP && r < grid.total_rows; ++r) {
+            if (!isNoteOnset(grid, ch, r)) continue;
+            if (grid.notes[ch][r] != note && std::abs(grid.notes[ch][r] - to) <= 0.5) target_row = r;
+            break;
+        }
+        if (target_row >= 0) {
+            uint8_t target = grid.notes[ch][target_row];
+            for (int r = start_row; r < target_row; ++r) {
+                if (grid.notes[ch][r] == note) grid.notes[ch][r] = target;
+            }
+            lanes.values[LANE_PITCH_BEND][start_row] = effectCell(0x3, speed);
+            ++report.tone_portamentos;
+        } else {
+            lanes.values[LANE_PITCH_BEND][start_row] = effectCell(delta > 0 ? 0x1 : 0x2, speed);
+            ++report.portamentos;
+        }
+    }
+}
+
+PitchCurveReport analyzePitchCurves(std::array<EffectLanes, UGE_NUM_CHANNELS>& lanes, UgeRowGrid& grid, int ticks_per_row) {
+    PitchCurveReport report;
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        EffectLanes& l = lanes[ch];
+        if (ch == 3) continue; // the noise channel has no pitch to bend
+        int held_bend = 0;
+        for (const auto& run : controllerRuns(l.bend, grid, ch)) {
+            report.bend_events += run.size();
+            analyzeBendRun(l, grid, ch, run, held_bend, ticks_per_row, report);
+            held_bend = l.bend[run.back()];
+        }
+        for (const auto& run : controllerRuns(l.modulation, grid, ch)) {
+            report.modulation_events += run.size();
+            int peak = 0;
+            for (int row : run) peak = std::max(peak, l.modulation[row]);
+            int depth = peak * 15 / 127;
+            if (depth == 0) continue;
+            l.values[LANE_VIBRATO][run.front()] = effectCell(0x4, (MODULATION_VIBRATO_SPEED << 4) | depth);
+            ++report.vibratos;
+        }
+    }
+    return report;
+}
+
+// --- Volume envelopes ---
+
+static constexpr int MIN_ENVELOPE_STEPS = 2;  // smaller ramps stay Cxx cells
+static constexpr int MIN_ENVELOPE_NOTES = 2;  // one-off shapes are not worth an instrument
+static constexpr double ENVELOPE_STEP_SECONDS = 1.0 / 64.0; // NRx2 pace unit
+
+EnvelopeFitReport fitVolumeEnvelopes(std::array<EffectLanes, UGE_NUM_CHANNELS>& lanes, const UgeRowGrid& grid, double seconds_per_row) {
+    EnvelopeFitReport report;
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        EffectLanes& l = lanes[ch];
+        const int rows = grid.total_rows;
+
+        // --- Held CC7 x CC11 level per row, on the 0-15 Cxx scale ---
+        std::pmr::vector<int> level(rows, grid.resource());
+        std::pmr::vector<bool> changed(rows, false, grid.resource());
+        int cc7 = 127, cc11 = 127;
+        for (int row = 0; row < rows; ++row) {
+            if (l.volume[row] != CONTROLLER_NONE) cc7 = l.volume[row];
+            if (l.expression[row] != CONTROLLER_NONE) cc11 = l.expression[row];
+            changed[row] = l.volume[row] != CONTROLLER_NONE || l.expression[row] != CONTROLLER_NONE;
+            level[row] = std::clamp(cc7 * cc11 / 127 * 15 / 127, 0, 15);
+        }
+
+        // --- Fit every note whose level ramps one way ---
+        std::vector<FittedEnvelope> fits;
+        std::map<VolumeEnvelope, int> uses;
+        for (int onset = 0; ch != 2 && onset < rows; ++onset) {
+            if (!isNoteOnset(grid, ch, onset)) continue;
+            int end = onset;
+            while (end + 1 < rows && grid.notes[ch][end + 1] == grid.notes[ch][onset] && !isNoteOnset(grid, ch, end + 1)) ++end;
+            int last_change = -1;
+            int dir = 0;
+            bool monotonic = true;
+            for (int row = onset + 1; row <= end; ++row) {
+                if (!changed[row]) continue;
+                int step = level[row] - level[row - 1];
+                int step_dir = (step > 0) - (step < 0);
+                if (step_dir != 0 && dir != 0 && step_dir != dir) monotonic = false;
+                if (step_dir != 0) dir = step_dir;
+                last_change = row;
+            }
+            if (!monotonic || last_change < 0) continue;
+            int steps = std::abs(level[last_change] - level[onset]);
+            // The hardware keeps ramping, so the ramp has to fill most of the note
+            if (steps < MIN_ENVELOPE_STEPS || (last_change - onset) * 2 < (end - onset)) continue;
+            FittedEnvelope fit;
+            fit.ch = ch;
+            fit.onset_row = onset;
+            fit.end_row = end;
+            fit.envelope.initial_volume = level[onset];
+            fit.envelope.sweep_dir = dir < 0 ? 1 : 0;
+            double seconds_per_step = (last_change - onset) * seconds_per_row / steps;
+            fit.envelope.sweep_amt = std::clamp((int)std::lround(seconds_per_step / ENVELOPE_STEP_SECONDS), 1, 7);
+            fits.push_back(fit);
+            ++uses[fit.envelope];
+        }
+        std::pmr::vector<bool> covered(rows, false, grid.resource());
+        for (const auto& fit : fits) {
+            if (uses[fit.envelope] < MIN_ENVELOPE_NOTES) continue;
+            for (int row = fit.onset_row; row <= fit.end_row; ++row) covered[row] = true;
+            report.notes.push_back(fit);
+        }
+
+        // --- Cxx cells for every level change outside the fitted notes ---
+        for (int row = 0; row < rows; ++row) {
+            if (!changed[row]) continue;
+            if (covered[row]) {
+                ++report.cells_removed;
+                continue;
+            }
+            l.values[LANE_VOLUME][row] = effectCell(0xC, level[row]);
+        }
+    }
+    return report;
+}
+
+// --- Thinning ---
+
+static int countCells(const std::array<EffectLanes, UGE_NUM_CHANNELS>& lanes) {
+    int cells = 0;
+    for (const auto& ch : lanes) {
+        const int rows = ch.values[0].size();
+        for (int row = 0; row < rows; ++row) {
+            for (const auto& lane : ch.values) {
+                if (lane[row] != EFFECT_NONE) {
+                    ++cells;
+                    break;
+                }
+            }
+        }
+    }
+    return cells;
+}
+
+// True when two cells are the same effect and their parameters are within tolerance
+static bool closeCells(int a, int b, int tolerance) {
+    return (a >> 8) == (b >> 8) && std::abs((a & 0xFF) - (b & 0xFF)) <= tolerance;
+}
+
+// onsets, when given, restart the deadband on every struck note: pitch effects
+// only act on the row they sit on, so a repeat on a new note is not redundant
+static void thinLane(std::pmr::vector<int>& lane, const std::pmr::vector<uint8_t>* onsets, int tolerance) {
+    // --- Deadband against the last kept value ---
+    int current = EFFECT_NONE;
+    for (int row = 0; row < (int)lane.size(); ++row) {
+        int& v = lane[row];
+        if (onsets && row < (int)onsets->size() && (*onsets)[row]) current = EFFECT_NONE;
+        if (v == EFFECT_NONE) continue;
+        if (current != EFFECT_NONE && closeCells(v, current, tolerance)) {
+            v = EFFECT_NONE;
+            continue;
+        }
+        current = v;
+    }
+    if (tolerance == 0) return;
+
+    // --- Collapse monotonic ramps to their endpoints ---
+    std::pmr::vector<int> rows(lane.get_allocator());
+    for (int row = 0; row < (int)lane.size(); ++row) {
+        if (lane[row] != EFFECT_NONE) rows.push_back(row);
+    }
+    size_t start = 0;
+    while (start < rows.size()) {
+        size_t end = start;
+        int dir = 0;
+        while (end + 1 < rows.size() && rows[end + 1] - rows[end] <= RAMP_MAX_GAP) {
+            if ((lane[rows[end + 1]] >> 8) != (lane[rows[end]] >> 8)) break;
+            int step = lane[rows[end + 1]] - lane[rows[end]];
+            int step_dir = (step > 0) - (step < 0);
+            if (dir != 0 && step_dir != dir) break;
+            dir = step_dir;
+            ++end;
+        }
+        for (size_t k = start + 1; k < end; ++k) lane[rows[k]] = EFFECT_NONE;
+        start = end + 1;
+    }
+}
+
+EffectThinningReport thinEffects(std::array<EffectLanes, UGE_NUM_CHANNELS>& lanes, const ChannelRows<uint8_t>& onsets, int tolerance) {
+    EffectThinningReport report;
+    report.cells_before = countCells(lanes);
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        for (int l = 0; l < NUM_EFFECT_LANES; ++l) {
+            // Cxx volume holds until changed, so only the pitch lanes restart per note
+            thinLane(lanes[ch].values[l], l == LANE_VOLUME ? nullptr : &onsets[ch], tolerance);
+        }
+    }
+    report.cells_after = countCells(lanes);
+    return report;
+}
+
+void applyEffectLanes(const std::array<EffectLanes, UGE_NUM_CHANNELS>& lanes, UgeRowGrid& grid) {
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        for (int row = 0; row < grid.total_rows; ++row) {
+            for (int l = 0; l < NUM_EFFECT_LANES; ++l) {
+                int v = lanes[ch].values[l][row];
+                if (v == EFFECT_NONE) continue;
+                grid.effects[ch][row] = v >> 8;
+                grid.effect_params[ch][row] = v & 0xFF;
+                break;
+            }
+        }
+    }
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include "patterns.h"
+#include <array>
+#include <climits>
+#include <cstdint>
+#include <tuple>
+#include <vector>
+
+// Continuous controllers that end up as row effects, highest priority first:
+// when several land on the same row only the first one is written.
+enum EffectLane { LANE_PITCH_BEND, LANE_VIBRATO, LANE_VOLUME, NUM_EFFECT_LANES };
+
+constexpr int EFFECT_NONE = -1;
+constexpr int CONTROLLER_NONE = INT_MIN;
+
+// Pitch bend range of a MIDI channel until RPN 0 sets another one (GM default)
+constexpr int DEFAULT_BEND_RANGE_CENTS = 200;
+// Bend lane units per semitone: a full-scale bend at the default range is -8192..8191
+constexpr int BEND_UNITS_PER_SEMITONE = 4096;
+
+// Bend lane value of a 14-bit pitch bend (-8192..8191) at a channel's bend range
+inline int bendLaneValue(int bend, int range_cents) {
+    return int((long long)bend * range_cents * BEND_UNITS_PER_SEMITONE / (100LL * 8192));
+}
+
+// Effect cell as stored in a lane: effect code in the high byte, parameter in the low byte
+inline int effectCell(uint8_t effect, uint8_t param) { return (effect << 8) | param; }
+
+// Effect cells per row and lane for one UGE channel (EFFECT_NONE where
+// nothing changes), plus the raw controller curves they are derived from
+struct EffectLanes {
+    explicit EffectLanes(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+    std::array<std::pmr::vector<int>, NUM_EFFECT_LANES> values;
+    std::pmr::vector<int> bend;       // last pitch bend within the row in BEND_UNITS_PER_SEMITONE, or CONTROLLER_NONE
+    std::pmr::vector<int> modulation; // last CC1 value within the row, 0..127, or CONTROLLER_NONE
+    std::pmr::vector<int> volume;     // last CC7 value within the row, 0..127, or CONTROLLER_NONE
+    std::pmr::vector<int> expression; // last CC11 value within the row, 0..127, or CONTROLLER_NONE
+
+    void resize(int rows);
+};
+
+struct PitchCurveReport {
+    int bend_events = 0;
+    int modulation_events = 0;
+    int vibratos = 0;        // 4xy from oscillating bend or modulation passages
+    int portamentos = 0;     // 1xx/2xx glides
+    int tone_portamentos = 0; // 3xx glides into the next note
+};
+
+// Turns the raw bend and modulation curves into pitch effects. Runs of
+// bend events are classified over their row window: an oscillating run
+// becomes one 4xy vibrato, anything else is split into monotonic glides
+// that become one 1xx/2xx each, or 3xx when the glide lands on the next
+// note. Speeds and depths are in Game Boy period units for the note
+// being bent. Modulation runs become one 4xy at their peak depth.
+PitchCurveReport analyzePitchCurves(std::array<EffectLanes, UGE_NUM_CHANNELS>& lanes, UgeRowGrid& grid, int ticks_per_row);
+
+// Hardware volume envelope (NRx2) of an instrument variant
+struct VolumeEnvelope {
+    int initial_volume = 15; // 0-15, relative to the instrument's own volume
+    int sweep_dir = 1;       // 1 = decrease
+    int sweep_amt = 0;       // envelope pace, 1-7
+
+    bool operator<(const VolumeEnvelope& o) const {
+        return std::tie(initial_volume, sweep_dir, sweep_amt) < std::tie(o.initial_volume, o.sweep_dir, o.sweep_amt);
+    }
+};
+
+struct FittedEnvelope {
+    int ch = 0;
+    int onset_row = 0;
+    int end_row = 0; // last row of the note
+    VolumeEnvelope envelope;
+};
+
+struct EnvelopeFitReport {
+    std::vector<FittedEnvelope> notes;
+    int cells_removed = 0;
+};
+
+// Builds the volume lane (Cxx) from the CC7 x CC11 level curve. Notes
+// during which the level ramps monotonically are fitted to a hardware
+// envelope instead; shapes shared by at least two notes on a channel are
+// returned so the caller can give those notes an instrument variant, and
+// no Cxx cells are written inside them. The wave channel has no envelope
+// and always keeps its Cxx cells.
+EnvelopeFitReport fitVolumeEnvelopes(std::array<EffectLanes, UGE_NUM_CHANNELS>& lanes, const UgeRowGrid& grid, double seconds_per_row);
+
+struct EffectThinningReport {
+    int cells_before = 0; // rows carrying an effect before thinning, all channels
+    int cells_after = 0;
+};
+
+// Removes controller changes that do not matter enough to cost a pattern cell:
+// - changes within tolerance of the last kept value on that lane
+// - the inner points of monotonic ramps (only the endpoints are kept)
+// A tolerance of 0 only drops repeats of the current value. Pitch and vibrato
+// cells are compared within a note only (onsets: 1 on struck rows).
+EffectThinningReport thinEffects(std::array<EffectLanes, UGE_NUM_CHANNELS>& lanes, const ChannelRows<uint8_t>& onsets, int tolerance);
+
+// Writes the lanes into grid.effects/effect_params, one effect per row by lane priority
+void applyEffectLanes(const std::array<EffectLanes, UGE_NUM_CHANNELS>& lanes, UgeRowGrid& grid);
@@ -0,0 +1,389 @@
+#include "hugedriver.h"
+#include "patterns.h"
+#include "profiler.h"
+#include "conversion_log.h"
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <fstream>
+#include <map>
+#include <unordered_set>
+
+// Everything except orders and patterns: descriptor, instrument tables,
+// enabled subpatterns and wavetable
+static HugeDriverSize fixedSize(const UgeSongHeader& header) {
+    HugeDriverSize size;
+    size.descriptor = HUGE_SONG_DESCRIPTOR_BYTES + HUGE_ORDER_CNT_BYTES;
+    size.instruments = (UGE_NUM_DUTY + UGE_NUM_WAVE + UGE_NUM_NOISE) * HUGE_INSTRUMENT_BYTES;
+    int subpatterns = 0;
+    for (const auto& inst : header.instruments.duty) subpatterns += inst.subpattern_enabled ? 1 : 0;
+    for (const auto& inst : header.instruments.wave) subpatterns += inst.subpattern_enabled ? 1 : 0;
+    for (const auto& inst : header.instruments.noise) subpatterns += inst.subpattern_enabled ? 1 : 0;
+    size.subpatterns = subpatterns * HUGE_SUBPATTERN_BYTES;
+    size.waves = UGE_NUM_WAVETABLE * HUGE_WAVE_BYTES;
+    return size;
+}
+
+int hugeOrderRows(const std::vector<UgePattern>& patterns, const UgeOrderMatrix& orders, size_t order) {
+    // A jump or break on any channel ends the order row for all of them
+    int rows = UGE_PATTERN_ROWS;
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        if (order >= orders[ch].size()) continue;
+        const UgePattern& pat = patterns[orders[ch][order]];
+        for (int row = 0; row < rows; ++row) {
+            uint8_t eff = pat.rows[row].effect;
+            if (eff == EFFECT_POSITION_JUMP || eff == EFFECT_PATTERN_BREAK) rows = row + 1;
+        }
+    }
+    return rows;
+}
+
+std::vector<int> hugePlayedRows(const std::vector<UgePattern>& patterns, const UgeOrderMatrix& orders) {
+    std::vector<int> played(patterns.size(), 0);
+    std::vector<bool> used(patterns.size(), false);
+    size_t num_orders = 0;
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) num_orders = std::max(num_orders, orders[ch].size());
+    for (size_t i = 0; i < num_orders; ++i) {
+        int rows = hugeOrderRows(patterns, orders, i);
+        for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+            if (i >= orders[ch].size()) continue;
+            uint32_t idx = orders[ch][i];
+            played[idx] = std::max(played[idx], rows);
+            used[idx] = true;
+        }
+    }
+    for (size_t p = 0; p < patterns.size(); ++p) {
+        if (!used[p]) played[p] = UGE_PATTERN_ROWS;
+    }
+    return played;
+}
+
+HugeDriverSize estimateHugeDriverSize(
+    const UgeSongHeader& header,
+    const std::vector<UgePattern>& patterns,
+    const UgeOrderMatrix& orders
+) {
+    HugeDriverSize size = fixedSize(header);
+    std::unordered_set<uint32_t> referenced;
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        size.orders += orders[ch].size() * HUGE_ORDER_ENTRY_BYTES;
+        for (uint32_t idx : orders[ch]) referenced.insert(idx);
+    }
+    std::vector<int> played = hugePlayedRows(patterns, orders);
+    size.num_patterns = referenced.size();
+    for (uint32_t idx : referenced) size.patterns += played[idx] * HUGE_ROW_BYTES;
+    return size;
+}
+
+int maxOrdersWithinBudget(
+    const UgeSongHeader& header,
+    const std::vector<UgePattern>& patterns,
+    const UgeOrderMatrix& orders,
+    size_t budget_bytes
+) {
+    size_t total = fixedSize(header).total();
+    size_t num_orders = 0;
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) num_orders = std::max(num_orders, orders[ch].size());
+    std::vector<int> played = hugePlayedRows(patterns, orders);
+    std::unordered_set<uint32_t> referenced;
+    int fits = 0;
+    for (size_t i = 0; i < num_orders; ++i) {
+        for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+            if (i >= orders[ch].size()) continue;
+            total += HUGE_ORDER_ENTRY_BYTES;
+            if (referenced.insert(orders[ch][i]).second) total += played[orders[ch][i]] * HUGE_ROW_BYTES;
+        }
+        if (total > budget_bytes) break;
+        fits = i + 1;
+    }
+    return fits;
+}
+
+void printHugeDriverSize(const HugeDriverSize& size, size_t budget_bytes) {
+    debugLog() << "[UGE DEBUG] hUGEDriver size: patterns " << size.patterns << " (" << size.num_patterns << " patterns)"
+               << ", orders " << size.orders
+               << ", instruments " << size.instruments
+               << ", subpatterns " << size.subpatterns
+               << ", waves " << size.waves
+               << ", routines " << size.routines
+               << ", descriptor " << size.descriptor
+               << ", total " << size.total() << " / " << budget_bytes << " bytes" << std::endl;
+}
+
+// --- hUGEDriver export ---
+
+namespace {
+
+// Register bytes of one instrument in hUGEDriver order; the subpattern pointer
+// sits between regs[2] and regs[3] for every instrument type
+using HugeInstrumentRegs = std::array<uint8_t, 5>;
+// Instrument table entries are pooled as the registers plus a 16-bit
+// subpattern pool id (0 = none)
+constexpr size_t INSTRUMENT_RECORD_BYTES = 7;
+
+uint8_t envelopeReg(uint8_t initial_volume, uint32_t sweep_dir, uint8_t sweep_change) {
+    // NR12/NR42: volume in the high nibble, bit 3 set for an increasing envelope
+    return ((initial_volume & 0x0F) << 4) | (sweep_dir == 0 ? 0x08 : 0x00) | (sweep_change & 0x07);
+}
+
+uint8_t lengthBits(uint8_t enabled, uint32_t length, uint32_t max_length) {
+    if (!enabled) return 0;
+    uint32_t len = std::max<uint32_t>(1, std::min(length, max_length));
+    return (max_length - len) & (max_length - 1);
+}
+
+HugeInstrumentRegs encodeDuty(const UgeDutyInstrument& inst) {
+    uint8_t sweep = ((inst.frequency_sweep_time & 0x07) << 4) | ((inst.frequency_sweep_direction & 0x01) << 3) | (inst.frequency_sweep_shift & 0x07);
+    uint8_t len_duty = ((inst.duty & 0x03) << 6) | lengthBits(inst.length_enabled, inst.length, 64);
+    uint8_t highmask = 0x80 | (inst.length_enabled ? 0x40 : 0x00);
+    return {sweep, len_duty, envelopeReg(inst.initial_volume, inst.volume_sweep_direction, inst.volume_sweep_change), highmask, 0};
+}
+
+HugeInstrumentRegs encodeWave(const UgeWaveInstrument& inst) {
+    uint8_t level = ugeWaveOutputLevel(inst.volume);
+    uint8_t highmask = 0x80 | (inst.length_enabled ? 0x40 : 0x00);
+    return {lengthBits(inst.length_enabled, inst.length, 256), uint8_t(level << 5), uint8_t(inst.wave_index), highmask, 0};
+}
+
+HugeInstrumentRegs encodeNoise(const UgeNoiseInstrument& inst) {
+    // highmask: bit 7 = 7-bit LFSR, bit 6 = length enabled, bits 0-5 = length
+    uint8_t highmask = (inst.noise_mode ? 0x80 : 0x00) | (inst.length_enabled ? 0x40 : 0x00) | lengthBits(inst.length_enabled, inst.length, 64);
+    return {envelopeReg(inst.initial_volume, inst.volume_sweep_direction, inst.volume_sweep_change), highmask, 0, 0, 0};
+}
+
+// Only the first rows rows are written; the driver never reads past a break.
+// The driver reads instrument nibble 0 as "keep the instrument" and N as
+// table entry N-1, so a note cell carries its 0-based slot plus one.
+std::vector<uint8_t> encodePattern(const UgePattern& pat, int rows) {
+    std::vector<uint8_t> bytes;
+    bytes.reserve(rows * HUGE_ROW_BYTES);
+    for (int i = 0; i < rows; ++i) {
+        const auto& row = pat.rows[i];
+        uint8_t instrument = row.note != UGE_EMPTY_NOTE ? ((row.instrument + 1) & 0x0F) : 0;
+        bytes.push_back(row.note);
+        bytes.push_back((instrument << 4) | (row.effect & 0x0F));
+        bytes.push_back(row.effect_param);
+    }
+    return bytes;
+}
+
+// Subpattern rows use the pattern cell layout with the jump in the instrument column
+std::vector<uint8_t> encodeSubpattern(const UgeSubpattern& subpattern) {
+    std::vector<uint8_t> bytes;
+    bytes.reserve(HUGE_SUBPATTERN_BYTES);
+    for (int i = 0; i < HUGE_SUBPATTERN_ROWS; ++i) {
+        const auto& row = subpattern[i];
+        bytes.push_back(row.note);
+        bytes.push_back(((row.jump & 0x0F) << 4) | (row.effect & 0x0F));
+        bytes.push_back(row.effect_param);
+    }
+    return bytes;
+}
+
+std::vector<uint8_t> encodeWaves(const UgeWavetable& waves) {
+    std::vector<uint8_t> bytes;
+    for (const auto& wave : waves) {
+        for (int i = 0; i < UGE_WAVETABLE_SIZE; i += 2) bytes.push_back(((wave[i] & 0x0F) << 4) | (wave[i + 1] & 0x0F));
+    }
+    return bytes;
+}
+
+// Interns byte blobs under sequential labels (prefix + index)
+class BlobPool {
+public:
+    explicit BlobPool(std::string prefix) : prefix(std::move(prefix)) {}
+    size_t add(const std::vector<uint8_t>& blob) {
+        auto it = index.find(blob);
+        if (it == index.end()) {
+            it = index.emplace(blob, labels.size()).first;
+            labels.push_back(prefix + std::to_string(labels.size()));
+            blobs.push_back(blob);
+        }
+        ++uses;
+        return it->second;
+    }
+    const std::string& intern(const std::vector<uint8_t>& blob) { return labels[add(blob)]; }
+    std::vector<std::string> labels;
+    std::vector<std::vector<uint8_t>> blobs;
+    size_t uses = 0;
+private:
+    std::string prefix;
+    std::map<std::vector<uint8_t>, size_t> index;
+};
+
+std::string hexByte(uint8_t b, HugeExportFormat format) {
+    static const char* digits = "0123456789ABCDEF";
+    std::string s = (format == HugeExportFormat::C) ? "0x" : "$";
+    s.push_back(digits[b >> 4]);
+    s.push_back(digits[b & 0x0F]);
+    return s;
+}
+
+void writeBytes(std::ofstream& out, const std::vector<uint8_t>& bytes, size_t per_line, HugeExportFormat format) {
+    for (size_t i = 0; i < bytes.size(); i += per_line) {
+        out << (format == HugeExportFormat::C ? "    " : "    db ");
+        for (size_t j = i; j < std::min(bytes.size(), i + per_line); ++j) {
+            out << hexByte(bytes[j], format);
+            if (format == HugeExportFormat::C || j + 1 < std::min(bytes.size(), i + per_line)) out << ",";
+        }
+        out << "\n";
+    }
+}
+
+} // namespace
+
+std::string hugeSymbolName(const std::string& path) {
+    size_t slash = path.find_last_of("/\\");
+    std::string base = (slash == std::string::npos) ? path : path.substr(slash + 1);
+    size_t dot = base.find_last_of('.');
+    if (dot != std::string::npos && dot > 0) base = base.substr(0, dot);
+    std::string sym;
+    for (char c : base) sym.push_back(std::isalnum(static_cast<unsigned char>(c)) ? c : '_');
+    if (sym.empty() || std::isdigit(static_cast<unsigned char>(sym[0]))) sym = "song_" + sym;
+    return sym;
+}
+
+bool writeHugeDriverExport(const std::string& path, const std::vector<HugeExportSong>& songs, HugeExportFormat format) {
+    PROFILE_SCOPE("export");
+    const bool c = (format == HugeExportFormat::C);
+    const std::string prefix = hugeSymbolName(path);
+
+    // --- Pool patterns, instrument tables and wavetables across all songs ---
+    BlobPool pattern_pool(prefix + "_P");
+    BlobPool duty_pool(prefix + "_duty_instruments_");
+    BlobPool wave_pool(prefix + "_wave_instruments_");
+    BlobPool noise_pool(prefix + "_noise_instruments_");
+    BlobPool waves_pool(prefix + "_waves_");
+    BlobPool subpattern_pool(prefix + "_SP");
+    struct SongLabels {
+        std::array<std::vector<std::string>, UGE_NUM_CHANNELS> orders;
+        std::string duty, wave, noise, waves;
+    };
+    std::vector<SongLabels> labels(songs.size());
+    for (size_t s = 0; s < songs.size(); ++s) {
+        const UgeSong& song = *songs[s].song;
+        std::vector<std::string> pattern_label(song.patterns.size());
+        std::vector<int> played = hugePlayedRows(song.patterns, song.orders);
+        for (size_t p = 0; p < song.patterns.size(); ++p) {
+            pattern_label[p] = pattern_pool.intern(encodePattern(song.patterns[p], played[p]));
+        }
+        for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+            for (uint32_t idx : song.orders[ch]) labels[s].orders[ch].push_back(pattern_label[idx]);
+        }
+        auto table = [&](const auto& bank, auto encode) {
+            std::vector<uint8_t> bytes;
+            for (const auto& inst : bank) {
+                HugeInstrumentRegs regs = encode(inst);
+                bytes.insert(bytes.end(), regs.begin(), regs.end());
+                size_t sp = inst.subpattern_enabled ? subpattern_pool.add(encodeSubpattern(inst.subpattern)) + 1 : 0;
+                bytes.push_back(sp & 0xFF);
+                bytes.push_back(sp >> 8);
+            }
+            return bytes;
+        };
+        labels[s].duty = duty_pool.intern(table(song.header.instruments.duty, encodeDuty));
+        labels[s].wave = wave_pool.intern(table(song.header.instruments.wave, encodeWave));
+        labels[s].noise = noise_pool.intern(table(song.header.instruments.noise, encodeNoise));
+        labels[s].waves = waves_pool.intern(encodeWaves(song.header.wavetable));
+    }
+    debugLog() << "[UGE DEBUG] hUGEDriver export: " << songs.size() << " songs, "
+               << pattern_pool.uses << " patterns pooled into " << pattern_pool.labels.size()
+               << ", " << duty_pool.uses + wave_pool.uses + noise_pool.uses << " instrument tables into "
+               << duty_pool.labels.size() + wave_pool.labels.size() + noise_pool.labels.size() << std::endl;
+
+    std::ofstream out(path, std::ios::trunc);
+    if (!out) return false;
+    const char* comment = c ? "//" : ";";
+    out << comment << " hUGEDriver song data generated by midi2uge (" << songs.size() << " songs)\n";
+    if (c) {
+        out << "#include \"hUGEDriver.h\"\n#include <stddef.h>\n\n";
+    } else {
+        out << "SECTION \"" << prefix << " song data\", ROMX\n\n";
+    }
+
+    // --- Patterns ---
+    for (size_t p = 0; p < pattern_pool.labels.size(); ++p) {
+        if (c) out << "static const unsigned char " << pattern_pool.labels[p] << "[] = {\n";
+        else out << pattern_pool.labels[p] << ":\n";
+        writeBytes(out, pattern_pool.blobs[p], HUGE_ROW_BYTES * 4, format);
+        out << (c ? "};\n\n" : "\n");
+    }
+
+    // --- Subpatterns ---
+    for (size_t p = 0; p < subpattern_pool.labels.size(); ++p) {
+        if (c) out << "static const unsigned char " << subpattern_pool.labels[p] << "[] = {\n";
+        else out << subpattern_pool.labels[p] << ":\n";
+        writeBytes(out, subpattern_pool.blobs[p], HUGE_ROW_BYTES * 4, format);
+        out << (c ? "};\n\n" : "\n");
+    }
+
+    // --- Instrument tables ---
+    auto writeInstruments = [&](BlobPool& pool, const char* c_type, bool noise) {
+        for (size_t t = 0; t < pool.labels.size(); ++t) {
+            const auto& bytes = pool.blobs[t];
+            if (c) out << "static const " << c_type << " " << pool.labels[t] << "[] = {\n";
+            else out << pool.labels[t] << ":\n";
+            for (size_t i = 0; i + INSTRUMENT_RECORD_BYTES <= bytes.size(); i += INSTRUMENT_RECORD_BYTES) {
+                size_t sp_id = bytes[i + 5] | (bytes[i + 6] << 8);
+                std::string sp = sp_id ? subpattern_pool.labels[sp_id - 1] : (c ? "NULL" : "0");
+                if (c && noise) {
+                    out << "    {" << hexByte(bytes[i], format) << ", " << sp << ", " << hexByte(bytes[i + 1], format) << ", 0, 0},\n";
+                } else if (c) {
+                    out << "    {" << hexByte(bytes[i], format) << ", " << hexByte(bytes[i + 1], format) << ", " << hexByte(bytes[i + 2], format)
+                        << ", " << sp << ", " << hexByte(bytes[i + 3], format) << "},\n";
+                } else if (noise) {
+                    out << "    db " << hexByte(bytes[i], format) << "\n    dw " << sp << "\n    db " << hexByte(bytes[i + 1], format) << ", 0, 0\n";
+                } else {
+                    out << "    db " << hexByte(bytes[i], format) << ", " << hexByte(bytes[i + 1], format) << ", " << hexByte(bytes[i + 2], format)
+                        << "\n    dw " << sp << "\n    db " << hexByte(bytes[i + 3], format) << "\n";
+                }
+            }
+            out << (c ? "};\n\n" : "\n");
+        }
+    };
+    writeInstruments(duty_pool, "hUGEDutyInstr_t", false);
+    writeInstruments(wave_pool, "hUGEWaveInstr_t", false);
+    writeInstruments(noise_pool, "hUGENoiseInstr_t", true);
+
+    // --- Wavetables ---
+    for (size_t w = 0; w < waves_pool.labels.size(); ++w) {
+        if (c) out << "static const unsigned char " << waves_pool.labels[w] << "[] = {\n";
+        else out << waves_pool.labels[w] << ":\n";
+        writeBytes(out, waves_pool.blobs[w], HUGE_WAVE_BYTES, format);
+        out << (c ? "};\n\n" : "\n");
+    }
+
+    // --- Song descriptors and order lists ---
+    for (size_t s = 0; s < songs.size(); ++s) {
+        const std::string& sym = songs[s].symbol;
+        const SongLabels& l = labels[s];
+        size_t num_orders = l.orders[0].size();
+        // order_cnt counts bytes of the pointer list, i.e. two per order
+        if (c) out << "static const unsigned char " << sym << "_order_cnt = " << num_orders * 2 << ";\n";
+        else out << sym << "_order_cnt: db " << num_orders * 2 << "\n";
+        for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+            if (c) out << "static const unsigned char* " << sym << "_order" << ch + 1 << "[] = {";
+            else out << sym << "_order" << ch + 1 << ": dw ";
+            for (size_t i = 0; i < l.orders[ch].size(); ++i) {
+                if (i) out << ", ";
+                out << l.orders[ch][i];
+            }
+            out << (c ? "};\n" : "\n");
+        }
+        int tempo = songs[s].song->header.ticks_per_row;
+        if (c) {
+            out << "const hUGESong_t " << sym << " = {" << tempo << ", &" << sym << "_order_cnt, "
+                << sym << "_order1, " << sym << "_order2, " << sym << "_order3, " << sym << "_order4, "
+                << l.duty << ", " << l.wave << ", " << l.noise << ", NULL, " << l.waves << "};\n\n";
+        } else {
+            out << sym << "::\n"
+                << "    db " << tempo << "\n"
+                << "    dw " << sym << "_order_cnt\n"
+                << "    dw " << sym << "_order1, " << sym << "_order2, " << sym << "_order3, " << sym << "_order4\n"
+                << "    dw " << l.duty << ", " << l.wave << ", " << l.noise << "\n"
+                << "    dw 0 ; routines\n"
+                << "    dw " << l.waves << "\n\n";
+        }
+    }
+    return static_cast<bool>(out);
+}
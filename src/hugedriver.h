@@ -0,0 +1,72 @@
+#pragma once
+#include "uge_writer.h"
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Byte layout of song data as hUGEDriver consumes it (hUGETracker's
+// C/RGBDS export for driver v6).
+constexpr int HUGE_SONG_DESCRIPTOR_BYTES = 21; // tempo, order_cnt ptr, 4 order ptrs, 3 instrument ptrs, routines ptr, waves ptr
+constexpr int HUGE_ORDER_CNT_BYTES = 1;
+constexpr int HUGE_ORDER_ENTRY_BYTES = 2;     // one pattern pointer per order per channel
+constexpr int HUGE_ROW_BYTES = 3;             // note, (instrument << 4) | effect, effect param
+constexpr int HUGE_PATTERN_BYTES = UGE_PATTERN_ROWS * HUGE_ROW_BYTES; // without a break
+constexpr int HUGE_INSTRUMENT_BYTES = 6;      // duty, wave and noise instruments share one size
+constexpr int HUGE_SUBPATTERN_ROWS = 32;
+constexpr int HUGE_SUBPATTERN_BYTES = HUGE_SUBPATTERN_ROWS * HUGE_ROW_BYTES;
+constexpr int HUGE_WAVE_BYTES = UGE_WAVETABLE_SIZE / 2; // two 4-bit samples per byte
+
+struct HugeDriverSize {
+    size_t descriptor = 0;
+    size_t orders = 0;
+    size_t patterns = 0;
+    size_t instruments = 0;
+    size_t subpatterns = 0;
+    size_t waves = 0;
+    size_t routines = 0;     // always 0: no routine calls (effect 6) are emitted, so the pointer is null
+    size_t num_patterns = 0; // unique patterns referenced by the orders
+    size_t total() const { return descriptor + orders + patterns + instruments + subpatterns + waves + routines; }
+};
+
+// Rows order row order plays before the next: up to the first jump or
+// break on any channel
+int hugeOrderRows(const std::vector<UgePattern>& patterns, const UgeOrderMatrix& orders, size_t order);
+
+// Rows of each pattern the driver can reach: up to the first jump or break
+// on any channel of the order rows using it (the most over all of them).
+// Rows after that are never read and are left out of the export.
+std::vector<int> hugePlayedRows(const std::vector<UgePattern>& patterns, const UgeOrderMatrix& orders);
+
+// Exported byte cost of a song. Only patterns referenced by the order matrix
+// are counted, as hUGETracker only exports those.
+HugeDriverSize estimateHugeDriverSize(
+    const UgeSongHeader& header,
+    const std::vector<UgePattern>& patterns,
+    const UgeOrderMatrix& orders
+);
+
+// Largest number of order rows (from the start of the song) whose exported
+// size fits in budget_bytes. Runs in one pass over the orders.
+int maxOrdersWithinBudget(
+    const UgeSongHeader& header,
+    const std::vector<UgePattern>& patterns,
+    const UgeOrderMatrix& orders,
+    size_t budget_bytes
+);
+
+void printHugeDriverSize(const HugeDriverSize& size, size_t budget_bytes);
+
+enum class HugeExportFormat { C, Asm };
+
+struct HugeExportSong {
+    std::string symbol; // identifier of the song descriptor
+    const UgeSong* song;
+};
+
+// C/assembly identifier derived from a file name ("music/Boss Theme.mid" -> "Boss_Theme")
+std::string hugeSymbolName(const std::string& path);
+
+// Writes hUGEDriver-ready data for one or more songs to a single C (GBDK) or
+// RGBDS assembly file. Identical patterns, instrument tables and wavetables
+// are emitted once and shared by every song that uses them.
+bool writeHugeDriverExport(const std::string& path, const std::vector<HugeExportSong>& songs, HugeExportFormat format);
@@ -0,0 +1,461 @@
+#include "instruments.h"
+#include "conversion_log.h"
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <map>
+
+// Signed envelope speed: 0 = flat, +7 = fastest rise, -7 = fastest fade
+static int envelopeSpeed(const InstrumentParams& p) {
+    if (p.sweep_amt == 0) return 0;
+    int speed = 8 - p.sweep_amt;
+    return p.sweep_dir ? -speed : speed;
+}
+
+// Rough perceptual distance between two instruments; noise mode and wave
+// shape change the timbre outright, so they weigh the most. Never 0 for two
+// different sounds, so no medoid ties with another one's parameters.
+static int paramDistance(const InstrumentParams& a, const InstrumentParams& b) {
+    int d = std::abs(a.volume - b.volume);
+    d += 2 * std::abs(envelopeSpeed(a) - envelopeSpeed(b));
+    d += 4 * std::abs(a.length_enabled - b.length_enabled);
+    d += std::abs(std::min(a.length, 256) - std::min(b.length, 256)) / 8;
+    d += 16 * std::abs(a.noise_mode - b.noise_mode);
+    d += 16 * (a.wave_index != b.wave_index);
+    d += 8 * (a.duty != b.duty);
+    d += 16 * (a.subpattern != b.subpattern);
+    return (d == 0 && !a.sameSound(b)) ? 1 : d;
+}
+
+std::vector<int> allocateInstrumentSlots(const std::vector<InstrumentParams>& candidates, int max_slots, std::vector<InstrumentParams>& slots) {
+    slots.clear();
+    std::vector<int> slot_of(candidates.size(), 0);
+    if (candidates.empty() || max_slots <= 0) return slot_of;
+
+    // --- Dedup identical parameter tuples ---
+    std::vector<InstrumentParams> unique;
+    std::vector<std::vector<int>> members; // unique index -> candidate indices
+    std::vector<int> unique_of(candidates.size());
+    for (size_t c = 0; c < candidates.size(); ++c) {
+        size_t u = 0;
+        while (u < unique.size() && !unique[u].sameSound(candidates[c])) ++u;
+        if (u == unique.size()) {
+            unique.push_back(candidates[c]);
+            unique.back().weight = 0;
+            members.emplace_back();
+        }
+        unique[u].weight += std::max(1, candidates[c].weight);
+        members[u].push_back(c);
+        unique_of[c] = u;
+    }
+    const int n = unique.size();
+
+    // --- Weighted k-medoids when there are more parameter sets than slots ---
+    std::vector<int> medoids;
+    std::vector<int> cluster_of(n);
+    if (n <= max_slots) {
+        for (int u = 0; u < n; ++u) {
+            medoids.push_back(u);
+            cluster_of[u] = u;
+        }
+    } else {
+        std::vector<std::vector<int>> dist(n, std::vector<int>(n));
+        for (int i = 0; i < n; ++i)
+            for (int j = 0; j < n; ++j) dist[i][j] = paramDistance(unique[i], unique[j]);
+        // BUILD: greedily add the medoid that lowers the total weighted distance most
+        std::vector<long> nearest(n, LONG_MAX);
+        for (int k = 0; k < max_slots; ++k) {
+            int best = -1;
+            long best_cost = LONG_MAX;
+            for (int cand = 0; cand < n; ++cand) {
+                if (std::find(medoids.begin(), medoids.end(), cand) != medoids.end()) continue;
+                long cost = 0;
+                for (int j = 0; j < n; ++j) cost += unique[j].weight * std::min<long>(nearest[j], dist[cand][j]);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best = cand;
+                }
+            }
+            medoids.push_back(best);
+            for (int j = 0; j < n; ++j) nearest[j] = std::min<long>(nearest[j], dist[best][j]);
+        }
+        // Alternate assignment and medoid update until stable. A medoid
+        // always stays in its own cluster, whatever ties with earlier ones.
+        for (int iter = 0; iter < 32; ++iter) {
+            for (int j = 0; j < n; ++j) {
+                int best = 0;
+                for (int k = 1; k < max_slots; ++k) {
+                    if (dist[medoids[k]][j] < dist[medoids[best]][j]) best = k;
+                }
+                cluster_of[j] = best;
+            }
+            for (int k = 0; k < max_slots; ++k) cluster_of[medoids[k]] = k;
+            bool changed = false;
+            for (int k = 0; k < max_slots; ++k) {
+                int best = medoids[k];
+                long best_cost = LONG_MAX;
+                for (int cand = 0; cand < n; ++cand) {
+                    if (cluster_of[cand] != k) continue;
+                    long cost = 0;
+                    for (int j = 0; j < n; ++j) {
+                        if (cluster_of[j] == k) cost += unique[j].weight * (long)dist[cand][j];
+                    }
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best = cand;
+                    }
+                }
+                if (best != medoids[k]) {
+                    medoids[k] = best;
+                    changed = true;
+                }
+            }
+            if (!changed) break;
+        }
+    }
+
+    // --- Number slots by first use so the table reads in song order ---
+    // Clusters left without a member get no slot
+    std::vector<int> first_use(medoids.size(), INT_MAX);
+    for (size_t c = 0; c < candidates.size(); ++c) {
+        int cl = cluster_of[unique_of[c]];
+        first_use[cl] = std::min<int>(first_use[cl], c);
+    }
+    std::vector<int> order;
+    for (int i = 0; i < (int)medoids.size(); ++i) {
+        if (first_use[i] != INT_MAX) order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return first_use[a] < first_use[b]; });
+    const int k = order.size();
+    std::vector<int> slot_of_cluster(medoids.size(), 0);
+    for (int s = 0; s < k; ++s) {
+        int cl = order[s];
+        slot_of_cluster[cl] = s;
+        InstrumentParams slot = unique[medoids[cl]];
+        slot.weight = 0;
+        int merged = 0;
+        for (int u = 0; u < n; ++u) {
+            if (cluster_of[u] != cl) continue;
+            slot.weight += unique[u].weight;
+            merged += members[u].size();
+        }
+        // Name the slot after its medoid's first program, noting how many others share it
+        slot.name = candidates[members[medoids[cl]][0]].name;
+        if (merged > 1) slot.name += " +" + std::to_string(merged - 1);
+        slots.push_back(slot);
+    }
+    for (size_t c = 0; c < candidates.size(); ++c) slot_of[c] = slot_of_cluster[cluster_of[unique_of[c]]];
+
+    debugLog() << "[UGE DEBUG] Instrument slots: " << candidates.size() << " candidates -> " << n << " unique parameter sets -> " << k << " slots" << std::endl;
+    return slot_of;
+}
+
+// --- Shared palette ---
+
+// Tick sequence of an enabled subpattern, without the trailing empty rows
+static std::vector<SubpatternTick> subpatternTicks(const UgeSubpattern& subpattern, uint8_t enabled) {
+    std::vector<SubpatternTick> ticks;
+    if (!enabled) return ticks;
+    for (const UgeSubpatternRow& row : subpattern) ticks.push_back({uint8_t(row.effect), row.effect_param, uint8_t(row.jump)});
+    while (!ticks.empty() && ticks.back() == SubpatternTick{}) ticks.pop_back();
+    return ticks;
+}
+
+static InstrumentParams paletteParams(const UgeDutyInstrument& inst) {
+    InstrumentParams p;
+    p.name = std::string(inst.name.data, inst.name.length);
+    p.volume = inst.initial_volume;
+    p.sweep_dir = inst.volume_sweep_direction;
+    p.sweep_amt = inst.volume_sweep_change;
+    p.length_enabled = inst.length_enabled;
+    p.length = inst.length;
+    p.duty = inst.duty;
+    p.subpattern = subpatternTicks(inst.subpattern, inst.subpattern_enabled);
+    return p;
+}
+
+static InstrumentParams paletteParams(const UgeWaveInstrument& inst) {
+    InstrumentParams p;
+    p.name = std::string(inst.name.data, inst.name.length);
+    p.volume = inst.volume;
+    p.sweep_dir = 0;
+    p.sweep_amt = 0;
+    p.length_enabled = inst.length_enabled;
+    p.length = inst.length;
+    p.wave_index = inst.wave_index;
+    p.subpattern = subpatternTicks(inst.subpattern, inst.subpattern_enabled);
+    return p;
+}
+
+static InstrumentParams paletteParams(const UgeNoiseInstrument& inst) {
+    InstrumentParams p;
+    p.name = std::string(inst.name.data, inst.name.length);
+    p.volume = inst.initial_volume;
+    p.sweep_dir = inst.volume_sweep_direction;
+    p.sweep_amt = inst.volume_sweep_change;
+    p.length_enabled = inst.length_enabled;
+    p.length = inst.length;
+    p.noise_mode = inst.noise_mode;
+    p.subpattern = subpatternTicks(inst.subpattern, inst.subpattern_enabled);
+    return p;
+}
+
+// Channel kind (0 = duty, 1 = wave, 2 = noise) of a UGE channel
+static int channelKind(int ch) { return ch == 3 ? 2 : (ch == 2 ? 1 : 0); }
+
+// Builds the palette for one instrument type. uses[s][i] counts the notes
+// song s plays with its instrument i; slot_of[s][i] receives the palette slot.
+template <typename Bank>
+static void sharePalette(const std::vector<UgeSong*>& songs, Bank UgeInstrumentCollection::*bank,
+                         const std::vector<std::vector<int>>& uses, std::vector<std::vector<int>>& slot_of,
+                         InstrumentPaletteReport& report, int type) {
+    using Instrument = typename Bank::value_type;
+    std::vector<InstrumentParams> candidates;
+    std::vector<const Instrument*> source;
+    std::vector<std::pair<size_t, int>> origin; // (song, instrument)
+    for (size_t s = 0; s < songs.size(); ++s) {
+        const Bank& instruments = songs[s]->header.instruments.*bank;
+        for (int i = 0; i < (int)instruments.size(); ++i) {
+            if (uses[s][i] == 0) continue;
+            candidates.push_back(paletteParams(instruments[i]));
+            candidates.back().weight = uses[s][i];
+            source.push_back(&instruments[i]);
+            origin.emplace_back(s, i);
+        }
+    }
+    std::vector<InstrumentParams> slots;
+    std::vector<int> slot_of_candidate = allocateInstrumentSlots(candidates, std::tuple_size<Bank>::value, slots);
+
+    // Each slot takes the exact registers and subpattern of an instrument it
+    // stands for, or of any member when none sounds the same. A slot without
+    // members is skipped and the later ones move up.
+    Bank palette;
+    std::vector<int> new_slot(slots.size(), -1);
+    std::vector<InstrumentParams> kept;
+    for (size_t k = 0; k < slots.size(); ++k) {
+        size_t member = candidates.size();
+        for (size_t c = 0; c < candidates.size(); ++c) {
+            if (slot_of_candidate[c] != (int)k) continue;
+            if (member == candidates.size()) member = c;
+            if (candidates[c].sameSound(slots[k])) {
+                member = c;
+                break;
+            }
+        }
+        if (member == candidates.size()) continue;
+        new_slot[k] = kept.size();
+        palette[kept.size()] = *source[member];
+        palette[kept.size()].name = make_shortstring(slots[k].name);
+        kept.push_back(slots[k]);
+    }
+    for (int& slot : slot_of_candidate) slot = new_slot[slot];
+    slots.swap(kept);
+
+    report.before[type] = candidates.size();
+    report.after[type] = slots.size();
+    // A note sounds different when its instrument was clustered with another one
+    for (size_t c = 0; c < candidates.size(); ++c) {
+        if (!candidates[c].sameSound(slots[slot_of_candidate[c]])) report.notes_changed += candidates[c].weight;
+    }
+
+    // Unused slots repeat the first one, so every song's table comes out identical
+    for (size_t k = slots.size(); k < palette.size(); ++k) {
+        palette[k] = slots.empty() ? (songs[0]->header.instruments.*bank)[k] : palette[0];
+        palette[k].name = make_shortstring("(unused)");
+    }
+    for (auto& table : slot_of) table.assign(palette.size(), 0);
+    for (size_t c = 0; c < candidates.size(); ++c) slot_of[origin[c].first][origin[c].second] = slot_of_candidate[c];
+    for (UgeSong* song : songs) song->header.instruments.*bank = palette;
+}
+
+InstrumentPaletteReport shareInstrumentPalette(const std::vector<UgeSong*>& songs) {
+    InstrumentPaletteReport report;
+    if (songs.empty()) return report;
+
+    // --- Give every pattern a single channel kind ---
+    // Instrument numbers mean different tables on duty, wave and noise channels
+    for (UgeSong* song : songs) {
+        std::vector<int> kind(song->patterns.size(), -1);
+        for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+            std::map<uint32_t, uint32_t> copies;
+            for (uint32_t& idx : song->orders[ch]) {
+                if (idx >= kind.size()) continue;
+                if (kind[idx] < 0) kind[idx] = channelKind(ch);
+                if (kind[idx] == channelKind(ch)) continue;
+                auto it = copies.find(idx);
+                if (it == copies.end()) {
+                    UgePattern copy = song->patterns[idx];
+                    copy.index = song->patterns.size();
+                    song->patterns.push_back(copy);
+                    kind.push_back(channelKind(ch));
+                    it = copies.emplace(idx, copy.index).first;
+                }
+                idx = it->second;
+            }
+        }
+    }
+
+    // --- Count the notes each song plays with each instrument ---
+    std::array<std::vector<std::vector<int>>, 3> uses;
+    for (auto& kind_uses : uses) kind_uses.assign(songs.size(), std::vector<int>(UGE_NUM_DUTY, 0)); // all three banks hold 15
+    for (size_t s = 0; s < songs.size(); ++s) {
+        const UgeSong& song = *songs[s];
+        for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+            for (uint32_t idx : song.orders[ch]) {
+                if (idx >= song.patterns.size()) continue;
+                for (const UgePatternRow& row : song.patterns[idx].rows) {
+                    if (row.note != UGE_EMPTY_NOTE && row.instrument < UGE_NUM_DUTY) uses[channelKind(ch)][s][row.instrument]++;
+                }
+            }
+        }
+    }
+
+    // --- One palette per instrument type ---
+    std::array<std::vector<std::vector<int>>, 3> slot_of;
+    for (auto& table : slot_of) table.resize(songs.size());
+    sharePalette(songs, &UgeInstrumentCollection::duty, uses[0], slot_of[0], report, 0);
+    bool same_waves = std::all_of(songs.begin(), songs.end(), [&](const UgeSong* song) { return song->header.wavetable == songs[0]->header.wavetable; });
+    if (same_waves) {
+        sharePalette(songs, &UgeInstrumentCollection::wave, uses[1], slot_of[1], report, 1);
+    } else {
+        warningLog() << "[UGE WARNING] Songs use different wavetables; wave instruments are not shared" << std::endl;
+        for (auto& table : slot_of[1]) {
+            table.resize(UGE_NUM_WAVE);
+            for (int i = 0; i < UGE_NUM_WAVE; ++i) table[i] = i;
+        }
+    }
+    sharePalette(songs, &UgeInstrumentCollection::noise, uses[2], slot_of[2], report, 2);
+
+    // --- Point the pattern cells at the palette ---
+    for (size_t s = 0; s < songs.size(); ++s) {
+        UgeSong& song = *songs[s];
+        std::vector<int> kind(song.patterns.size(), -1);
+        for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+            for (uint32_t idx : song.orders[ch]) {
+                if (idx < kind.size()) kind[idx] = channelKind(ch);
+            }
+        }
+        for (size_t p = 0; p < song.patterns.size(); ++p) {
+            if (kind[p] < 0) continue;
+            for (UgePatternRow& row : song.patterns[p].rows) {
+                if (row.note == UGE_EMPTY_NOTE || row.instrument >= UGE_NUM_DUTY) continue;
+                row.instrument = slot_of[kind[p]][s][row.instrument];
+            }
+        }
+    }
+    debugLog() << "[UGE DEBUG] Shared instrument palette over " << songs.size() << " songs: duty " << report.before[0] << " -> " << report.after[0]
+               << ", wave " << report.before[1] << " -> " << report.after[1] << ", noise " << report.before[2] << " -> " << report.after[2] << std::endl;
+    if (report.notes_changed > 0) {
+        warningLog() << "[UGE WARNING] More than 15 instruments of a type across the songs: " << report.notes_changed
+                     << " notes now play with a similar instrument" << std::endl;
+    }
+    return report;
+}
+
+// --- Subpatterns ---
+
+// Ticks a subpattern may use: the idle row that ends it jumps to itself,
+// and a subpattern row keeps its jump in the instrument nibble of the
+// hUGEDriver cell (see encodeSubpattern), so only ticks 1-15 can be named
+static constexpr int MAX_SUBPATTERN_TICKS = 15;
+static constexpr int MIN_SUBPATTERN_NOTES = 2;
+
+// Effects that shape a single note; jumps, breaks, cuts and speed changes stay in the pattern
+static bool isArticulation(uint8_t effect) {
+    return effect == 0x0 || effect == 0x1 || effect == 0x2 || effect == 0x4 || effect == 0x8 || effect == 0x9 || effect == 0xA || effect == 0xC;
+}
+
+// Effects that act on every tick of their row rather than once
+static bool isContinuous(uint8_t effect) {
+    return effect == 0x0 || effect == 0x1 || effect == 0x2 || effect == 0x4 || effect == 0xA;
+}
+
+struct RowEffect {
+    int offset;
+    uint8_t effect, param;
+    bool operator<(const RowEffect& o) const {
+        return offset != o.offset ? offset < o.offset : (effect != o.effect ? effect < o.effect : param < o.param);
+    }
+};
+
+// Spreads row effects over ticks. Continuous effects last their row, except
+// the last one, which keeps running for the rest of the note on the idle row.
+static bool toTicks(const std::vector<RowEffect>& cells, int ticks_per_row, std::vector<SubpatternTick>& ticks) {
+    ticks.clear();
+    for (size_t i = 0; i < cells.size(); ++i) {
+        int start = cells[i].offset * ticks_per_row;
+        bool last = i + 1 == cells.size();
+        int length = (isContinuous(cells[i].effect) && !last) ? ticks_per_row : 1;
+        if (start + length > MAX_SUBPATTERN_TICKS) return false;
+        if ((int)ticks.size() < start + length) ticks.resize(start + length);
+        for (int t = start; t < start + length; ++t) ticks[t] = {cells[i].effect, cells[i].param, 0};
+    }
+    // Idle on the last tick: a continuous effect keeps running, anything else
+    // gets an empty tick after it
+    if (!isContinuous(cells.back().effect)) {
+        if ((int)ticks.size() + 1 > MAX_SUBPATTERN_TICKS) return false;
+        ticks.emplace_back();
+    }
+    ticks.back().jump = ticks.size();
+    return true;
+}
+
+SubpatternReport extractSubpatterns(UgeRowGrid& grid, const ChannelRows<uint8_t>& onsets, int ticks_per_row) {
+    SubpatternReport report;
+    std::map<std::vector<SubpatternTick>, int> sequence_index; // shared by all channels
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        struct Candidate {
+            int onset, end;
+            std::vector<RowEffect> cells;
+        };
+        std::vector<Candidate> notes;
+        std::map<std::vector<RowEffect>, int> uses;
+        for (int row = 0; row < grid.total_rows; ++row) {
+            uint8_t note = grid.notes[ch][row];
+            if (note == UGE_EMPTY_NOTE) continue;
+            bool struck = onsets[ch][row] || row == 0 || grid.notes[ch][row - 1] != note;
+            if (!struck) continue;
+            int end = row;
+            while (end + 1 < grid.total_rows && grid.notes[ch][end + 1] == note && !onsets[ch][end + 1]) ++end;
+            Candidate c{row, end, {}};
+            bool eligible = true;
+            for (int r = row; r <= end && eligible; ++r) {
+                uint8_t eff = grid.effects[ch][r];
+                uint8_t param = grid.effect_params[ch][r];
+                if (eff == 0 && param == 0) continue;
+                eligible = isArticulation(eff);
+                c.cells.push_back({r - row, eff, param});
+            }
+            if (!eligible || c.cells.empty()) continue;
+            ++uses[c.cells];
+            notes.push_back(std::move(c));
+        }
+        std::map<std::vector<RowEffect>, int> sequence_of;
+        for (const Candidate& c : notes) {
+            if (uses[c.cells] < MIN_SUBPATTERN_NOTES) continue;
+            auto it = sequence_of.find(c.cells);
+            if (it == sequence_of.end()) {
+                std::vector<SubpatternTick> ticks;
+                if (!toTicks(c.cells, ticks_per_row, ticks)) {
+                    uses[c.cells] = 0; // too long for a subpattern, skip the other notes quickly
+                    continue;
+                }
+                auto seq = sequence_index.find(ticks);
+                if (seq == sequence_index.end()) {
+                    report.sequences.push_back(ticks);
+                    seq = sequence_index.emplace(ticks, (int)report.sequences.size() - 1).first;
+                }
+                it = sequence_of.emplace(c.cells, seq->second).first;
+            }
+            for (const RowEffect& cell : c.cells) {
+                grid.effects[ch][c.onset + cell.offset] = 0;
+                grid.effect_params[ch][c.onset + cell.offset] = 0;
+                ++report.cells_moved;
+            }
+            report.notes.push_back({ch, c.onset, c.end, it->second});
+        }
+    }
+    debugLog() << "[UGE DEBUG] Subpatterns: " << report.sequences.size() << " recurring note articulations, "
+               << report.notes.size() << " notes, " << report.cells_moved << " effect cells moved out of patterns" << std::endl;
+    return report;
+}
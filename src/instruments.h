@@ -0,0 +1,81 @@
+#pragma once
+#include "patterns.h"
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// One tick of an instrument subpattern
+struct SubpatternTick {
+    uint8_t effect = 0;
+    uint8_t param = 0;
+    uint8_t jump = 0; // 1-based tick to continue at, 0 = next tick
+
+    bool operator==(const SubpatternTick& o) const { return effect == o.effect && param == o.param && jump == o.jump; }
+    bool operator<(const SubpatternTick& o) const {
+        return effect != o.effect ? effect < o.effect : (param != o.param ? param < o.param : jump < o.jump);
+    }
+};
+
+// Parameters of one converted instrument before it is given a UGE slot.
+// Fields that do not apply to an instrument type are left at 0.
+struct InstrumentParams {
+    std::string name;
+    int volume = 15;         // initial volume (duty/noise) or volume (wave), 0-15
+    int sweep_dir = 1;       // 1 = decrease
+    int sweep_amt = 4;       // envelope pace, 0-7
+    int length_enabled = 0;
+    int length = 0;
+    int noise_mode = 0;      // 0 = 15-bit, 1 = 7-bit
+    int wave_index = 0;
+    int duty = 0;            // duty cycle 0-3; only set when instruments from several songs are compared
+    std::vector<SubpatternTick> subpattern; // empty = no subpattern
+    int weight = 1;          // notes played with this instrument
+
+    bool sameSound(const InstrumentParams& o) const {
+        return volume == o.volume && sweep_dir == o.sweep_dir && sweep_amt == o.sweep_amt &&
+               length_enabled == o.length_enabled && length == o.length &&
+               noise_mode == o.noise_mode && wave_index == o.wave_index && duty == o.duty && subpattern == o.subpattern;
+    }
+};
+
+// Assigns every candidate instrument to one of at most max_slots slots.
+// Candidates with identical parameters share a slot; if more distinct sets
+// remain than there are slots, they are clustered with weighted k-medoids.
+// slots receives the parameters of each slot (the cluster medoid) and the
+// return value maps candidate index -> slot.
+std::vector<int> allocateInstrumentSlots(const std::vector<InstrumentParams>& candidates, int max_slots, std::vector<InstrumentParams>& slots);
+
+struct InstrumentPaletteReport {
+    std::array<int, 3> before{}; // duty, wave, noise: instruments in use over all songs
+    std::array<int, 3> after{};  // palette slots
+    int notes_changed = 0;       // note cells now played with a merged instrument
+};
+
+// Gives every song the same instrument tables: the instruments the songs
+// play (per type, over all songs) are deduplicated and, past 15 per type,
+// clustered into one shared palette, and each song's pattern cells are
+// rewritten to the palette slots. Wave instruments are only shared when the
+// songs have the same wavetable. The songs are changed in place.
+InstrumentPaletteReport shareInstrumentPalette(const std::vector<UgeSong*>& songs);
+
+struct SubpatternNote {
+    int ch = 0;
+    int onset_row = 0;
+    int end_row = 0; // last row of the note
+    int sequence = 0; // index into SubpatternReport::sequences
+};
+
+struct SubpatternReport {
+    std::vector<std::vector<SubpatternTick>> sequences;
+    std::vector<SubpatternNote> notes;
+    int cells_moved = 0;
+};
+
+// Finds per-note effect sequences (the effect cells from a note's start
+// row to its end, relative to the start) that recur on at least two notes
+// of a channel, converts each to a tick-rate subpattern and clears those
+// cells from the grid. The caller gives the listed notes an instrument
+// variant carrying the subpattern. Works on the held-note grid; onsets
+// marks the rows where a note is struck.
+SubpatternReport extractSubpatterns(UgeRowGrid& grid, const ChannelRows<uint8_t>& onsets, int ticks_per_row);
@@ -0,0 +1,365 @@
+#include "json_io.h"
+#include "conversion_log.h"
+#include "profiler.h"
+#include "MidiFile.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+
+// --- Base64 ---
+
+static const char BASE64_CHARS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+std::string base64Encode(const std::string& bytes) {
+    std::string out;
+    out.reserve((bytes.size() + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 2 < bytes.size(); i += 3) {
+        uint32_t v = uint8_t(bytes[i]) << 16 | uint8_t(bytes[i + 1]) << 8 | uint8_t(bytes[i + 2]);
+        for (int shift = 18; shift >= 0; shift -= 6) out += BASE64_CHARS[(v >> shift) & 63];
+    }
+    if (i < bytes.size()) {
+        uint32_t v = uint8_t(bytes[i]) << 16 | (i + 1 < bytes.size() ? uint8_t(bytes[i + 1]) << 8 : 0);
+        out += BASE64_CHARS[(v >> 18) & 63];
+        out += BASE64_CHARS[(v >> 12) & 63];
+        out += i + 1 < bytes.size() ? BASE64_CHARS[(v >> 6) & 63] : '=';
+        out += '=';
+    }
+    return out;
+}
+
+bool base64Decode(const std::string& text, std::string& bytes) {
+    bytes.clear();
+    uint32_t v = 0;
+    int bits = 0;
+    for (char c : text) {
+        if (c == '=') break;
+        const char* at = std::strchr(BASE64_CHARS, c);
+        if (!at || c == '\0') return false;
+        v = v << 6 | uint32_t(at - BASE64_CHARS);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            bytes += char((v >> bits) & 0xFF);
+        }
+    }
+    return true;
+}
+
+// --- UGE ---
+
+// Helpers to read little-endian values; reading past the end throws, so a
+// truncated file fails instead of decoding garbage
+static void read_bytes(std::istream& in, char* out, std::streamsize n) {
+    in.read(out, n);
+    if (in.gcount() != n) throw std::runtime_error("UGE file is truncated");
+}
+static uint32_t read_u32(std::istream& in) {
+    uint8_t b[4]; read_bytes(in, (char*)b, 4);
+    return b[0] | (b[1]<<8) | (b[2]<<16) | (b[3]<<24);
+}
+static uint8_t read_u8(std::istream& in) {
+    uint8_t b; read_bytes(in, (char*)&b, 1); return b;
+}
+static std::string read_shortstring(std::istream& in) {
+    uint8_t len = read_u8(in);
+    char buf[255]; read_bytes(in, buf, 255);
+    return std::string(buf, buf + len);
+}
+static void skip_bytes(std::istream& in, std::streamoff n) {
+    in.seekg(n, std::ios::cur);
+    if (!in) throw std::runtime_error("UGE file is truncated");
+}
+static uint64_t bytes_left(std::istream& in) {
+    std::streampos at = in.tellg();
+    in.seekg(0, std::ios::end);
+    std::streampos end = in.tellg();
+    in.seekg(at);
+    return end > at ? uint64_t(end - at) : 0;
+}
+// A count of entries, checked against what is left of the file so a damaged
+// count cannot make us loop or allocate far past its end
+static uint32_t read_count(std::istream& in, uint64_t entry_size, const char* what) {
+    uint32_t count = read_u32(in);
+    if (count * entry_size > bytes_left(in)) {
+        throw std::runtime_error("UGE file is truncated: " + std::to_string(count) + " " + what + " do not fit in the rest of the file");
+    }
+    return count;
+}
+
+json parse_uge(std::istream& in) {
+    PROFILE_SCOPE("parse_uge");
+    json root;
+    // Header
+    root["header"]["version"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+    root["header"]["name"] = { {"size", 256}, {"type", "shortstring"}, {"value", read_shortstring(in)} };
+    root["header"]["artist"] = { {"size", 256}, {"type", "shortstring"}, {"value", read_shortstring(in)} };
+    root["header"]["comment"] = { {"size", 256}, {"type", "shortstring"}, {"value", read_shortstring(in)} };
+    // Duty instruments
+    json duty_arr = json::array();
+    for (int i = 0; i < 15; ++i) {
+        json inst;
+        inst["type"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["name"] = { {"size", 256}, {"type", "shortstring"}, {"value", read_shortstring(in)} };
+        inst["length"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["length_enabled"] = { {"size", 1}, {"type", "uint8"}, {"value", read_u8(in)} };
+        inst["initial_volume"] = { {"size", 1}, {"type", "uint8"}, {"value", read_u8(in)} };
+        inst["volume_sweep_direction"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["volume_sweep_change"] = { {"size", 1}, {"type", "uint8"}, {"value", read_u8(in)} };
+        inst["frequency_sweep_time"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["frequency_sweep_direction"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["frequency_sweep_shift"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["duty"] = { {"size", 1}, {"type", "uint8"}, {"value", read_u8(in)} };
+        inst["unused1"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["unused2"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["unused3"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["subpattern_enabled"] = { {"size", 1}, {"type", "uint8"}, {"value", read_u8(in)} };
+        // Skip subpattern block for now
+        skip_bytes(in, 64 * 17);
+        duty_arr.push_back(inst);
+    }
+    root["duty_instruments"] = duty_arr;
+    // Wave instruments
+    json wave_arr = json::array();
+    for (int i = 0; i < 15; ++i) {
+        json inst;
+        inst["type"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["name"] = { {"size", 256}, {"type", "shortstring"}, {"value", read_shortstring(in)} };
+        inst["length"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["length_enabled"] = { {"size", 1}, {"type", "uint8"}, {"value", read_u8(in)} };
+        inst["unused1"] = { {"size", 1}, {"type", "uint8"}, {"value", read_u8(in)} };
+        inst["unused2"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["unused3"] = { {"size", 1}, {"type", "uint8"}, {"value", read_u8(in)} };
+        inst["unused4"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["unused5"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["unused6"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["unused7"] = { {"size", 1}, {"type", "uint8"}, {"value", read_u8(in)} };
+        inst["volume"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["wave_index"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["unused8"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["unused9"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["subpattern_enabled"] = { {"size", 1}, {"type", "uint8"}, {"value", read_u8(in)} };
+        skip_bytes(in, 64 * 17);
+        wave_arr.push_back(inst);
+    }
+    root["wave_instruments"] = wave_arr;
+    // Noise instruments
+    json noise_arr = json::array();
+    for (int i = 0; i < 15; ++i) {
+        json inst;
+        inst["type"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["name"] = { {"size", 256}, {"type", "shortstring"}, {"value", read_shortstring(in)} };
+        inst["length"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["length_enabled"] = { {"size", 1}, {"type", "uint8"}, {"value", read_u8(in)} };
+        inst["initial_volume"] = { {"size", 1}, {"type", "uint8"}, {"value", read_u8(in)} };
+        inst["volume_sweep_direction"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["volume_sweep_change"] = { {"size", 1}, {"type", "uint8"}, {"value", read_u8(in)} };
+        inst["unused1"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["unused2"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["unused3"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["unused4"] = { {"size", 1}, {"type", "uint8"}, {"value", read_u8(in)} };
+        inst["unused5"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["unused6"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["noise_mode"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
+        inst["subpattern_enabled"] = { {"size", 1}, {"type", "uint8"}, {"value", read_u8(in)} };
+        skip_bytes(in, 64 * 17);
+        noise_arr.push_back(inst);
+    }
+    root["noise_instruments"] = noise_arr;
+    // Wavetable
+    json wavetable_arr = json::array();
+    for (int i = 0; i < 16; ++i) {
+        json wave = json::array();
+        for (int j = 0; j < 32; ++j) {
+            wave.push_back(read_u8(in));
+        }
+        wavetable_arr.push_back(wave);
+    }
+    root["wavetable"] = wavetable_arr;
+    // TEMP PATCH: Seek to patterns offset for this file
+    in.seekg(0xf882, std::ios::beg);
+    if (!in) throw std::runtime_error("UGE file is truncated");
+    // Patterns
+    debugLog() << "[uge2json debug] File pointer before reading num_patterns: 0x" << hexString(std::streamoff(in.tellg())) << std::endl;
+    const uint64_t pattern_size = 4 + 64 * 17; // index, then 64 rows
+    uint32_t num_patterns = read_count(in, pattern_size, "patterns");
+    debugLog() << "[uge2json debug] num_patterns read: " << num_patterns << std::endl;
+    debugLog() << "[uge2json debug] File pointer after reading num_patterns: 0x" << hexString(std::streamoff(in.tellg())) << std::endl;
+    json patterns_arr = json::array();
+    for (uint32_t p = 0; p < num_patterns; ++p) {
+        json pat;
+        pat["index"] = read_u32(in);
+        json rows = json::array();
+        for (int r = 0; r < 64; ++r) {
+            json row;
+            row["note"] = read_u32(in);
+            row["instrument"] = read_u32(in);
+            row["unused"] = read_u32(in);
+            row["effect"] = read_u32(in);
+            row["effect_param"] = read_u8(in);
+            rows.push_back(row);
+        }
+        pat["rows"] = rows;
+        patterns_arr.push_back(pat);
+    }
+    root["patterns"] = patterns_arr;
+    // Order matrix
+    json orders_arr = json::array();
+    for (int ch = 0; ch < 4; ++ch) {
+        uint32_t len = read_count(in, 4, "order entries");
+        json order = json::array();
+        for (uint32_t i = 0; i < len; ++i) order.push_back(read_u32(in));
+        orders_arr.push_back(order);
+    }
+    root["orders"] = orders_arr;
+    // Routines
+    json routines_arr = json::array();
+    for (int i = 0; i < 16; ++i) {
+        uint32_t len = read_count(in, 1, "routine bytes");
+        std::string s(len, '\0');
+        if (len) read_bytes(in, &s[0], len);
+        // Encode as base64 to avoid invalid UTF-8
+        routines_arr.push_back(base64Encode(s));
+    }
+    root["routines"] = routines_arr;
+    return root;
+}
+
+// --- MIDI ---
+
+json midi_to_json(smf::MidiFile& midi) {
+    PROFILE_SCOPE("midi_to_json");
+    midi.doTimeAnalysis();
+    midi.linkNotePairs();
+    json j;
+    j["header"]["format"] = (midi.getTrackCount() == 1 ? 0 : 1);
+    j["header"]["tracks"] = midi.getTrackCount();
+    j["header"]["ticks_per_quarter"] = midi.getTicksPerQuarterNote();
+    // Track events
+    for (int t = 0; t < midi.getTrackCount(); ++t) {
+        json track_events = json::array();
+        for (int e = 0; e < midi[t].size(); ++e) {
+            const auto& ev = midi[t][e];
+            json jev;
+            jev["tick"] = ev.tick;
+            if (ev.isNoteOn()) {
+                jev["type"] = "note_on";
+                jev["channel"] = ev.getChannel();
+                jev["note"] = ev.getKeyNumber();
+                jev["velocity"] = ev.getVelocity();
+            } else if (ev.isNoteOff()) {
+                jev["type"] = "note_off";
+                jev["channel"] = ev.getChannel();
+                jev["note"] = ev.getKeyNumber();
+                jev["velocity"] = ev.getVelocity();
+            } else if (ev.isTimbre()) {
+                jev["type"] = "program_change";
+                jev["channel"] = ev.getChannel();
+                jev["program"] = ev.getP1();
+            } else if (ev.isMeta()) {
+                jev["type"] = "meta";
+                jev["meta_type"] = ev.getMetaType();
+                if (ev.getMetaType() == 0x03) {
+                    jev["text"] = ev.getMetaContent();
+                }
+                if (ev.getMetaType() == 0x51) {
+                    jev["tempo_us_per_quarter"] = ev.getTempoMicro();
+                }
+            } else {
+                jev["type"] = "other";
+            }
+            track_events.push_back(jev);
+        }
+        j["tracks"][t] = track_events;
+    }
+    // Notes per program and percussion
+    std::map<int, std::vector<json>> program_notes;
+    std::vector<json> percussion_notes;
+    for (int t = 0; t < midi.getTrackCount(); ++t) {
+        for (int e = 0; e < midi[t].size(); ++e) {
+            const auto& ev = midi[t][e];
+            if (ev.isNoteOn()) {
+                int ch = ev.getChannel();
+                int note = ev.getKeyNumber();
+                int vel = ev.getVelocity();
+                int start_tick = ev.tick;
+                int end_tick = -1;
+                // Find matching note off
+                for (int f = e + 1; f < midi[t].size(); ++f) {
+                    const auto& ev2 = midi[t][f];
+                    if ((ev2.isNoteOff() || (ev2.isNoteOn() && ev2.getVelocity() == 0)) && ev2.getKeyNumber() == note && ev2.getChannel() == ch) {
+                        end_tick = ev2.tick;
+                        break;
+                    }
+                }
+                json note_obj = {
+                    {"note", note},
+                    {"start_tick", start_tick},
+                    {"end_tick", end_tick},
+                    {"velocity", vel},
+                    {"track", t},
+                    {"channel", ch}
+                };
+                if (ch == 9) {
+                    percussion_notes.push_back(note_obj);
+                } else {
+                    // Find program for this channel up to this event
+                    int prog = 0;
+                    for (int f = e; f >= 0; --f) {
+                        const auto& ev2 = midi[t][f];
+                        if (ev2.isTimbre() && ev2.getChannel() == ch) {
+                            prog = ev2.getP1();
+                            break;
+                        }
+                    }
+                    program_notes[prog].push_back(note_obj);
+                }
+            }
+        }
+    }
+    for (const auto& kv : program_notes) {
+        j["programs"][kv.first] = kv.second;
+    }
+    j["percussion"] = percussion_notes;
+    return j;
+}
+
+// --- Conversion options and stats ---
+
+void applyOptionsJson(const json& j, ConversionOptions& options) {
+    if (j.contains("map")) {
+        std::array<int, 4> mapping = {-1, -1, -1, -1};
+        for (size_t i = 0; i < 4 && i < j["map"].size(); ++i) mapping[i] = j["map"][i].get<int>();
+        options.channel_map = mapping;
+    }
+    if (j.contains("budget")) options.rom_budget_bytes = j["budget"].get<size_t>();
+    if (j.contains("truncate")) options.fit_to_budget = !j["truncate"].get<bool>();
+    if (j.contains("effect_tolerance")) options.effect_tolerance = std::max(0, j["effect_tolerance"].get<int>());
+    if (j.contains("pattern_rows")) {
+        int rows = j["pattern_rows"].get<int>();
+        if (rows != 0 && rows != 16 && rows != 32 && rows != 48 && rows != 64) {
+            throw std::invalid_argument("pattern_rows must be 16, 32, 48, 64 or 0 (auto)");
+        }
+        options.pattern_rows = rows;
+    }
+    if (j.contains("rows_per_quarter")) options.rows_per_quarter = std::max(0, j["rows_per_quarter"].get<int>());
+    if (j.contains("onset_tolerance_ms")) options.onset_tolerance_ms = std::max(0.0, j["onset_tolerance_ms"].get<double>());
+    if (j.contains("max_timing_error_ms")) options.max_timing_error_ms = std::max(0.0, j["max_timing_error_ms"].get<double>());
+    if (j.contains("fixed_speed")) options.speed_sections = !j["fixed_speed"].get<bool>();
+    if (j.contains("split")) options.split_to_fit = j["split"].get<bool>();
+}
+
+json statsJson(const ConversionStats& stats) {
+    return {
+        {"ticks_per_quarter", stats.ticks_per_quarter}, {"rows_per_quarter", stats.rows_per_quarter},
+        {"ticks_per_row", stats.ticks_per_row}, {"rows", stats.rows}, {"seconds", stats.seconds},
+        {"parts", stats.parts}, {"patterns", stats.patterns}, {"orders", stats.orders},
+        {"driver_bytes", stats.driver_bytes},
+    };
+}
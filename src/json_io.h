@@ -0,0 +1,29 @@
+#pragma once
+#include "midi2uge.h"
+#include "nlohmann_json.hpp"
+#include <istream>
+#include <string>
+
+namespace smf {
+class MidiFile;
+}
+
+// Field-by-field dump of a UGE v6 file, as uge2json writes it
+nlohmann::json parse_uge(std::istream& in);
+
+// Track events, and notes grouped by program and percussion, as midi2json
+// writes them. midi must have been read.
+nlohmann::json midi_to_json(smf::MidiFile& midi);
+
+// Applies conversion options given as JSON, with keys named after the
+// command-line flags (map, budget, truncate, effect_tolerance, pattern_rows,
+// rows_per_quarter, onset_tolerance_ms, max_timing_error_ms, fixed_speed,
+// split); 0 means auto for the row counts. Throws on values of the wrong
+// type or out of range.
+void applyOptionsJson(const nlohmann::json& j, ConversionOptions& options);
+
+nlohmann::json statsJson(const ConversionStats& stats);
+
+std::string base64Encode(const std::string& bytes);
+// False when text holds characters outside the base64 alphabet
+bool base64Decode(const std::string& text, std::string& bytes);
@@ -0,0 +1,153 @@
+#include "libmidi2uge.h"
+#include "midi2uge.h"
+#include "json_io.h"
+#include "profiler.h"
+#include "MidiFile.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+struct midi2uge_context {
+    ConversionContext conversion;
+    std::string error;
+    std::string warnings;
+};
+
+namespace {
+
+int fail(midi2uge_context* ctx, const std::string& error) {
+    ctx->error = error.empty() ? "failed" : error;
+    return -1;
+}
+
+// Copies data into a malloc'd buffer the caller frees with midi2uge_free
+void* copyOut(const std::string& data, bool terminate) {
+    void* out = std::malloc(data.size() + (terminate ? 1 : 0));
+    if (!out) return nullptr;
+    std::memcpy(out, data.data(), data.size());
+    if (terminate) static_cast<char*>(out)[data.size()] = '\0';
+    return out;
+}
+
+std::string dumpJson(const nlohmann::json& j, int indent) {
+    PROFILE_SCOPE("write json");
+    return j.dump(indent < 0 ? -1 : indent);
+}
+
+} // namespace
+
+extern "C" {
+
+int midi2uge_api_version(void) { return MIDI2UGE_API_VERSION; }
+
+midi2uge_context* midi2uge_context_new(void) {
+    try {
+        midi2uge_context* ctx = new midi2uge_context;
+        ctx->conversion.log.debug = nullptr;
+        return ctx;
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void midi2uge_context_free(midi2uge_context* ctx) { delete ctx; }
+
+int midi2uge_convert(midi2uge_context* ctx, const void* midi, size_t midi_size, const char* options_json,
+                     void** uge, size_t* uge_size) {
+    if (!ctx) return -1;
+    if (!midi || !uge || !uge_size) return fail(ctx, "midi, uge and uge_size must not be NULL");
+    ctx->error.clear();
+    ctx->warnings.clear();
+    *uge = nullptr;
+    *uge_size = 0;
+    try {
+        ConversionContext& conversion = ctx->conversion;
+        conversion.options = ConversionOptions();
+        if (options_json && *options_json) applyOptionsJson(nlohmann::json::parse(options_json), conversion.options);
+        conversion.options.split_to_fit = false;
+
+        std::ostringstream warnings;
+        conversion.log.warning = &warnings;
+        ConversionLogScope log(conversion.log);
+        std::istringstream in(std::string(static_cast<const char*>(midi), midi_size), std::ios::binary);
+        std::vector<SongPart> parts;
+        bool converted = convertMidiToUgeParts(in, "<buffer>", parts, conversion);
+        conversion.log.warning = nullptr;
+        ctx->warnings = warnings.str();
+        if (!converted) {
+            std::string last = ctx->warnings.substr(0, ctx->warnings.find_last_not_of('\n') + 1);
+            return fail(ctx, last.substr(last.find_last_of('\n') + 1));
+        }
+
+        std::string data;
+        {
+            PROFILE_SCOPE("write");
+            data = ugeBytes(parts[0].song);
+        }
+        *uge = copyOut(data, false);
+        if (!*uge) return fail(ctx, "out of memory");
+        *uge_size = data.size();
+        return 0;
+    } catch (const std::exception& e) {
+        ctx->conversion.log.warning = nullptr;
+        return fail(ctx, e.what());
+    }
+}
+
+int midi2uge_uge_to_json(midi2uge_context* ctx, const void* uge, size_t uge_size, int indent, char** json) {
+    if (!ctx) return -1;
+    if (!uge || !json) return fail(ctx, "uge and json must not be NULL");
+    ctx->error.clear();
+    *json = nullptr;
+    try {
+        std::istringstream in(std::string(static_cast<const char*>(uge), uge_size), std::ios::binary);
+        ConversionLogScope log(ctx->conversion.log);
+        *json = static_cast<char*>(copyOut(dumpJson(parse_uge(in), indent), true));
+        return *json ? 0 : fail(ctx, "out of memory");
+    } catch (const std::exception& e) {
+        return fail(ctx, e.what());
+    }
+}
+
+int midi2uge_midi_to_json(midi2uge_context* ctx, const void* midi, size_t midi_size, int indent, char** json) {
+    if (!ctx) return -1;
+    if (!midi || !json) return fail(ctx, "midi and json must not be NULL");
+    ctx->error.clear();
+    *json = nullptr;
+    try {
+        std::istringstream in(std::string(static_cast<const char*>(midi), midi_size), std::ios::binary);
+        smf::MidiFile file;
+        if (!file.read(in)) return fail(ctx, "not a readable MIDI file");
+        *json = static_cast<char*>(copyOut(dumpJson(midi_to_json(file), indent), true));
+        return *json ? 0 : fail(ctx, "out of memory");
+    } catch (const std::exception& e) {
+        return fail(ctx, e.what());
+    }
+}
+
+void midi2uge_free(void* data) { std::free(data); }
+
+const char* midi2uge_last_error(const midi2uge_context* ctx) { return ctx ? ctx->error.c_str() : "no context"; }
+
+const char* midi2uge_warnings(const midi2uge_context* ctx) { return ctx ? ctx->warnings.c_str() : ""; }
+
+int midi2uge_get_stats(const midi2uge_context* ctx, midi2uge_stats* stats) {
+    if (!ctx || !stats || stats->struct_size < sizeof(uint32_t)) return -1;
+    const ConversionStats& s = ctx->conversion.stats;
+    midi2uge_stats full;
+    full.struct_size = stats->struct_size;
+    full.ticks_per_quarter = s.ticks_per_quarter;
+    full.rows_per_quarter = s.rows_per_quarter;
+    full.ticks_per_row = s.ticks_per_row;
+    full.rows = s.rows;
+    full.seconds = s.seconds;
+    full.patterns = s.patterns;
+    full.orders = s.orders;
+    full.driver_bytes = s.driver_bytes;
+    // A caller built against an older header gets the fields it knows
+    std::memcpy(stats, &full, std::min<size_t>(stats->struct_size, sizeof(full)));
+    return 0;
+}
+
+} // extern "C"
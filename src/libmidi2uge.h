@@ -0,0 +1,89 @@
+#pragma once
+/* C interface of libmidi2uge, for embedding the converter in other
+ * languages' processes (Python ctypes/cffi, Node N-API, ...).
+ *
+ * All data goes in and out as buffers. Results are allocated by the
+ * library and released with midi2uge_free. Functions return 0 on success
+ * and -1 on failure, with the reason in midi2uge_last_error.
+ *
+ * A context holds one conversion's state and keeps its scratch memory for
+ * the next; use it from one thread at a time. Calls on different contexts
+ * may run concurrently.
+ *
+ * The ABI only grows: functions and stats fields are added, never changed
+ * or removed. MIDI2UGE_API_VERSION counts the additions. */
+#include <stddef.h>
+#include <stdint.h>
+
+/* What the shared library exports: these functions and nothing else.
+ * Define MIDI2UGE_STATIC when the library's sources are compiled into
+ * the program itself. */
+#if defined(MIDI2UGE_STATIC)
+#define MIDI2UGE_API
+#elif defined(_WIN32)
+#ifdef MIDI2UGE_BUILDING
+#define MIDI2UGE_API __declspec(dllexport)
+#else
+#define MIDI2UGE_API __declspec(dllimport)
+#endif
+#else
+#define MIDI2UGE_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MIDI2UGE_API_VERSION 1
+
+typedef struct midi2uge_context midi2uge_context;
+
+/* Figures of the last conversion. Set struct_size to sizeof(midi2uge_stats)
+ * before calling midi2uge_get_stats; a library older than the caller's
+ * header fills in only the fields it knows. */
+typedef struct midi2uge_stats {
+    uint32_t struct_size;
+    int32_t ticks_per_quarter; /* of the MIDI file */
+    int32_t rows_per_quarter;
+    int32_t ticks_per_row;
+    int32_t rows;
+    double seconds;
+    int32_t patterns;
+    int32_t orders;            /* per channel */
+    uint64_t driver_bytes;     /* hUGEDriver data, as estimated for the budget */
+} midi2uge_stats;
+
+/* MIDI2UGE_API_VERSION of the library actually loaded */
+MIDI2UGE_API int midi2uge_api_version(void);
+
+MIDI2UGE_API midi2uge_context* midi2uge_context_new(void);
+MIDI2UGE_API void midi2uge_context_free(midi2uge_context* ctx);
+
+/* Converts a Standard MIDI File to a UGE v6 file. options_json may be NULL
+ * or a JSON object with the keys of the --serve "options" (map, budget,
+ * truncate, effect_tolerance, pattern_rows, rows_per_quarter,
+ * onset_tolerance_ms, max_timing_error_ms, fixed_speed). Splitting is not
+ * available here: a song over the budget is reduced as without --split. */
+MIDI2UGE_API int midi2uge_convert(midi2uge_context* ctx, const void* midi, size_t midi_size, const char* options_json,
+                                  void** uge, size_t* uge_size);
+
+/* The JSON documents of uge2json and midi2json, NUL-terminated;
+ * indent < 0 gives the compact form */
+MIDI2UGE_API int midi2uge_uge_to_json(midi2uge_context* ctx, const void* uge, size_t uge_size, int indent, char** json);
+MIDI2UGE_API int midi2uge_midi_to_json(midi2uge_context* ctx, const void* midi, size_t midi_size, int indent, char** json);
+
+/* Releases a result of the functions above; NULL is ignored */
+MIDI2UGE_API void midi2uge_free(void* data);
+
+/* Why the last call on ctx failed, "" after a success. Valid until the
+ * next call on ctx. */
+MIDI2UGE_API const char* midi2uge_last_error(const midi2uge_context* ctx);
+
+/* The [UGE WARNING] lines of the last conversion, one per line */
+MIDI2UGE_API const char* midi2uge_warnings(const midi2uge_context* ctx);
+
+MIDI2UGE_API int midi2uge_get_stats(const midi2uge_context* ctx, midi2uge_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,173 +1,55 @@
 #include "midi2uge.h"
+#include "libmidi2uge.h"
+#include "hugedriver.h"
+#include "instruments.h"
+#include "profiler.h"
+#include "server.h"
+#include "stream_io.h"
 #include <iostream>
 #include <string>
 #include <fstream>
-#include <iomanip>
-#include "nlohmann_json.hpp"
 #include "uge_writer.h"
-#include "third_party/midifile/include/MidiFile.h"
-#include <map>
 #include <vector>
 #include <sstream>
 #include <optional>
 #include <array>
+#include <algorithm>
 
-using json = nlohmann::json;
-
-// Helper to read little-endian values (for uge2json logic)
-uint32_t read_u32(std::ifstream& in) {
-    uint8_t b[4]; in.read((char*)b, 4);
-    return b[0] | (b[1]<<8) | (b[2]<<16) | (b[3]<<24);
-}
-uint8_t read_u8(std::ifstream& in) {
-    uint8_t b; in.read((char*)&b, 1); return b;
-}
-std::string read_shortstring(std::ifstream& in) {
-    uint8_t len = read_u8(in);
-    char buf[255]; in.read(buf, 255);
-    return std::string(buf, buf + len);
-}
-
-json parse_uge(const std::string& path) {
-    std::ifstream in(path, std::ios::binary);
-    if (!in) throw std::runtime_error("Cannot open file");
-    json root;
-    // Header
-    root["header"]["version"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
-    root["header"]["name"] = { {"size", 256}, {"type", "shortstring"}, {"value", read_shortstring(in)} };
-    root["header"]["artist"] = { {"size", 256}, {"type", "shortstring"}, {"value", read_shortstring(in)} };
-    root["header"]["comment"] = { {"size", 256}, {"type", "shortstring"}, {"value", read_shortstring(in)} };
-    // Duty instruments
-    json duty_arr = json::array();
-    for (int i = 0; i < 15; ++i) {
-        json inst;
-        inst["type"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
-        inst["name"] = { {"size", 256}, {"type", "shortstring"}, {"value", read_shortstring(in)} };
-        inst["length"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
-        inst["length_enabled"] = { {"size", 1}, {"type", "uint8"}, {"value", read_u8(in)} };
-        inst["initial_volume"] = { {"size", 1}, {"type", "uint8"}, {"value", read_u8(in)} };
-        inst["volume_sweep_direction"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
-        inst["volume_sweep_change"] = { {"size", 1}, {"type", "uint8"}, {"value", read_u8(in)} };
-        inst["frequency_sweep_time"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
-        inst["frequency_sweep_direction"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
-        inst["frequency_sweep_shift"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
-        inst["duty"] = { {"size", 1}, {"type", "uint8"}, {"value", read_u8(in)} };
-        inst["unused1"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
-        inst["unused2"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
-        inst["unused3"] = { {"size", 4}, {"type", "uint32"}, {"value", read_u32(in)} };
-        inst["subpattern_enabled"] = { {"size", 1}, {"type", "uint8"}, {"value", read_u8(in)} };
-        in.seekg(64 * 17, std::ios::cur);
-        duty_arr.push_back(inst);
-    }
-    root["duty_instruments"] = duty_arr;
-    // TODO: Parse wave, noise, wavetable, patterns, orders, routines
-    return root;
+// Runs MIDI or UGE data through one of the library's JSON dumps; text is
+// the JSON or, on failure, the error
+static bool dataToJson(const std::string& name, const std::string& data, int (*dump)(midi2uge_context*, const void*, size_t, int, char**),
+                       int indent, std::string& text) {
+    ProfileFileScope profile_file(name);
+    midi2uge_context* ctx = midi2uge_context_new();
+    char* json = nullptr;
+    bool ok = dump(ctx, data.data(), data.size(), indent, &json) == 0;
+    text = ok ? json : midi2uge_last_error(ctx);
+    midi2uge_free(json);
+    midi2uge_context_free(ctx);
+    return ok;
 }
 
-json midi_to_json(const std::string& midi_path) {
-    smf::MidiFile midi;
-    if (!midi.read(midi_path)) {
-        throw std::runtime_error("Failed to read MIDI file: " + midi_path);
-    }
-    midi.doTimeAnalysis();
-    midi.linkNotePairs();
-    json j;
-    j["header"]["format"] = (midi.getTrackCount() == 1 ? 0 : 1);
-    j["header"]["tracks"] = midi.getTrackCount();
-    j["header"]["ticks_per_quarter"] = midi.getTicksPerQuarterNote();
-    for (int t = 0; t < midi.getTrackCount(); ++t) {
-        json track_events = json::array();
-        for (int e = 0; e < midi[t].size(); ++e) {
-            const auto& ev = midi[t][e];
-            json jev;
-            jev["tick"] = ev.tick;
-            if (ev.isNoteOn()) {
-                jev["type"] = "note_on";
-                jev["channel"] = ev.getChannel();
-                jev["note"] = ev.getKeyNumber();
-                jev["velocity"] = ev.getVelocity();
-            } else if (ev.isNoteOff()) {
-                jev["type"] = "note_off";
-                jev["channel"] = ev.getChannel();
-                jev["note"] = ev.getKeyNumber();
-                jev["velocity"] = ev.getVelocity();
-            } else if (ev.isTimbre()) {
-                jev["type"] = "program_change";
-                jev["channel"] = ev.getChannel();
-                jev["program"] = ev.getP1();
-            } else if (ev.isMeta()) {
-                jev["type"] = "meta";
-                jev["meta_type"] = ev.getMetaType();
-                if (ev.getMetaType() == 0x03) {
-                    jev["text"] = ev.getMetaContent();
-                }
-                if (ev.getMetaType() == 0x51) {
-                    jev["tempo_us_per_quarter"] = ev.getTempoMicro();
-                }
-            } else {
-                jev["type"] = "other";
-            }
-            track_events.push_back(jev);
-        }
-        j["tracks"][t] = track_events;
-    }
-    std::map<int, std::vector<json>> program_notes;
-    std::vector<json> percussion_notes;
-    for (int t = 0; t < midi.getTrackCount(); ++t) {
-        for (int e = 0; e < midi[t].size(); ++e) {
-            const auto& ev = midi[t][e];
-            if (ev.isNoteOn()) {
-                int ch = ev.getChannel();
-                int note = ev.getKeyNumber();
-                int vel = ev.getVelocity();
-                int start_tick = ev.tick;
-                int end_tick = -1;
-                for (int f = e + 1; f < midi[t].size(); ++f) {
-                    const auto& ev2 = midi[t][f];
-                    if ((ev2.isNoteOff() || (ev2.isNoteOn() && ev2.getVelocity() == 0)) && ev2.getKeyNumber() == note && ev2.getChannel() == ch) {
-                        end_tick = ev2.tick;
-                        break;
-                    }
-                }
-                json note_obj = {
-                    {"note", note},
-                    {"start_tick", start_tick},
-                    {"end_tick", end_tick},
-                    {"velocity", vel},
-                    {"track", t},
-                    {"channel", ch}
-                };
-                if (ch == 9) {
-                    percussion_notes.push_back(note_obj);
-                } else {
-                    int prog = 0;
-                    for (int f = e; f >= 0; --f) {
-                        const auto& ev2 = midi[t][f];
-                        if (ev2.isTimbre() && ev2.getChannel() == ch) {
-                            prog = ev2.getP1();
-                            break;
-                        }
-                    }
-                    program_notes[prog].push_back(note_obj);
-                }
-            }
-        }
-    }
-    for (const auto& kv : program_notes) {
-        j["programs"][kv.first] = kv.second;
-    }
-    j["percussion"] = percussion_notes;
-    return j;
+static bool endsWith(const std::string& s, const std::string& suffix) {
+    return s.size() > suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
 }
 
 int main(int argc, char* argv[]) {
     std::string midiPath, ugePath;
-    std::optional<std::array<int, 4>> user_channel_map = std::nullopt;
+    std::vector<std::string> extraInputs; // further -i files, only used with --export
+    std::optional<HugeExportFormat> exportFormat;
+    std::optional<OutputFormat> format;
+    bool sharedInstruments = false;
+    bool serve = false;
+    ServerOptions server;
+    ConversionOptions options;
+    ProfileOutput profileOutput; // printed/written when main returns
     // Parse flags
     for (int i = 1; i < argc; ++i) {
+        if (parseProfileFlag(argc, argv, i, profileOutput)) continue;
         std::string arg = argv[i];
         if ((arg == "-i" || arg == "--input") && i+1 < argc) {
-            midiPath = argv[++i];
+            if (midiPath.empty()) midiPath = argv[++i];
+            else extraInputs.push_back(argv[++i]);
         } else if ((arg == "-o" || arg == "--output") && i+1 < argc) {
             ugePath = argv[++i];
         } else if ((arg == "-m" || arg == "--map") && i+1 < argc) {
@@ -184,57 +66,266 @@ int main(int argc, char* argv[]) {
                 }
                 ++idx;
             }
-            user_channel_map = mapping;
+            options.channel_map = mapping;
+        } else if (arg == "--budget" && i+1 < argc) {
+            try {
+                options.rom_budget_bytes = std::stoul(argv[++i], nullptr, 0);
+            } catch (...) {
+                std::cerr << "Invalid --budget value: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--effect-tolerance" && i+1 < argc) {
+            try {
+                options.effect_tolerance = std::max(0, std::stoi(argv[++i]));
+            } catch (...) {
+                std::cerr << "Invalid --effect-tolerance value: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--pattern-rows" && i+1 < argc) {
+            std::string rows = argv[++i];
+            if (rows == "auto") options.pattern_rows = 0;
+            else if (rows == "16" || rows == "32" || rows == "48" || rows == "64") options.pattern_rows = std::stoi(rows);
+            else {
+                std::cerr << "Invalid --pattern-rows value: " << rows << " (expected 16, 32, 48, 64 or auto)" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--rows-per-quarter" && i+1 < argc) {
+            std::string rows = argv[++i];
+            try {
+                options.rows_per_quarter = rows == "auto" ? 0 : std::max(1, std::stoi(rows));
+            } catch (...) {
+                std::cerr << "Invalid --rows-per-quarter value: " << rows << std::endl;
+                return 1;
+            }
+        } else if (arg == "--onset-tolerance" && i+1 < argc) {
+            try {
+                options.onset_tolerance_ms = std::max(0.0, std::stod(argv[++i]));
+            } catch (...) {
+                std::cerr << "Invalid --onset-tolerance value: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--max-timing-error" && i+1 < argc) {
+            try {
+                options.max_timing_error_ms = std::max(0.0, std::stod(argv[++i]));
+            } catch (...) {
+                std::cerr << "Invalid --max-timing-error value: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--fixed-speed") {
+            options.speed_sections = false;
+        } else if (arg == "--split") {
+            options.split_to_fit = true;
+        } else if (arg == "--shared-instruments") {
+            sharedInstruments = true;
+        } else if (arg == "--serve") {
+            serve = true;
+        } else if (arg == "--socket" && i+1 < argc) {
+            server.socket_path = argv[++i];
+        } else if (arg == "--workers" && i+1 < argc) {
+            try {
+                server.workers = std::max(0, std::stoi(argv[++i]));
+            } catch (...) {
+                std::cerr << "Invalid --workers value: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--truncate") {
+            options.fit_to_budget = false;
+        } else if (arg == "--format" && i+1 < argc) {
+            OutputFormat fmt;
+            if (!parseOutputFormat(argv[++i], fmt)) {
+                std::cerr << "Invalid --format value: " << argv[i] << " (expected uge, json or json-compact)" << std::endl;
+                return 1;
+            }
+            format = fmt;
+        } else if (arg == "--export" && i+1 < argc) {
+            std::string fmt = argv[++i];
+            if (fmt == "c") exportFormat = HugeExportFormat::C;
+            else if (fmt == "asm") exportFormat = HugeExportFormat::Asm;
+            else {
+                std::cerr << "Invalid --export format: " << fmt << " (expected c or asm)" << std::endl;
+                return 1;
+            }
         }
     }
+    // Conversion daemon: requests as JSON lines (see server.h)
+    if (serve) {
+        server.defaults = options;
+        return runServer(server);
+    }
     // Fallback to positional arguments for backward compatibility
     if (midiPath.empty() && ugePath.empty() && argc == 3) {
         midiPath = argv[1];
         ugePath = argv[2];
     }
-    // If input is .mid and output is .json or missing, call midi_to_json
-    if (!midiPath.empty() && midiPath.size() >= 4 && midiPath.substr(midiPath.size() - 4) == ".mid" &&
-        (ugePath.empty() || (ugePath.size() >= 5 && ugePath.substr(ugePath.size() - 5) == ".json"))) {
-        std::string outpath = ugePath.empty() ? midiPath + ".json" : ugePath;
-        try {
-            json j = midi_to_json(midiPath);
-            std::ofstream ofs(outpath);
-            ofs << j.dump(2);
-            std::cout << "Wrote " << outpath << std::endl;
-        } catch (const std::exception& e) {
-            std::cerr << e.what() << std::endl;
+    // MIDI to hUGEDriver source mode: every input becomes one song in a shared file
+    if (exportFormat) {
+        if (midiPath.empty()) {
+            std::cerr << "--export needs at least one -i <input.mid>" << std::endl;
             return 1;
         }
-        return 0;
-    }
-    // UGE to JSON mode
-    if (!midiPath.empty() && midiPath.size() > 4 && midiPath.substr(midiPath.size()-4) == ".uge") {
+        // Symbols are named after the files, so stdin and stdout have no place here
+        if (isStdStream(midiPath) || isStdStream(ugePath) || std::any_of(extraInputs.begin(), extraInputs.end(), isStdStream)) {
+            std::cerr << "--export reads and writes named files only" << std::endl;
+            return 1;
+        }
+        std::vector<std::string> inputs = {midiPath};
+        inputs.insert(inputs.end(), extraInputs.begin(), extraInputs.end());
         std::string outPath = ugePath;
-        if (ugePath.empty()) outPath = midiPath + ".json";
-        if (!outPath.empty() && outPath.size() > 5 && outPath.substr(outPath.size()-5) == ".json") {
-            try {
-                json j = parse_uge(midiPath);
-                std::ofstream out(outPath);
-                out << std::setw(2) << j << std::endl;
-                std::cout << "Wrote " << outPath << std::endl;
-            } catch (const std::exception& e) {
-                std::cerr << "Error: " << e.what() << std::endl;
+        if (outPath.empty()) {
+            size_t dot = midiPath.find_last_of('.');
+            outPath = midiPath.substr(0, dot) + (*exportFormat == HugeExportFormat::C ? ".c" : ".asm");
+        }
+        std::vector<std::vector<SongPart>> songs(inputs.size());
+        std::vector<HugeExportSong> exports;
+        std::vector<SplitManifestSong> manifest;
+        bool split = false;
+        ConversionContext context(options); // its arena is reused from file to file
+        for (size_t n = 0; n < inputs.size(); ++n) {
+            if (!convertMidiToUgeParts(inputs[n], songs[n], context)) {
+                std::cerr << "Failed to convert " << inputs[n] << std::endl;
+                return 1;
+            }
+            // The same file name in two directories must not clash in the linker
+            std::string symbol = hugeSymbolName(inputs[n]);
+            int suffix = 1;
+            auto taken = [&](const std::string& sym) {
+                return std::any_of(exports.begin(), exports.end(), [&](const HugeExportSong& e) {
+                    return e.symbol == sym || e.symbol.rfind(sym + "_part", 0) == 0;
+                });
+            };
+            while (taken(suffix == 1 ? symbol : symbol + "_" + std::to_string(suffix))) ++suffix;
+            if (suffix > 1) symbol += "_" + std::to_string(suffix);
+            // A split song becomes one song per part: <symbol>_part1, _part2, ...
+            manifest.push_back({inputs[n], &songs[n], {}});
+            for (size_t p = 0; p < songs[n].size(); ++p) {
+                std::string part_symbol = songs[n].size() > 1 ? symbol + "_part" + std::to_string(p + 1) : symbol;
+                exports.push_back({part_symbol, &songs[n][p].song});
+                manifest.back().names.push_back(part_symbol);
+            }
+            split = split || songs[n].size() > 1;
+        }
+        if (sharedInstruments) {
+            std::vector<UgeSong*> palette_songs;
+            for (auto& parts : songs) {
+                for (SongPart& part : parts) palette_songs.push_back(&part.song);
+            }
+            shareInstrumentPalette(palette_songs);
+        }
+        if (!writeHugeDriverExport(outPath, exports, *exportFormat)) {
+            std::cerr << "Failed to write " << outPath << std::endl;
+            return 1;
+        }
+        std::cout << "Wrote " << outPath << std::endl;
+        if (split) {
+            std::string manifest_path = splitManifestPath(outPath);
+            if (!writeSplitManifest(manifest_path, manifest, "symbol", options.rom_budget_bytes)) {
+                std::cerr << "Failed to write " << manifest_path << std::endl;
                 return 1;
             }
-            return 0;
+            std::cout << "Wrote " << manifest_path << std::endl;
         }
+        return 0;
+    }
+    // Stdin is read up front: without an extension, UGE data is told from
+    // MIDI by its first word, the format version (6 at most) where MIDI has "MThd"
+    const bool fromStdin = isStdStream(midiPath);
+    if (fromStdin && ugePath.empty()) ugePath = "-";
+    std::string input;
+    if (fromStdin && !readInput(midiPath, input)) {
+        std::cerr << "Failed to read stdin" << std::endl;
+        return 1;
+    }
+    const bool ugeInput = fromStdin ? input.size() >= 4 && static_cast<unsigned char>(input[0]) <= 6 && input.compare(1, 3, std::string(3, '\0')) == 0
+                                    : endsWith(midiPath, ".uge");
+    // --format, or else JSON for a .uge input, a .json output or a .mid input without one
+    OutputFormat outFormat = OutputFormat::Uge;
+    if (format) outFormat = *format;
+    else if (ugeInput || endsWith(ugePath, ".json") || (ugePath.empty() && endsWith(midiPath, ".mid"))) outFormat = OutputFormat::Json;
+    // MIDI or UGE to JSON mode
+    if (!midiPath.empty() && outFormat != OutputFormat::Uge) {
+        std::string outPath = ugePath.empty() ? midiPath + ".json" : ugePath;
+        if (!fromStdin && !readInput(midiPath, input)) {
+            std::cerr << (ugeInput ? "Error: Cannot open file" : "Failed to read MIDI file: " + midiPath) << std::endl;
+            return 1;
+        }
+        std::string text;
+        if (!dataToJson(midiPath, input, ugeInput ? midi2uge_uge_to_json : midi2uge_midi_to_json, jsonIndent(outFormat), text)) {
+            if (ugeInput) std::cerr << "Error: " << text << std::endl;
+            else std::cerr << "Failed to read MIDI file: " << midiPath << std::endl;
+            return 1;
+        }
+        if (ugeInput) text += "\n";
+        if (!writeOutput(outPath, text)) {
+            std::cerr << "Failed to write " << outPath << std::endl;
+            return 1;
+        }
+        if (!isStdStream(outPath)) std::cout << "Wrote " << outPath << std::endl;
+        return 0;
+    }
+    if (ugeInput && !midiPath.empty()) {
+        std::cerr << "A UGE input can only be written as JSON (--format json or json-compact)" << std::endl;
+        return 1;
     }
     // MIDI to UGE mode
+    if (sharedInstruments) std::cerr << "--shared-instruments only applies to --export with several songs" << std::endl;
     if (midiPath.empty() || ugePath.empty()) {
-        std::cerr << "Usage: " << argv[0] << " -i <input.mid> -o <output.uge>\n"
+        std::cerr << "Usage: " << argv[0] << " -i <input.mid> -o <output.uge> [-m <d1,d2,wave,noise>] [--budget <bytes>] [--truncate] [--effect-tolerance <n>] [--pattern-rows 16|32|48|64|auto]\n"
+                  << "          [--rows-per-quarter <n>|auto] [--onset-tolerance <ms>] [--max-timing-error <ms>] [--fixed-speed] [--split]\n"
+                  << "          [--format uge|json|json-compact] [--profile] [--profile-trace <trace.json>]\n"
+                  << "          (- for <input> reads stdin, for <output> writes stdout)\n"
+                  << "   or: " << argv[0] << " --serve [--socket <path>] [--workers <n>] [conversion flags as defaults]\n"
+                  << "   or: " << argv[0] << " -i <a.mid> [-i <b.mid> ...] --export c|asm [--split] [--shared-instruments] [-o <songs.c|songs.asm>]\n"
                   << "   or: " << argv[0] << " <input.mid> <output.uge>\n"
-                  << "   or: " << argv[0] << " -i <input.uge> [-o <output.json>]" << std::endl;
+                  << "   or: " << argv[0] << " -i <input.uge|input.mid> [-o <output.json>] [--format json|json-compact]" << std::endl;
         return 1;
     }
-    if (!convertMidiToUge(midiPath, ugePath, user_channel_map)) {
+    if (!fromStdin && !isStdStream(ugePath)) {
+        if (!convertMidiToUge(midiPath, ugePath, options)) {
+            std::cerr << "Failed to convert MIDI to UGE." << std::endl;
+            return 1;
+        }
+        if (!options.split_to_fit) std::cout << "Wrote " << ugePath << std::endl;
+        return 0;
+    }
+    // Streaming: the song goes to stdout, so the debug lines go to stderr
+    if (isStdStream(ugePath) && options.split_to_fit) {
+        std::cerr << "--split writes one file per part and needs -o <output.uge>" << std::endl;
+        return 1;
+    }
+    if (!fromStdin && !readInput(midiPath, input)) {
+        std::cerr << "Failed to read MIDI file: " << midiPath << std::endl;
+        return 1;
+    }
+    const std::string name = fromStdin ? "<stdin>" : midiPath;
+    ConversionContext context(options);
+    if (isStdStream(ugePath)) context.log.debug = &std::cerr;
+    std::istringstream in(input, std::ios::binary);
+    std::vector<SongPart> parts;
+    if (!convertMidiToUgeParts(in, name, parts, context)) {
         std::cerr << "Failed to convert MIDI to UGE." << std::endl;
         return 1;
     }
-    std::cout << "Wrote " << ugePath << std::endl;
+    if (!isStdStream(ugePath)) {
+        if (!writeSongParts(name, ugePath, parts, context)) {
+            std::cerr << "Failed to convert MIDI to UGE." << std::endl;
+            return 1;
+        }
+        if (!options.split_to_fit) std::cout << "Wrote " << ugePath << std::endl;
+        return 0;
+    }
+    std::ostringstream out(std::ios::binary); // written whole, so a failed write leaves stdout empty
+    {
+        ProfileFileScope profile_file(name);
+        PROFILE_SCOPE("write");
+        ConversionLogScope log(context.log);
+        if (!writeUge(out, parts[0].song)) {
+            std::cerr << "Failed to write the UGE data" << std::endl;
+            return 1;
+        }
+    }
+    if (!writeOutput(ugePath, out.str())) {
+        std::cerr << "Failed to write to stdout" << std::endl;
+        return 1;
+    }
     return 0;
 }
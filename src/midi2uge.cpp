@@ -1,8 +1,18 @@
 #include "midi2uge.h"
 #include "uge_writer.h"
+#include "patterns.h"
+#include "hugedriver.h"
+#include "rom_budget.h"
+#include "instruments.h"
+#include "effects.h"
+#include "song_loop.h"
+#include "timing.h"
+#include "song_split.h"
+#include "profiler.h"
+#include "conversion_log.h"
 #include "MidiFile.h"
-#include <iostream>
 #include <algorithm>
+#include <cctype>
 #include <cstring>
 #include <map>
 #include <vector>
@@ -10,9 +20,9 @@
 #include <optional>
 #include <set>
 
-constexpr int TICKS_PER_ROW = 6; // Set to 6 to match hUGETracker default
-// QUESTION: Is 6 always the best default for TICKS_PER_ROW, or should this be user-configurable?
-constexpr int UGE_EMPTY_NOTE = 90;
+// Note lengths for the instrument envelopes are measured in 64th notes
+// whatever the row resolution, so the thresholds in lenToSweep stay put
+constexpr int LENGTH_UNITS_PER_QUARTER = 16;
 
 // Helper to zero-initialize all fields of an instrument
 static void init_duty_instrument(UgeDutyInstrument& inst, const std::string& name, uint8_t initial_volume = 15, uint8_t sweep_amt = 7, int duty_idx = 0) {
@@ -32,6 +42,7 @@ static void init_duty_instrument(UgeDutyInstrument& inst, const std::string& nam
     inst.unused2 = 0;
     inst.unused3 = 0;
     inst.subpattern_enabled = 0;
+    for (auto& row : inst.subpattern) row.note = UGE_EMPTY_NOTE;
 }
 static void init_wave_instrument(UgeWaveInstrument& inst, const std::string& name, uint8_t initial_volume = 15, uint8_t sweep_amt = 7, int wave_idx = 0) {
     std::memset(&inst, 0, sizeof(UgeWaveInstrument));
@@ -51,6 +62,7 @@ static void init_wave_instrument(UgeWaveInstrument& inst, const std::string& nam
     inst.unused8 = 0;
     inst.unused9 = 0;
     inst.subpattern_enabled = 0;
+    for (auto& row : inst.subpattern) row.note = UGE_EMPTY_NOTE;
 }
 static void init_noise_instrument(UgeNoiseInstrument& inst, const std::string& name, uint8_t initial_volume = 15, uint8_t sweep_amt = 7, uint8_t noise_mode = 0) {
     std::memset(&inst, 0, sizeof(UgeNoiseInstrument));
@@ -69,30 +81,117 @@ static void init_noise_instrument(UgeNoiseInstrument& inst, const std::string& n
     inst.unused6 = 0;
     inst.noise_mode = noise_mode; // 0 = 15-bit
     inst.subpattern_enabled = 0;
+    for (auto& row : inst.subpattern) row.note = UGE_EMPTY_NOTE;
+}
+
+// Copies a tick sequence into an instrument's subpattern block
+static void set_subpattern(UgeSubpattern& subpattern, uint8_t& enabled, const std::vector<SubpatternTick>& ticks) {
+    enabled = ticks.empty() ? 0 : 1;
+    for (size_t i = 0; i < ticks.size() && i < subpattern.size(); ++i) {
+        subpattern[i].effect = ticks[i].effect;
+        subpattern[i].effect_param = ticks[i].param;
+        subpattern[i].jump = ticks[i].jump;
+    }
 }
 
 // Helper clamp function (C++11 compatible)
 template<typename T>
 T clamp(T v, T lo, T hi) { return v < lo ? lo : (v > hi ? hi : v); }
 
-bool convertMidiToUge(const std::string& midiPath, const std::string& ugePath, std::optional<std::array<int, 4>> user_channel_map) {
+constexpr int MAX_PATTERNS_PER_CHANNEL = 256;
+
+// Speed sections, page phase and length, song loop and the ROM budget: the
+// finished row grid becomes the song's patterns and orders
+static void buildSongPatterns(UgeRowGrid& grid, UgeSongHeader& header, BarGrid bars, const ConversionOptions& options, std::vector<UgePattern>& patterns, UgeOrderMatrix& orders) {
+    PROFILE_SCOPE("pattern dedup");
+    // --- Speed sections: merge the empty rows of sparse passages ---
+    if (options.speed_sections) {
+        std::vector<int> row_map;
+        SpeedSectionReport speed = applySpeedSections(grid, header.ticks_per_row, row_map);
+        if (!speed.sections.empty()) {
+            // Bar lines stay evenly spaced only within the section holding the origin
+            int origin = std::min(std::max(bars.origin_row, 0), (int)row_map.size() - 1);
+            int factor = 1;
+            for (const SpeedSection& s : speed.sections) {
+                if (s.source_row <= origin) factor = s.factor;
+            }
+            bars.origin_row = row_map[origin];
+            bars.rows_per_beat = bars.rows_per_beat % factor == 0 ? bars.rows_per_beat / factor : 0;
+            bars.rows_per_bar = bars.rows_per_bar % factor == 0 ? bars.rows_per_bar / factor : 0;
+        }
+    }
+
+    // --- Patterns: pick the page phase that dedups best, then assign sequential indices with deduplication ---
+    int start_row = findBestPatternPhase(grid, bars);
+    patterns.clear();
+    int page_rows = options.pattern_rows ? options.pattern_rows : choosePatternRows(grid, start_row, MAX_PATTERNS_PER_CHANNEL);
+    int overwritten_effects = buildLoopedPatterns(grid, header, start_row, patterns, orders, page_rows);
+
+    // --- Fit to UGE/hUGETracker limits ---
+    const size_t MAX_PATTERN_DATA_BYTES = options.rom_budget_bytes; // 16KB by default
+    // QUESTION: Are these limits (256 patterns, 16KB) strictly enforced by hUGETracker, or can they be relaxed for custom tools?
+    if (options.fit_to_budget) {
+        BudgetReport budget = optimizeForBudget(grid, header, bars, MAX_PATTERN_DATA_BYTES, MAX_PATTERNS_PER_CHANNEL, options.pattern_rows, patterns, orders);
+        if (!budget.sacrifices.empty()) {
+            warningLog() << "[UGE WARNING] Song reduced from " << budget.initial_bytes << " to " << budget.final_bytes << " bytes to fit " << MAX_PATTERN_DATA_BYTES << " byte budget:" << std::endl;
+            for (const auto& s : budget.sacrifices) warningLog() << "  - " << s << std::endl;
+            overwritten_effects = budget.overwritten_effects;
+        }
+    }
+    if (overwritten_effects > 0) {
+        warningLog() << "[UGE WARNING] " << overwritten_effects << " effects replaced by the pattern break (D00) of a short pattern: "
+                     << "every channel had an effect on its last row" << std::endl;
+    }
+    // Truncate whatever still does not fit
+    int num_orders = orders[0].size();
+    int max_orders = num_orders;
+    // Truncate by pattern count if needed
+    if (num_orders > MAX_PATTERNS_PER_CHANNEL) {
+        // Short pages and speed sections make the orders kept shorter than 64 rows
+        int kept_rows = 0;
+        for (int i = 0; i < MAX_PATTERNS_PER_CHANNEL; ++i) kept_rows += hugeOrderRows(patterns, orders, i);
+        warningLog() << "[UGE WARNING] Song too long: truncating to " << MAX_PATTERNS_PER_CHANNEL << " patterns per channel (" << kept_rows << " rows)." << std::endl;
+        max_orders = MAX_PATTERNS_PER_CHANNEL;
+    }
+    // Truncate by exported hUGEDriver data size
+    int max_orders_by_size = maxOrdersWithinBudget(header, patterns, orders, MAX_PATTERN_DATA_BYTES);
+    if (max_orders > max_orders_by_size) {
+        warningLog() << "[UGE WARNING] Song data too large: hUGEDriver export needs " << estimateHugeDriverSize(header, patterns, orders).total()
+                     << " bytes; truncating to " << max_orders_by_size << " patterns per channel to fit " << MAX_PATTERN_DATA_BYTES << " byte limit." << std::endl;
+        max_orders = max_orders_by_size;
+    }
+    if (max_orders < num_orders) {
+        truncateOrders(patterns, orders, max_orders);
+    }
+    printHugeDriverSize(estimateHugeDriverSize(header, patterns, orders), MAX_PATTERN_DATA_BYTES);
+}
+
+// The conversion proper, reading the MIDI file at midiPath or, when given,
+// from in. Row grids, effect lanes and note tracking come from scratch and
+// all die with this function.
+static bool convertParts(const std::string& midiPath, std::istream* in, std::vector<SongPart>& parts, const ConversionOptions& options, std::pmr::memory_resource* scratch, ConversionStats& stats) {
+    const auto& user_channel_map = options.channel_map;
+    ProfileStage stage("read");
     smf::MidiFile midi;
-    if (!midi.read(midiPath)) {
-        std::cerr << "Failed to read MIDI file: " << midiPath << std::endl;
+    if (!(in ? midi.read(*in) : midi.read(midiPath))) {
+        warningLog() << "Failed to read MIDI file: " << midiPath << std::endl;
         return false;
     }
+    stage.next("join");
     midi.joinTracks();
+    stage.next("time analysis");
     midi.doTimeAnalysis();
     midi.linkNotePairs();
     int tpq = midi.getTicksPerQuarterNote();
 
     constexpr int UGE_NUM_CHANNELS = 4;
-    constexpr int UGE_PATTERN_ROWS = 64;
     constexpr int UGE_NUM_DUTY = 15;
     constexpr int UGE_NUM_WAVE = 15;
     constexpr int UGE_NUM_NOISE = 15;
 
-    UgeSongHeader header{};
+    UgeSong song;
+    UgeSongHeader& header = song.header;
+    std::memset(&header, 0, sizeof(UgeSongHeader));
     header.version = 6;
     // QUESTION: Is version 6 always correct for all UGE files, or should this be checked against the input or user-specified?
     header.name = make_shortstring("");
@@ -100,21 +199,26 @@ bool convertMidiToUge(const std::string& midiPath, const std::string& ugePath, s
     header.comment = make_shortstring("");
 
     // --- Instrument mapping ---
-    std::map<int, int> midiProgToUgeInst; // MIDI program -> UGE Duty instrument (channels 0,1)
-    std::map<int, int> midiProgToUgeWaveInst; // MIDI program -> UGE Wave instrument (channel 2)
+    stage.next("mapping");
+    // Ids are handed out first-come without a cap and mapped to the 15 UGE slots
+    // once all instrument parameters are known (see allocateInstrumentSlots)
+    std::map<int, int> midiProgToUgeInst; // MIDI program -> Duty instrument id (channels 0,1)
+    std::map<int, int> midiProgToUgeWaveInst; // MIDI program -> Wave instrument id (channel 2)
     int nextUgeInst = 0;
     int nextUgeWaveInst = 0;
-    std::array<int, UGE_NUM_CHANNELS> channelProgram;
+    std::array<int, 16> channelProgram; // indexed by MIDI channel
     channelProgram.fill(0);
-    std::array<std::vector<int>, UGE_NUM_CHANNELS> channel_instruments;
-    std::array<std::vector<uint8_t>, UGE_NUM_CHANNELS> channel_notes;
-    std::array<std::vector<uint8_t>, UGE_NUM_CHANNELS> channel_velocities;
+    ChannelRows<int> channel_instruments = makeChannelRows<int>(scratch);
+    ChannelRows<uint8_t> channel_notes = makeChannelRows<uint8_t>(scratch);
+    ChannelRows<uint8_t> channel_velocities = makeChannelRows<uint8_t>(scratch);
+    ChannelRows<uint8_t> channel_onsets = makeChannelRows<uint8_t>(scratch); // 1 on rows where a note is struck
     for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
         channel_instruments[ch].clear();
         channel_notes[ch].clear();
         channel_velocities[ch].clear();
+        channel_onsets[ch].clear();
     }
-    // Percussion mapping: MIDI note -> UGE Noise instrument
+    // Percussion mapping: MIDI note -> Noise instrument id
     std::map<int, int> percussionNoteToUgeInst;
     int nextNoiseInst = 0;
 
@@ -123,56 +227,6 @@ bool convertMidiToUge(const std::string& midiPath, const std::string& ugePath, s
     std::map<int, int> waveProgMaxVelocity; // MIDI program -> max velocity (Wave)
     std::map<int, int> percMaxVelocity; // Perc note -> max velocity
 
-    // --- Tempo handling ---
-    // --- Extract MIDI tempo and set UGE timer fields ---
-    int midi_tempo_us_per_qn = 500000; // default 120 BPM
-    // QUESTION: Is 500000 (120 BPM) the best default if no tempo is found, or should we warn the user?
-    for (int t = 0; t < midi.getTrackCount(); ++t) {
-        for (int i = 0; i < midi[t].size(); ++i) {
-            const auto& ev = midi[t][i];
-        if (ev.isMeta() && ev.getMetaType() == 0x51) {
-                midi_tempo_us_per_qn = (ev[3] << 16) | (ev[4] << 8) | ev[5];
-                goto found_tempo;
-            }
-        }
-    }
-found_tempo:
-    // --- User-configurable rows per quarter note ---
-    int user_rows_per_qn = 4; // You can change this value for different musical feels
-    int ticks_per_row = std::max(1, std::min(tpq / user_rows_per_qn, 16)); // Clamp to max 16
-    // QUESTION: Why clamp ticks_per_row to 16? Is this a hUGETracker limit or just a safe default?
-    int timer_enabled = 1;
-    int timer_divider = 0;
-    double rows_per_qn = static_cast<double>(tpq) / ticks_per_row;
-    double row_rate = 1000000.0 / midi_tempo_us_per_qn * rows_per_qn;
-    timer_divider = static_cast<int>(4194304.0 / (16.0 * row_rate) + 0.5);
-    bool divider_clamped = false;
-    if (timer_divider < 1) { timer_divider = 1; divider_clamped = true; }
-    if (timer_divider > 255) { timer_divider = 255; divider_clamped = true; }
-    // QUESTION: Are 1 and 255 the true hardware/driver limits for timer_divider, or just what hUGETracker expects?
-    header.ticks_per_row = ticks_per_row;
-    header.timer_enabled = timer_enabled;
-    header.timer_divider = timer_divider;
-    std::cout << "[UGE DEBUG] MIDI tempo: " << (60000000.0 / midi_tempo_us_per_qn) << " BPM, PPQN: " << tpq << ", ticks_per_row: " << ticks_per_row << ", row_rate: " << row_rate << ", UGE timer_divider: " << timer_divider << std::endl;
-    if (divider_clamped) {
-        std::cerr << "[UGE WARNING] Timer divider was clamped. Try reducing ticks_per_row or increasing rows_per_quarter_note for better tempo accuracy." << std::endl;
-    }
-
-    // Find max tick to determine song length
-    int max_tick = 0;
-    for (int i = 0; i < midi[0].size(); ++i) {
-        max_tick = std::max(max_tick, midi[0][i].tick);
-    }
-    int total_rows = max_tick / TICKS_PER_ROW + 1;
-    int num_patterns = (total_rows + UGE_PATTERN_ROWS - 1) / UGE_PATTERN_ROWS;
-
-    // Pre-size channel note/instrument/velocity arrays
-    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
-        channel_notes[ch].resize(total_rows, UGE_EMPTY_NOTE);
-        channel_instruments[ch].resize(total_rows, 0);
-        channel_velocities[ch].resize(total_rows, 0);
-    }
-
     // --- Flexible channel-to-UGE mapping ---
     // Count note-on events per MIDI channel (excluding percussion channel 9)
     std::array<int, 16> channel_note_counts = {0};
@@ -184,9 +238,9 @@ found_tempo:
         }
     }
     // --- Print note-on event count for all MIDI channels ---
-    std::cout << "[UGE DEBUG] Note-on event count per MIDI channel:" << std::endl;
+    debugLog() << "[UGE DEBUG] Note-on event count per MIDI channel:" << std::endl;
     for (int ch = 0; ch < 16; ++ch) {
-        std::cout << "  MIDI channel " << ch << ": " << channel_note_counts[ch] << " note-on events" << std::endl;
+        debugLog() << "  MIDI channel " << ch << ": " << channel_note_counts[ch] << " note-on events" << std::endl;
     }
     // Find the three most active melodic channels
     std::vector<std::pair<int, int>> channel_activity;
@@ -200,12 +254,12 @@ found_tempo:
         for (int i = 0; i < 4; ++i) {
             midi_to_uge[i] = (*user_channel_map)[i];
         }
-        std::cout << "[UGE DEBUG] Using user-supplied MIDI channel mapping:" << std::endl;
+        debugLog() << "[UGE DEBUG] Using user-supplied MIDI channel mapping:" << std::endl;
         for (int i = 0; i < 4; ++i) {
             if (midi_to_uge[i] >= 0 && midi_to_uge[i] < 16) {
-                std::cout << "  UGE " << (i == 0 ? "Duty1" : (i == 1 ? "Duty2" : (i == 2 ? "Wave" : "Noise"))) << " <= MIDI channel " << midi_to_uge[i] << std::endl;
+                debugLog() << "  UGE " << (i == 0 ? "Duty1" : (i == 1 ? "Duty2" : (i == 2 ? "Wave" : "Noise"))) << " <= MIDI channel " << midi_to_uge[i] << std::endl;
             } else {
-                std::cout << "  UGE " << (i == 0 ? "Duty1" : (i == 1 ? "Duty2" : (i == 2 ? "Wave" : "Noise"))) << " <= (empty)" << std::endl;
+                debugLog() << "  UGE " << (i == 0 ? "Duty1" : (i == 1 ? "Duty2" : (i == 2 ? "Wave" : "Noise"))) << " <= (empty)" << std::endl;
             }
         }
     } else {
@@ -218,16 +272,152 @@ found_tempo:
         std::sort(channel_activity.rbegin(), channel_activity.rend());
         for (int i = 0; i < 3; ++i) midi_to_uge[i] = channel_activity[i].second;
         midi_to_uge[3] = 9; // Noise always maps to MIDI channel 9
-        std::cout << "[UGE DEBUG] MIDI channel to UGE channel mapping (auto):" << std::endl;
+        debugLog() << "[UGE DEBUG] MIDI channel to UGE channel mapping (auto):" << std::endl;
         for (int i = 0; i < 4; ++i) {
             if (i < 3)
-                std::cout << "  UGE " << (i == 0 ? "Duty1" : (i == 1 ? "Duty2" : "Wave")) << " <= MIDI channel " << midi_to_uge[i] << std::endl;
+                debugLog() << "  UGE " << (i == 0 ? "Duty1" : (i == 1 ? "Duty2" : "Wave")) << " <= MIDI channel " << midi_to_uge[i] << std::endl;
             else
-                std::cout << "  UGE Noise <= MIDI channel 9" << std::endl;
+                debugLog() << "  UGE Noise <= MIDI channel 9" << std::endl;
+        }
+    }
+    // --- Tempo handling ---
+    // --- Extract MIDI tempo and set UGE timer fields ---
+    int midi_tempo_us_per_qn = 500000; // default 120 BPM
+    // QUESTION: Is 500000 (120 BPM) the best default if no tempo is found, or should we warn the user?
+    for (int t = 0; t < midi.getTrackCount(); ++t) {
+        for (int i = 0; i < midi[t].size(); ++i) {
+            const auto& ev = midi[t][i];
+        if (ev.isMeta() && ev.getMetaType() == 0x51) {
+                midi_tempo_us_per_qn = (ev[3] << 16) | (ev[4] << 8) | ev[5];
+                goto found_tempo;
+            }
+        }
+    }
+found_tempo:
+    // --- Row resolution from the note onsets ---
+    int rows_per_qn = options.rows_per_quarter;
+    if (rows_per_qn <= 0) {
+        std::vector<int> onset_ticks;
+        for (int i = 0; i < midi[0].size(); ++i) {
+            const auto& ev = midi[0][i];
+            if (!ev.isNoteOn() || ev.getVelocity() == 0) continue;
+            if (std::find(midi_to_uge.begin(), midi_to_uge.end(), ev.getChannel()) == midi_to_uge.end()) continue;
+            onset_ticks.push_back(ev.tick);
+        }
+        double tolerance_ticks = options.onset_tolerance_ms * 1000.0 / midi_tempo_us_per_qn * tpq;
+        RowResolution resolution = chooseRowsPerQuarter(onset_ticks, tpq, tolerance_ticks);
+        rows_per_qn = resolution.rows_per_quarter;
+        debugLog() << "[UGE DEBUG] Row resolution: " << onset_ticks.size() << " onsets in " << resolution.clusters
+                   << " clusters per quarter note -> " << rows_per_qn << " rows per quarter note (worst onset error "
+                   << resolution.max_error_ticks << " ticks, tolerance " << tolerance_ticks << ")" << std::endl;
+    }
+    rows_per_qn = std::max(1, std::min(rows_per_qn, tpq));
+    // MIDI ticks per row may be fractional (e.g. 3 rows per quarter at 96 PPQN is 32, at 100 PPQN 33.3);
+    // events go to the nearest row
+    auto tickToRow = [&](int tick) { return (int)(((int64_t)tick * rows_per_qn * 2 + tpq) / (2 * tpq)); };
+    // The timer plays row_rate rows a second whatever the row resolution;
+    // ticks_per_row only sets how finely effects and subpatterns step, up to
+    // 16 ticks unless the divider needs more
+    double row_rate = 1000000.0 / midi_tempo_us_per_qn * rows_per_qn;
+    TimerSetting timer = chooseTimerSetting(row_rate, std::min(tpq / rows_per_qn, 16));
+    int ticks_per_row = timer.ticks_per_row;
+    header.ticks_per_row = ticks_per_row;
+    header.timer_enabled = 1;
+    header.timer_divider = timer.divider;
+    debugLog() << "[UGE DEBUG] MIDI tempo: " << (60000000.0 / midi_tempo_us_per_qn) << " BPM, PPQN: " << tpq << ", ticks_per_row: " << ticks_per_row << ", row_rate: " << row_rate << ", UGE timer_divider: " << timer.divider << " (tempo off by " << timer.error * 100.0 << "%)" << std::endl;
+    if (timer.clamped) {
+        warningLog() << "[UGE WARNING] Timer divider was clamped: no ticks per row up to " << MAX_TIMER_TICKS_PER_ROW << " plays " << row_rate
+                     << " rows per second; the song plays " << timer.error * 100.0 << "% off tempo. Try a different rows_per_quarter." << std::endl;
+    }
+
+    // --- Time signature (first 0x58 meta) for bar-line alignment ---
+    int ts_numerator = 4;
+    int ts_denominator = 4;
+    int ts_tick = 0;
+    for (int i = 0; i < midi[0].size(); ++i) {
+        const auto& ev = midi[0][i];
+        if (ev.isMeta() && ev.getMetaType() == 0x58 && ev.size() >= 5) {
+            ts_numerator = std::max(1, (int)ev[3]);
+            ts_denominator = 1 << std::min((int)ev[4], 6);
+            ts_tick = ev.tick;
+            break;
+        }
+    }
+
+    // --- Onset quantization: repeats of a phrase start their notes on the same rows ---
+    std::pmr::vector<std::pair<int, int>> onsets(scratch), releases(scratch);
+    for (int i = 0; i < midi[0].size(); ++i) {
+        const auto& ev = midi[0][i];
+        if (!ev.isNoteOn() && !ev.isNoteOff()) continue;
+        if (std::find(midi_to_uge.begin(), midi_to_uge.end(), ev.getChannel()) == midi_to_uge.end()) continue;
+        if (ev.isNoteOn() && ev.getVelocity() > 0) onsets.push_back({ev.getChannel(), ev.tick});
+        else releases.push_back({ev.getChannel(), ev.tick});
+    }
+    double ms_per_tick = midi_tempo_us_per_qn / 1000.0 / tpq;
+    // Onsets a quarter row apart can only be one position played loosely
+    double link_ticks = std::max(options.onset_tolerance_ms / ms_per_tick, double(tpq) / rows_per_qn / 4.0);
+    // By default an onset may move by the rounding to a row plus that looseness
+    double max_timing_error_ms = options.max_timing_error_ms > 0.0 ? options.max_timing_error_ms
+                                                                    : (double(tpq) / rows_per_qn / 2.0 + link_ticks) * ms_per_tick;
+    int bar_ticks = ts_numerator * tpq * 4 / ts_denominator;
+    OnsetQuantization quantized = quantizeOnsets(onsets, tpq, rows_per_qn, bar_ticks, ts_tick, link_ticks, max_timing_error_ms / ms_per_tick, scratch);
+    // Note ends the same way, so repeated notes also keep their length in rows
+    OnsetQuantization quantized_releases = quantizeOnsets(releases, tpq, rows_per_qn, bar_ticks, ts_tick, link_ticks, max_timing_error_ms / ms_per_tick, scratch);
+    debugLog() << "[UGE DEBUG] Onset quantization: " << quantized.onsets << " onsets in " << quantized.clusters << " positions per bar, "
+               << quantized.moved << " moved to their position's row, " << quantized.over_limit << " left on the nearest row (over "
+               << max_timing_error_ms << " ms); timing error max " << quantized.max_error_ticks * ms_per_tick << " ms, mean "
+               << quantized.mean_error_ticks * ms_per_tick << " ms; " << quantized_releases.moved << " of " << quantized_releases.onsets
+               << " note ends moved" << std::endl;
+
+    // Find max tick to determine song length
+    int max_tick = 0;
+    for (int i = 0; i < midi[0].size(); ++i) {
+        max_tick = std::max(max_tick, midi[0][i].tick);
+    }
+    int total_rows = tickToRow(max_tick) + 1;
+
+    // --- Loop markers: CC111 or "loopStart"/"loopEnd" marker events ---
+    // The song is cut at the loop end (the end of the song for CC111) and
+    // jumps back to the loop start instead of playing the unrolled repeats
+    int loop_start_tick = -1, loop_end_tick = -1;
+    for (int i = 0; i < midi[0].size(); ++i) {
+        const auto& ev = midi[0][i];
+        if (ev.isController() && ev.getP1() == 111 && loop_start_tick < 0) loop_start_tick = ev.tick;
+        if (ev.isMeta() && (ev.getMetaType() == 0x06 || ev.getMetaType() == 0x07)) { // marker or cue point
+            std::string text;
+            for (char c : ev.getMetaContent()) {
+                if (std::isalnum((unsigned char)c)) text += std::tolower((unsigned char)c);
+            }
+            if (text == "loopstart") loop_start_tick = ev.tick;
+            else if (text == "loopend" && loop_end_tick < 0) loop_end_tick = ev.tick;
+        }
+    }
+    int loop_start_row = -1;
+    bool cut_at_loop_end = false;
+    if (loop_start_tick >= 0 || loop_end_tick >= 0) {
+        int end_row = tickToRow(loop_end_tick >= 0 ? loop_end_tick : max_tick); // the end of the song, not a row after it
+        int start_row = loop_start_tick >= 0 ? tickToRow(loop_start_tick) : 0;
+        if (start_row < end_row && end_row <= total_rows) {
+            cut_at_loop_end = end_row < total_rows;
+            total_rows = end_row;
+            loop_start_row = start_row;
+            debugLog() << "[UGE DEBUG] Loop markers: loop from row " << start_row << " to row " << (end_row - 1) << std::endl;
+        } else {
+            warningLog() << "[UGE WARNING] Ignoring loop markers: loop start (tick " << loop_start_tick << ") is not before the loop end (tick " << loop_end_tick << ")" << std::endl;
         }
     }
+
+    // Pre-size channel note/instrument/velocity arrays
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        channel_notes[ch].resize(total_rows, UGE_EMPTY_NOTE);
+        channel_instruments[ch].resize(total_rows, 0);
+        channel_velocities[ch].resize(total_rows, 0);
+        channel_onsets[ch].resize(total_rows, 0);
+    }
+
     // --- Note-on/off handling with velocity tracking and correct note lifetimes ---
-    std::array<std::map<int, std::tuple<int, int, int>>, UGE_NUM_CHANNELS> active_notes; // note -> (start_row, inst, velocity)
+    stage.next("event loop");
+    auto active_notes = arenaArray<std::pmr::map<int, std::tuple<int, int, int>>, UGE_NUM_CHANNELS>(scratch); // note -> (start_row, inst, velocity)
 
     // Fill all channels with empty notes by default
     for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
@@ -241,22 +431,38 @@ found_tempo:
     std::array<int, 16> last_pitch_bend = {0}; // -8192 to +8191
     std::array<int, 16> last_modulation = {0}; // 0 to 127
     std::array<int, 16> last_volume = {127}; // 0 to 127, default max
-    std::array<std::vector<uint8_t>, UGE_NUM_CHANNELS> channel_effect;
-    std::array<std::vector<uint8_t>, UGE_NUM_CHANNELS> channel_effect_param;
+    // Pitch bend range per MIDI channel, set through RPN 0: CC101/CC100 select
+    // the parameter, then CC6 gives the semitones and CC38 the cents
+    std::array<int, 16> bend_range_cents;
+    bend_range_cents.fill(DEFAULT_BEND_RANGE_CENTS);
+    std::array<int, 16> selected_rpn;
+    selected_rpn.fill(0x3FFF); // the null RPN
+    // One lane per controller; the last change within a row wins and lane
+    // priority is applied once the lanes have been thinned (see effects.h)
+    auto effect_lanes = arenaArray<EffectLanes, UGE_NUM_CHANNELS>(scratch);
     for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
-        channel_effect[ch].resize(total_rows, 0);
-        channel_effect_param[ch].resize(total_rows, 0);
+        effect_lanes[ch].resize(total_rows);
     }
     // --- Sustain pedal (CC64) tracking ---
     std::array<bool, 16> sustain_on = {false};
-    std::array<std::set<int>, 16> pending_release_notes;
+    auto pending_release_notes = arenaArray<std::pmr::set<int>, 16>(scratch);
     // Only process events for mapped channels
     for (int i = 0; i < midi[0].size(); ++i) {
         const auto& ev = midi[0][i];
         int tick = ev.tick;
-        int row = tick / TICKS_PER_ROW;
-        if (row >= total_rows) continue;
+        int row = tickToRow(tick);
         int channel = ev.getChannel();
+        // Note starts and ends follow the quantized onsets; an end on a note
+        // start goes with that start so legato notes stay joined
+        if (ev.isNoteOn() || ev.isNoteOff()) {
+            auto q = quantized.rows.find({channel, tick});
+            if (q != quantized.rows.end()) {
+                row = q->second;
+            } else if ((q = quantized_releases.rows.find({channel, tick})) != quantized_releases.rows.end()) {
+                row = q->second;
+            }
+        }
+        if (row >= total_rows) continue;
         if (channel < 0 || channel > 15) continue;
         // Handle sustain pedal (CC64)
         if (ev.isController() && ev.getP1() == 64) {
@@ -274,7 +480,8 @@ found_tempo:
                                 int start_row = std::get<0>(it->second);
                                 int ugeInst = std::get<1>(it->second);
                                 int velocity = std::get<2>(it->second);
-                                int off_row = row;
+                                int off_row = std::max(row, start_row + 1); // a note shorter than a row keeps its start row
+                                if (start_row < off_row && start_row < total_rows) channel_onsets[uge_ch][start_row] = 1;
                                 for (int r = start_row; r < off_row && r < total_rows; ++r) {
                                     channel_notes[uge_ch][r] = note;
                                     channel_instruments[uge_ch][r] = ugeInst;
@@ -293,17 +500,26 @@ found_tempo:
                 pending_release_notes[channel].clear();
             }
         }
+        // Handle RPN 0 (pitch bend range); an NRPN selection deselects it
+        if (ev.isController()) {
+            int cc = ev.getP1(), value = ev.getP2();
+            int& rpn = selected_rpn[channel];
+            if (cc == 101) rpn = (value << 7) | (rpn & 0x7F);
+            else if (cc == 100) rpn = (rpn & 0x3F80) | value;
+            else if (cc == 99 || cc == 98) rpn = 0x3FFF;
+            else if (cc == 6 && rpn == 0) bend_range_cents[channel] = value * 100;
+            else if (cc == 38 && rpn == 0) bend_range_cents[channel] = bend_range_cents[channel] / 100 * 100 + std::min(value, 99);
+        }
         // Handle pitch bend
         if ((ev[0] & 0xF0) == 0xE0) { // Pitch bend event
             int lsb = ev[1];
             int msb = ev[2];
             int value = ((msb << 7) | lsb) - 8192; // -8192..+8191
             last_pitch_bend[channel] = value;
-            int uge_param = clamp((value + 8192) * 15 / 16383, 0, 15);
             for (int uge_ch = 0; uge_ch < UGE_NUM_CHANNELS; ++uge_ch) {
                 if (midi_to_uge[uge_ch] == channel) {
-                    channel_effect[uge_ch][row] = 1; // UGE effect 1: portamento
-                    channel_effect_param[uge_ch][row] = uge_param;
+                    // turned into 1xx/2xx/3xx/4xy by analyzePitchCurves
+                    effect_lanes[uge_ch].bend[row] = bendLaneValue(value, bend_range_cents[channel]);
                 }
             }
         }
@@ -311,14 +527,9 @@ found_tempo:
         if (ev.isController() && ev.getP1() == 1) {
             int value = ev.getP2(); // 0..127
             last_modulation[channel] = value;
-            int uge_param = clamp(value * 15 / 127, 0, 15);
             for (int uge_ch = 0; uge_ch < UGE_NUM_CHANNELS; ++uge_ch) {
                 if (midi_to_uge[uge_ch] == channel) {
-                    // Only set vibrato if no other effect is set for this row (e.g., pitch bend takes priority)
-                    if (channel_effect[uge_ch][row] == 0) {
-                        channel_effect[uge_ch][row] = 4; // UGE effect 4: vibrato
-                        channel_effect_param[uge_ch][row] = uge_param;
-                    }
+                    effect_lanes[uge_ch].modulation[row] = value; // UGE effect 4: vibrato
                 }
             }
         }
@@ -326,14 +537,17 @@ found_tempo:
         if (ev.isController() && ev.getP1() == 7) {
             int value = ev.getP2(); // 0..127
             last_volume[channel] = value;
-            int uge_param = clamp(value * 15 / 127, 0, 15);
             for (int uge_ch = 0; uge_ch < UGE_NUM_CHANNELS; ++uge_ch) {
                 if (midi_to_uge[uge_ch] == channel) {
-                    // Only set volume if no higher-priority effect is set for this row
-                    if (channel_effect[uge_ch][row] == 0) {
-                        channel_effect[uge_ch][row] = 0xC; // UGE effect C: volume slide
-                        channel_effect_param[uge_ch][row] = uge_param;
-                    }
+                    effect_lanes[uge_ch].volume[row] = value; // UGE effect C or an instrument envelope, see fitVolumeEnvelopes
+                }
+            }
+        }
+        // Handle expression (CC11), which scales CC7
+        if (ev.isController() && ev.getP1() == 11) {
+            for (int uge_ch = 0; uge_ch < UGE_NUM_CHANNELS; ++uge_ch) {
+                if (midi_to_uge[uge_ch] == channel) {
+                    effect_lanes[uge_ch].expression[row] = ev.getP2();
                 }
             }
         }
@@ -347,7 +561,7 @@ found_tempo:
             if (ev.isNoteOn() && ev.getVelocity() > 0) {
                 int note = ev.getKeyNumber();
                 int velocity = ev.getVelocity();
-                if (percussionNoteToUgeInst.count(note) == 0 && nextNoiseInst < UGE_NUM_NOISE) {
+                if (percussionNoteToUgeInst.count(note) == 0) {
                     percussionNoteToUgeInst[note] = nextNoiseInst++;
                 }
                 int ugeInst = percussionNoteToUgeInst.count(note) ? percussionNoteToUgeInst[note] : 0;
@@ -355,6 +569,7 @@ found_tempo:
                     channel_notes[uge_ch][row] = note;
                     channel_instruments[uge_ch][row] = ugeInst;
                     channel_velocities[uge_ch][row] = velocity;
+                    channel_onsets[uge_ch][row] = 1;
                 if (percMaxVelocity[note] < velocity) percMaxVelocity[note] = velocity;
                 if (row + 1 < total_rows) {
                         channel_notes[uge_ch][row + 1] = UGE_EMPTY_NOTE;
@@ -367,11 +582,11 @@ found_tempo:
                 int prog = ev.getP1();
                 channelProgram[channel] = prog;
                     if (uge_ch == 2) { // Wave
-                if (midiProgToUgeWaveInst.count(prog) == 0 && nextUgeWaveInst < UGE_NUM_WAVE) {
+                if (midiProgToUgeWaveInst.count(prog) == 0) {
                     midiProgToUgeWaveInst[prog] = nextUgeWaveInst++;
                         }
                     } else { // Duty
-                        if (midiProgToUgeInst.count(prog) == 0 && nextUgeInst < UGE_NUM_DUTY) {
+                        if (midiProgToUgeInst.count(prog) == 0) {
                             midiProgToUgeInst[prog] = nextUgeInst++;
                         }
                 }
@@ -381,13 +596,13 @@ found_tempo:
                 int prog = channelProgram[channel];
                     int ugeInst = 0;
                     if (uge_ch == 2) { // Wave
-                if (midiProgToUgeWaveInst.count(prog) == 0 && nextUgeWaveInst < UGE_NUM_WAVE) {
+                if (midiProgToUgeWaveInst.count(prog) == 0) {
                     midiProgToUgeWaveInst[prog] = nextUgeWaveInst++;
                 }
                         ugeInst = midiProgToUgeWaveInst.count(prog) ? midiProgToUgeWaveInst[prog] : 0;
                 if (waveProgMaxVelocity[prog] < velocity) waveProgMaxVelocity[prog] = velocity;
                     } else { // Duty
-                if (midiProgToUgeInst.count(prog) == 0 && nextUgeInst < UGE_NUM_DUTY) {
+                if (midiProgToUgeInst.count(prog) == 0) {
                     midiProgToUgeInst[prog] = nextUgeInst++;
                 }
                         ugeInst = midiProgToUgeInst.count(prog) ? midiProgToUgeInst[prog] : 0;
@@ -402,7 +617,8 @@ found_tempo:
                     int start_row = std::get<0>(it->second);
                     int ugeInst = std::get<1>(it->second);
                     int velocity = std::get<2>(it->second);
-                    int off_row = row;
+                    int off_row = std::max(row, start_row + 1); // a note shorter than a row keeps its start row
+                    if (start_row < off_row && start_row < total_rows) channel_onsets[uge_ch][start_row] = 1;
                     // Fill all rows from start_row to off_row-1
                     for (int r = start_row; r < off_row && r < total_rows; ++r) {
                             channel_notes[uge_ch][r] = note;
@@ -422,13 +638,27 @@ found_tempo:
             // --- End original note-on/note-off/instrument/velocity logic ---
         }
     }
+    // Notes still held where the song was cut at the loop end sound up to it
+    if (cut_at_loop_end) {
+        for (int uge_ch = 0; uge_ch < UGE_NUM_CHANNELS; ++uge_ch) {
+            for (const auto& held : active_notes[uge_ch]) {
+                int start_row = std::get<0>(held.second);
+                channel_onsets[uge_ch][start_row] = 1;
+                for (int r = start_row; r < total_rows; ++r) {
+                    channel_notes[uge_ch][r] = held.first;
+                    channel_instruments[uge_ch][r] = std::get<1>(held.second);
+                    channel_velocities[uge_ch][r] = std::get<2>(held.second);
+                }
+            }
+        }
+    }
     // Add debug output for which channels are filled
     for (int uge_ch = 0; uge_ch < UGE_NUM_CHANNELS; ++uge_ch) {
         int mapped_midi_ch = midi_to_uge[uge_ch];
         if (mapped_midi_ch < 0 || mapped_midi_ch > 15) {
-            std::cout << "[UGE DEBUG] UGE channel " << uge_ch << " is empty (no MIDI mapping)" << std::endl;
+            debugLog() << "[UGE DEBUG] UGE channel " << uge_ch << " is empty (no MIDI mapping)" << std::endl;
         } else {
-            std::cout << "[UGE DEBUG] UGE channel " << uge_ch << " mapped to MIDI channel " << mapped_midi_ch << std::endl;
+            debugLog() << "[UGE DEBUG] UGE channel " << uge_ch << " mapped to MIDI channel " << mapped_midi_ch << std::endl;
         }
     }
 
@@ -437,93 +667,101 @@ found_tempo:
     // and assign up to 3 notes to UGE channels 0, 1, 2 (Duty 1, Duty 2, Wave)
     // For percussion, pick the highest velocity note per row
     //
-    // We'll build a new set of arrays: uge_notes, uge_instruments, uge_velocities
-    std::array<std::vector<uint8_t>, UGE_NUM_CHANNELS> uge_notes;
-    std::array<std::vector<int>, UGE_NUM_CHANNELS> uge_instruments;
-    std::array<std::vector<uint8_t>, UGE_NUM_CHANNELS> uge_velocities;
-    std::array<std::vector<uint8_t>, UGE_NUM_CHANNELS> uge_effects;
-    std::array<std::vector<uint8_t>, UGE_NUM_CHANNELS> uge_effect_params;
+    // We'll build the row grid (notes, instruments, effects) plus uge_velocities
+    UgeRowGrid grid(scratch);
+    grid.resize(total_rows);
+    grid.loop_start_row = loop_start_row;
+    ChannelRows<uint8_t> uge_velocities = makeChannelRows<uint8_t>(scratch);
     for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
-        uge_notes[ch].resize(total_rows, UGE_EMPTY_NOTE);
-        uge_instruments[ch].resize(total_rows, 0);
         uge_velocities[ch].resize(total_rows, 0);
-        uge_effects[ch].resize(total_rows, 0);
-        uge_effect_params[ch].resize(total_rows, 0);
     }
     // --- Strict channel mapping and debug output ---
     // For each row, assign MIDI channel 0 to UGE 0, 1 to 1, 2 to 2
     for (int row = 0; row < total_rows; ++row) {
         for (int ch = 0; ch < 3; ++ch) { // Duty 1, Duty 2, Wave
-            uge_notes[ch][row] = channel_notes[ch][row];
-            uge_instruments[ch][row] = channel_instruments[ch][row];
+            grid.notes[ch][row] = channel_notes[ch][row];
+            grid.instruments[ch][row] = channel_instruments[ch][row];
             uge_velocities[ch][row] = channel_velocities[ch][row];
         }
-        uge_notes[3][row] = channel_notes[3][row];
-        uge_instruments[3][row] = channel_instruments[3][row];
+        grid.notes[3][row] = channel_notes[3][row];
+        grid.instruments[3][row] = channel_instruments[3][row];
         uge_velocities[3][row] = channel_velocities[3][row];
     }
+    // --- Effects: fit pitch curves, thin dense controller streams, then resolve lane priority ---
+    stage.next("effects");
+    PitchCurveReport curves = analyzePitchCurves(effect_lanes, grid, header.ticks_per_row);
+    debugLog() << "[UGE DEBUG] Pitch curves: " << curves.bend_events << " bend and " << curves.modulation_events << " modulation events -> "
+               << curves.vibratos << " vibrato, " << curves.portamentos << " portamento, " << curves.tone_portamentos << " tone portamento" << std::endl;
+    double seconds_per_row = midi_tempo_us_per_qn / 1000000.0 / rows_per_qn;
+    EnvelopeFitReport envelopes = fitVolumeEnvelopes(effect_lanes, grid, seconds_per_row);
+    debugLog() << "[UGE DEBUG] Volume envelopes: " << envelopes.notes.size() << " notes fitted to instrument envelopes, "
+               << envelopes.cells_removed << " volume cells dropped" << std::endl;
+    EffectThinningReport thinning = thinEffects(effect_lanes, channel_onsets, options.effect_tolerance);
+    applyEffectLanes(effect_lanes, grid);
+    debugLog() << "[UGE DEBUG] Effect thinning (tolerance " << options.effect_tolerance << "): " << thinning.cells_before << " effect cells -> "
+               << thinning.cells_after << " (" << (thinning.cells_before - thinning.cells_after) << " removed)" << std::endl;
     // --- Find first non-empty row ---
     int first_nonempty_row = total_rows;
     for (int row = 0; row < total_rows; ++row) {
         for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
-            if (uge_notes[ch][row] != UGE_EMPTY_NOTE) {
+            if (grid.notes[ch][row] != UGE_EMPTY_NOTE) {
                 first_nonempty_row = row;
                 goto found_first;
             }
         }
     }
 found_first:;
-    int first_nonempty_page = first_nonempty_row / UGE_PATTERN_ROWS;
     // --- Warn if no notes on channels 0,1,2 ---
     bool has_duty_wave = false;
     for (int ch = 0; ch < 3; ++ch) {
         for (int row = 0; row < total_rows; ++row) {
-            if (uge_notes[ch][row] != UGE_EMPTY_NOTE) {
+            if (grid.notes[ch][row] != UGE_EMPTY_NOTE) {
                 has_duty_wave = true;
                 break;
             }
         }
     }
     if (!has_duty_wave) {
-        std::cerr << "[UGE WARNING] No notes found on MIDI channels 0, 1, or 2 (Duty/Wave). Only Noise channel will be populated." << std::endl;
+        warningLog() << "[UGE WARNING] No notes found on MIDI channels 0, 1, or 2 (Duty/Wave). Only Noise channel will be populated." << std::endl;
     }
     // --- Debug: print mapping for first 16 non-empty rows ---
-    std::cout << "[UGE DEBUG] Row | Duty1 (note,inst) | Duty2 (note,inst) | Wave (note,inst) | Noise (note,inst)" << std::endl;
+    debugLog() << "[UGE DEBUG] Row | Duty1 (note,inst) | Duty2 (note,inst) | Wave (note,inst) | Noise (note,inst)" << std::endl;
     int debug_rows_printed = 0;
     for (int row = first_nonempty_row; row < total_rows && debug_rows_printed < 16; ++row, ++debug_rows_printed) {
-        std::cout << "[UGE DEBUG] " << row << " | ";
+        debugLog() << "[UGE DEBUG] " << row << " | ";
         for (int ch = 0; ch < 4; ++ch) {
-            if (uge_notes[ch][row] != UGE_EMPTY_NOTE)
-                std::cout << (int)uge_notes[ch][row] << "," << uge_instruments[ch][row];
+            if (grid.notes[ch][row] != UGE_EMPTY_NOTE)
+                debugLog() << (int)grid.notes[ch][row] << "," << grid.instruments[ch][row];
             else
-                std::cout << "--,--";
-            if (ch < 3) std::cout << " | ";
+                debugLog() << "--,--";
+            if (ch < 3) debugLog() << " | ";
         }
-        std::cout << std::endl;
+        debugLog() << std::endl;
     }
-    // Use uge_notes, uge_instruments, uge_velocities for pattern writing below
+    // Use grid for pattern writing below
 
     // --- Debug: print first 16 rows of channel_notes for mapped channels ---
-    std::cout << "[UGE DEBUG] First 16 rows of channel_notes for mapped UGE channels:" << std::endl;
+    debugLog() << "[UGE DEBUG] First 16 rows of channel_notes for mapped UGE channels:" << std::endl;
     for (int row = 0; row < std::min(16, total_rows); ++row) {
-        std::cout << "Row " << row << ": ";
+        debugLog() << "Row " << row << ": ";
         for (int ch = 0; ch < 3; ++ch) {
-            std::cout << "Ch" << ch << " (MIDI " << midi_to_uge[ch] << ") note=" << (int)channel_notes[ch][row]
-                      << ", inst=" << channel_instruments[ch][row]
-                      << ", vel=" << (int)channel_velocities[ch][row] << " | ";
+            debugLog() << "Ch" << ch << " (MIDI " << midi_to_uge[ch] << ") note=" << (int)channel_notes[ch][row]
+                       << ", inst=" << channel_instruments[ch][row]
+                       << ", vel=" << (int)channel_velocities[ch][row] << " | ";
         }
-        std::cout << std::endl;
+        debugLog() << std::endl;
     }
     // --- Track note lengths for each instrument ---
-    std::unordered_map<int, std::vector<int>> progNoteLengths; // MIDI program -> vector of note lengths (Duty/Wave)
-    std::unordered_map<int, std::vector<int>> percNoteLengths; // Perc note -> vector of note lengths
+    stage.next("statistics");
+    std::pmr::unordered_map<int, std::pmr::vector<int>> progNoteLengths(scratch); // MIDI program -> vector of note lengths (Duty/Wave)
+    std::pmr::unordered_map<int, std::pmr::vector<int>> percNoteLengths(scratch); // Perc note -> vector of note lengths
     // For each channel, track note-on row for each note
-    std::array<std::unordered_map<int, int>, UGE_NUM_CHANNELS> noteOnRow;
+    auto noteOnRow = arenaArray<std::pmr::unordered_map<int, int>, UGE_NUM_CHANNELS>(scratch);
     for (int i = 0; i < midi[0].size(); ++i) {
         const auto& ev = midi[0][i];
         int tick = ev.tick;
-        int row = tick / TICKS_PER_ROW;
-        if (row >= total_rows) continue;
+        if (tickToRow(tick) >= total_rows) continue;
+        int row = tick * LENGTH_UNITS_PER_QUARTER / tpq;
         int channel = ev.getChannel();
         if (channel < 0 || channel > 15) continue;
         if (channel == 9) { // Percussion/Noise
@@ -603,43 +841,129 @@ found_first:;
         if (note == 42 || note == 44 || note == 46 || note == 49 || note == 51 || note == 52 || note == 55 || note == 57 || note == 59) return 1;
         return 0;
     };
-    // --- Update instrument initialization to use these mappings ---
-    // Build reverse maps: UGE instrument index -> MIDI program/note
-    std::map<int, int> ugeInstToProg;
+    // --- Build one candidate instrument per MIDI program / percussion note ---
+    stage.next("instruments");
+    // Candidates are indexed by the ids handed out in the event loop; identical
+    // parameter sets are then merged and the rest clustered into the 15 slots.
+    auto noteCount = [](const std::pmr::unordered_map<int, std::pmr::vector<int>>& lengths, int key) {
+        auto it = lengths.find(key);
+        return it == lengths.end() ? 1 : std::max(1, (int)it->second.size());
+    };
+    std::vector<InstrumentParams> duty_candidates(nextUgeInst);
     for (const auto& kv : midiProgToUgeInst) {
-        ugeInstToProg[kv.second] = kv.first;
+        int prog = kv.first;
+        InstrumentParams& p = duty_candidates[kv.second];
+        p.name = "MIDI Prog " + std::to_string(prog);
+        p.sweep_amt = 4; // moderate decay by default
+        p.sweep_dir = 1; // fade out
+        if (progMaxVelocity.count(prog))
+            p.volume = std::max(1, std::min(15, (progMaxVelocity[prog] * 15 + 63) / 127));
+        if (progAvgLen.count(prog) && progAvgLen[prog] > 0) {
+            p.sweep_amt = lenToSweep(progAvgLen[prog]);
+            p.length_enabled = 1;
+            p.length = progAvgLen[prog] * tpq / LENGTH_UNITS_PER_QUARTER;
+        }
+        p.weight = noteCount(progNoteLengths, prog);
     }
-    std::map<int, int> ugeWaveInstToProg;
+    std::vector<InstrumentParams> wave_candidates(nextUgeWaveInst);
     for (const auto& kv : midiProgToUgeWaveInst) {
-        ugeWaveInstToProg[kv.second] = kv.first;
+        int prog = kv.first;
+        InstrumentParams& p = wave_candidates[kv.second];
+        p.name = "MIDI Prog " + std::to_string(prog);
+        // The wave channel has no volume envelope
+        p.sweep_dir = 0;
+        p.sweep_amt = 0;
+        if (waveProgMaxVelocity.count(prog))
+            p.volume = std::max(1, std::min(15, (waveProgMaxVelocity[prog] * 15 + 63) / 127));
+        if (progAvgLen.count(prog) && progAvgLen[prog] > 0) {
+            // Set length based on MIDI note length
+            p.length_enabled = 1;
+            p.length = progAvgLen[prog] * tpq / LENGTH_UNITS_PER_QUARTER;
+        }
+        p.weight = noteCount(progNoteLengths, prog);
     }
-    std::map<int, int> ugeNoiseInstToNote;
+    std::vector<InstrumentParams> noise_candidates(nextNoiseInst);
     for (const auto& kv : percussionNoteToUgeInst) {
-        ugeNoiseInstToNote[kv.second] = kv.first;
+        int note = kv.first;
+        InstrumentParams& p = noise_candidates[kv.second];
+        p.name = "Perc Note " + std::to_string(note);
+        p.noise_mode = noteToNoiseMode(note);
+        if (percMaxVelocity.count(note))
+            p.volume = std::max(1, std::min(15, (percMaxVelocity[note] * 15 + 63) / 127));
+        if (percAvgLen.count(note) && percAvgLen[note] > 0) {
+            p.sweep_amt = lenToSweep(percAvgLen[note]);
+            p.length_enabled = 1;
+            p.length = percAvgLen[note] * tpq / LENGTH_UNITS_PER_QUARTER;
+        }
+        p.weight = noteCount(percNoteLengths, note);
+    }
+    // --- Instrument variants for notes fitted to a volume envelope ---
+    std::map<std::tuple<int, int, VolumeEnvelope>, int> envelopeVariant; // (channel, base id, envelope) -> id
+    for (const FittedEnvelope& fit : envelopes.notes) {
+        std::vector<InstrumentParams>& candidates = (fit.ch == 3) ? noise_candidates : duty_candidates;
+        int base = grid.instruments[fit.ch][fit.onset_row];
+        if (base < 0 || base >= (int)candidates.size()) continue;
+        auto key = std::make_tuple(fit.ch == 3 ? 3 : 0, base, fit.envelope);
+        auto it = envelopeVariant.find(key);
+        if (it == envelopeVariant.end()) {
+            InstrumentParams variant = candidates[base];
+            variant.volume = clamp((variant.volume * fit.envelope.initial_volume + 7) / 15, 0, 15);
+            variant.sweep_dir = fit.envelope.sweep_dir;
+            variant.sweep_amt = fit.envelope.sweep_amt;
+            variant.weight = 0;
+            variant.name += fit.envelope.sweep_dir ? " fade" : " swell";
+            candidates.push_back(variant);
+            it = envelopeVariant.emplace(key, (int)candidates.size() - 1).first;
+        }
+        candidates[it->second].weight++;
+        candidates[base].weight = std::max(1, candidates[base].weight - 1);
+        for (int row = fit.onset_row; row <= fit.end_row; ++row) grid.instruments[fit.ch][row] = it->second;
+    }
+    // --- Instrument variants for recurring per-note effect sequences ---
+    SubpatternReport subpatterns = extractSubpatterns(grid, channel_onsets, header.ticks_per_row);
+    std::map<std::tuple<int, int, int>, int> subpatternVariant; // (channel kind, base id, sequence) -> id
+    for (const SubpatternNote& sn : subpatterns.notes) {
+        std::vector<InstrumentParams>& candidates = (sn.ch == 3) ? noise_candidates : (sn.ch == 2 ? wave_candidates : duty_candidates);
+        int base = grid.instruments[sn.ch][sn.onset_row];
+        if (base < 0 || base >= (int)candidates.size()) continue;
+        auto key = std::make_tuple(sn.ch == 1 ? 0 : sn.ch, base, sn.sequence);
+        auto it = subpatternVariant.find(key);
+        if (it == subpatternVariant.end()) {
+            InstrumentParams variant = candidates[base];
+            variant.subpattern = subpatterns.sequences[sn.sequence];
+            variant.weight = 0;
+            variant.name += " fx" + std::to_string(sn.sequence + 1);
+            candidates.push_back(variant);
+            it = subpatternVariant.emplace(key, (int)candidates.size() - 1).first;
+        }
+        candidates[it->second].weight++;
+        candidates[base].weight = std::max(1, candidates[base].weight - 1);
+        for (int row = sn.onset_row; row <= sn.end_row; ++row) grid.instruments[sn.ch][row] = it->second;
+    }
+    std::vector<InstrumentParams> duty_slots, wave_slots, noise_slots;
+    std::vector<int> duty_slot_of = allocateInstrumentSlots(duty_candidates, UGE_NUM_DUTY, duty_slots);
+    std::vector<int> wave_slot_of = allocateInstrumentSlots(wave_candidates, UGE_NUM_WAVE, wave_slots);
+    std::vector<int> noise_slot_of = allocateInstrumentSlots(noise_candidates, UGE_NUM_NOISE, noise_slots);
+    // Point the grid at the allocated slots
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        const std::vector<int>& slot_of = (ch == 3) ? noise_slot_of : (ch == 2 ? wave_slot_of : duty_slot_of);
+        for (int row = 0; row < total_rows; ++row) {
+            if (grid.notes[ch][row] == UGE_EMPTY_NOTE) continue;
+            int id = grid.instruments[ch][row];
+            grid.instruments[ch][row] = (id >= 0 && id < (int)slot_of.size()) ? slot_of[id] : 0;
+        }
     }
     // Duty instruments
     for (int i = 0; i < UGE_NUM_DUTY; ++i) {
-        if (ugeInstToProg.count(i)) {
-            int prog = ugeInstToProg[i];
-            std::string name = "MIDI Prog " + std::to_string(prog);
-            uint8_t vol = 15;
-            int sweep_amt = 4; // moderate decay by default
+        if (i < (int)duty_slots.size()) {
+            const InstrumentParams& p = duty_slots[i];
             int duty_val = i % 4;
-            int sweep_dir = 1; // fade out
-            int len_enabled = 0;
-            int len = 0;
-            if (progMaxVelocity.count(prog))
-                vol = std::max(1, std::min(15, (progMaxVelocity[prog] * 15 + 63) / 127));
-            if (progAvgLen.count(prog) && progAvgLen[prog] > 0) {
-                sweep_amt = lenToSweep(progAvgLen[prog]);
-                len_enabled = 1;
-                len = progAvgLen[prog] * TICKS_PER_ROW;
-            }
             UgeDutyInstrument& inst = header.instruments.duty[i];
-            init_duty_instrument(inst, name, vol, sweep_amt, duty_val);
-            inst.volume_sweep_direction = sweep_dir;
-            inst.length_enabled = len_enabled;
-            inst.length = len;
+            init_duty_instrument(inst, p.name, p.volume, p.sweep_amt, duty_val);
+            set_subpattern(inst.subpattern, inst.subpattern_enabled, p.subpattern);
+            inst.volume_sweep_direction = p.sweep_dir;
+            inst.length_enabled = p.length_enabled;
+            inst.length = p.length;
         } else {
             std::string name = "(unused)";
             int duty_val = i % 4;
@@ -649,26 +973,13 @@ found_first:;
     }
     // Wave instruments
     for (int i = 0; i < UGE_NUM_WAVE; ++i) {
-        if (ugeWaveInstToProg.count(i)) {
-            int prog = ugeWaveInstToProg[i];
-            std::string name = "MIDI Prog " + std::to_string(prog);
-            uint8_t vol = 15;
-            int sweep_amt = 4;
-            int wave_idx = 0;
-            if (waveProgMaxVelocity.count(prog))
-                vol = std::max(1, std::min(15, (waveProgMaxVelocity[prog] * 15 + 63) / 127));
-            if (progAvgLen.count(prog) && progAvgLen[prog] > 0) {
-                sweep_amt = lenToSweep(progAvgLen[prog]);
-                // Set length based on MIDI note length
-                header.instruments.wave[i].length_enabled = 1;
-                header.instruments.wave[i].length = progAvgLen[prog] * TICKS_PER_ROW;
-            } else {
-                header.instruments.wave[i].length_enabled = 0;
-                header.instruments.wave[i].length = 0;
-            }
+        if (i < (int)wave_slots.size()) {
+            const InstrumentParams& p = wave_slots[i];
             UgeWaveInstrument& inst = header.instruments.wave[i];
-            init_wave_instrument(inst, name, vol, sweep_amt, wave_idx);
-            // No volume_sweep_direction, length_enabled, or length for UgeWaveInstrument
+            init_wave_instrument(inst, p.name, p.volume, p.sweep_amt, p.wave_index);
+            set_subpattern(inst.subpattern, inst.subpattern_enabled, p.subpattern);
+            inst.length_enabled = p.length_enabled;
+            inst.length = p.length;
         } else {
             std::string name = "(unused)";
             init_wave_instrument(header.instruments.wave[i], name, 15, 4, 0);
@@ -676,27 +987,14 @@ found_first:;
     }
     // Noise instruments
     for (int i = 0; i < UGE_NUM_NOISE; ++i) {
-        if (ugeNoiseInstToNote.count(i)) {
-            int note = ugeNoiseInstToNote[i];
-            std::string name = "Perc Note " + std::to_string(note);
-            uint8_t vol = 15;
-            int sweep_amt = 4;
-            int noise_mode = noteToNoiseMode(note);
-            int sweep_dir = 1;
-            int len_enabled = 0;
-            int len = 0;
-            if (percMaxVelocity.count(note))
-                vol = std::max(1, std::min(15, (percMaxVelocity[note] * 15 + 63) / 127));
-            if (percAvgLen.count(note) && percAvgLen[note] > 0) {
-                sweep_amt = lenToSweep(percAvgLen[note]);
-                len_enabled = 1;
-                len = percAvgLen[note] * TICKS_PER_ROW;
-            }
+        if (i < (int)noise_slots.size()) {
+            const InstrumentParams& p = noise_slots[i];
             UgeNoiseInstrument& inst = header.instruments.noise[i];
-            init_noise_instrument(inst, name, vol, sweep_amt, noise_mode);
-            inst.volume_sweep_direction = sweep_dir;
-            inst.length_enabled = len_enabled;
-            inst.length = len;
+            init_noise_instrument(inst, p.name, p.volume, p.sweep_amt, p.noise_mode);
+            set_subpattern(inst.subpattern, inst.subpattern_enabled, p.subpattern);
+            inst.volume_sweep_direction = p.sweep_dir;
+            inst.length_enabled = p.length_enabled;
+            inst.length = p.length;
         } else {
             std::string name = "(unused)";
             init_noise_instrument(header.instruments.noise[i], name, 15, 4, 0);
@@ -705,120 +1003,214 @@ found_first:;
     }
     for (auto& wave : header.wavetable) wave.fill(0);
 
-    // --- Automatic truncation to fit UGE/hUGETracker limits ---
-    constexpr int MAX_PATTERNS_PER_CHANNEL = 256;
-    constexpr int MAX_PATTERN_DATA_BYTES = 0x4000; // 16KB
-    // QUESTION: Are these limits (256 patterns, 16KB) strictly enforced by hUGETracker, or can they be relaxed for custom tools?
-    int max_patterns = num_patterns;
-    // Truncate by pattern count if needed
-    if (num_patterns > MAX_PATTERNS_PER_CHANNEL) {
-        std::cerr << "[UGE WARNING] Song too long: truncating to " << MAX_PATTERNS_PER_CHANNEL << " patterns per channel (" << (MAX_PATTERNS_PER_CHANNEL * UGE_PATTERN_ROWS) << " rows)." << std::endl;
-        max_patterns = MAX_PATTERNS_PER_CHANNEL;
-    }
-    // Estimate max patterns by data size
-    int max_patterns_by_size = MAX_PATTERN_DATA_BYTES / (UGE_PATTERN_ROWS * sizeof(UgePatternRow) + sizeof(uint32_t));
-    if (max_patterns > max_patterns_by_size) {
-        std::cerr << "[UGE WARNING] Song data too large: truncating to " << max_patterns_by_size << " patterns per channel to fit 16KB limit." << std::endl;
-        max_patterns = max_patterns_by_size;
-    }
-    // --- Patterns: skip initial empty pages, assign new sequential indices with deduplication ---
-    std::vector<UgePattern> patterns;
-    UgeOrderMatrix orders;
-    int start_pattern = first_nonempty_page;
-    int new_pattern_idx = 0;
-    // Map: (channel, pattern hash) -> pattern index
-    std::unordered_map<size_t, int> pattern_hash_to_index[UGE_NUM_CHANNELS];
-    std::hash<std::string> hasher;
+    // Rows where no note sounds: a part of a split song best starts after one
+    stage.next("patterns");
+    std::pmr::vector<uint8_t> silent_rows(grid.total_rows, 1, scratch);
     for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
-        orders[ch].clear();
-        for (int pat = start_pattern; pat < num_patterns; ++pat) {
-            // Build pattern data string for hashing
-            std::string pat_data;
-            for (int row = 0; row < UGE_PATTERN_ROWS; ++row) {
-                int song_row = pat * UGE_PATTERN_ROWS + row;
-                uint8_t note = (song_row < total_rows) ? uge_notes[ch][song_row] : UGE_EMPTY_NOTE;
-                uint8_t inst = (song_row < total_rows) ? uge_instruments[ch][song_row] : 0;
-                uint8_t eff = (song_row < total_rows) ? uge_effects[ch][song_row] : 0;
-                uint8_t eff_param = (song_row < total_rows) ? uge_effect_params[ch][song_row] : 0;
-                pat_data.push_back(note);
-                pat_data.push_back(inst);
-                pat_data.push_back(eff);
-                pat_data.push_back(eff_param);
-            }
-            size_t hash = hasher(pat_data);
-            auto it = pattern_hash_to_index[ch].find(hash);
-            int pat_idx;
-            if (it != pattern_hash_to_index[ch].end()) {
-                pat_idx = it->second; // Reuse existing pattern
-                    } else {
-                UgePattern p{};
-                p.index = new_pattern_idx;
-                for (int row = 0; row < UGE_PATTERN_ROWS; ++row) {
-                    int song_row = pat * UGE_PATTERN_ROWS + row;
-                    p.rows[row].note = (song_row < total_rows) ? uge_notes[ch][song_row] : UGE_EMPTY_NOTE;
-                    p.rows[row].instrument = (song_row < total_rows) ? uge_instruments[ch][song_row] : 0;
-                    p.rows[row].effect = (song_row < total_rows) ? uge_effects[ch][song_row] : 0;
-                    p.rows[row].effect_param = (song_row < total_rows) ? uge_effect_params[ch][song_row] : 0;
-                    p.rows[row].unused1 = 0;
-            }
-            patterns.push_back(p);
-                pat_idx = new_pattern_idx;
-                pattern_hash_to_index[ch][hash] = new_pattern_idx;
-                ++new_pattern_idx;
-            }
-            orders[ch].push_back(pat_idx);
+        for (int row = 0; row < grid.total_rows; ++row) {
+            if (grid.notes[ch][row] != UGE_EMPTY_NOTE) silent_rows[row] = 0;
         }
     }
 
-    // Routines: empty
-    UgeRoutineBank routines;
-    for (auto& r : routines) r = "";
+    // --- Write notes on their start rows only, ending them with a cut ---
+    NoteEncodingReport note_encoding = encodeNoteStarts(grid, channel_onsets);
+    debugLog() << "[UGE DEBUG] Note cells: " << note_encoding.held_cells << " held rows -> " << note_encoding.note_cells
+               << " note starts + " << note_encoding.cut_cells << " note cuts" << std::endl;
+    if (note_encoding.cuts_skipped > 0) {
+        warningLog() << "[UGE WARNING] " << note_encoding.cuts_skipped
+                     << " note cuts (E00) left out because their row already has an effect; those notes ring on" << std::endl;
+    }
 
-    if (!writeUgeFile(ugePath, header, patterns, orders, routines)) {
-        std::cerr << "Failed to write UGE file: " << ugePath << std::endl;
-        return false;
+    // --- Bar lines, for the page phase and the split points ---
+    BarGrid bars;
+    bars.rows_per_beat = rows_per_qn * 4 / ts_denominator;
+    bars.rows_per_bar = bars.rows_per_beat * ts_numerator;
+    bars.origin_row = tickToRow(ts_tick);
+
+    // --- Split the song into parts that each fit the budget ---
+    std::vector<int> part_starts = {0};
+    if (options.split_to_fit) {
+        part_starts = chooseSplitRows(grid, header, bars, silent_rows, options.rom_budget_bytes, MAX_PATTERNS_PER_CHANNEL);
+        if (part_starts.size() > 1) {
+            debugLog() << "[UGE DEBUG] Split into " << part_starts.size() << " parts at rows";
+            for (size_t p = 1; p < part_starts.size(); ++p) debugLog() << " " << part_starts[p];
+            debugLog() << std::endl;
+        }
+    }
+    parts.clear();
+    for (size_t p = 0; p < part_starts.size(); ++p) {
+        SongPart part;
+        part.first_row = part_starts[p];
+        part.rows = (p + 1 < part_starts.size() ? part_starts[p + 1] : grid.total_rows) - part.first_row;
+        part.seconds = part.rows * seconds_per_row;
+        parts.push_back(std::move(part));
+    }
+    int loop_part = 0;
+    for (size_t p = 0; p < parts.size(); ++p) {
+        if (grid.loop_start_row >= parts[p].first_row) loop_part = p;
+    }
+    if (parts.size() == 1) {
+        buildSongPatterns(grid, header, bars, options, song.patterns, song.orders);
+        total_rows = grid.total_rows;
+    } else {
+        for (size_t p = 0; p < parts.size(); ++p) {
+            SongPart& part = parts[p];
+            debugLog() << "[UGE DEBUG] Part " << (p + 1) << ": rows " << part.first_row << "-" << (part.first_row + part.rows - 1) << std::endl;
+            UgeRowGrid part_grid = sliceGrid(grid, part.first_row, part.first_row + part.rows);
+            BarGrid part_bars = bars;
+            part_bars.origin_row -= part.first_row;
+            part.song.header = header;
+            buildSongPatterns(part_grid, part.song.header, part_bars, options, part.song.patterns, part.song.orders);
+            for (auto& r : part.song.routines) r = "";
+        }
     }
+
+    // Routines: empty
+    for (auto& r : song.routines) r = "";
+    stage.stop();
+    stats.ticks_per_quarter = tpq;
+    stats.rows_per_quarter = rows_per_qn;
+    stats.ticks_per_row = ticks_per_row;
+    stats.rows = grid.total_rows;
+    stats.seconds = grid.total_rows * seconds_per_row;
+
     // Debug: print all fields of each Noise instrument
-    std::cout << "[UGE DEBUG] Noise instrument fields:" << std::endl;
+    debugLog() << "[UGE DEBUG] Noise instrument fields:" << std::endl;
     for (int i = 0; i < UGE_NUM_NOISE; ++i) {
         const auto& inst = header.instruments.noise[i];
-        std::cout << "[UGE DEBUG] NoiseInst " << i << ": name='" << std::string(inst.name.data, inst.name.length) << "'"
-                  << ", initial_volume=" << (int)inst.initial_volume
-                  << ", sweep_dir=" << inst.volume_sweep_direction
-                  << ", sweep_amt=" << (int)inst.volume_sweep_change
-                  << ", noise_mode=" << inst.noise_mode
-                  << ", length_enabled=" << (int)inst.length_enabled
-                  << ", subpattern_enabled=" << (int)inst.subpattern_enabled
-                  << std::endl;
-    }
-    // --- Debug: print first 16 rows of uge_notes after pattern filling ---
-    std::cout << "[UGE DEBUG] First 16 rows of uge_notes after pattern filling:" << std::endl;
+        debugLog() << "[UGE DEBUG] NoiseInst " << i << ": name='" << std::string(inst.name.data, inst.name.length) << "'"
+                   << ", initial_volume=" << (int)inst.initial_volume
+                   << ", sweep_dir=" << inst.volume_sweep_direction
+                   << ", sweep_amt=" << (int)inst.volume_sweep_change
+                   << ", noise_mode=" << inst.noise_mode
+                   << ", length_enabled=" << (int)inst.length_enabled
+                   << ", subpattern_enabled=" << (int)inst.subpattern_enabled
+                   << std::endl;
+    }
+    // --- Debug: print first 16 rows of grid.notes after pattern filling ---
+    debugLog() << "[UGE DEBUG] First 16 rows of grid.notes after pattern filling:" << std::endl;
     for (int row = 0; row < std::min(16, total_rows); ++row) {
-        std::cout << "Row " << row << ": ";
+        debugLog() << "Row " << row << ": ";
         for (int ch = 0; ch < 3; ++ch) {
-            std::cout << "Ch" << ch << " note=" << (int)uge_notes[ch][row]
-                      << ", inst=" << uge_instruments[ch][row]
-                      << ", vel=" << (int)uge_velocities[ch][row] << " | ";
+            debugLog() << "Ch" << ch << " note=" << (int)grid.notes[ch][row]
+                       << ", inst=" << grid.instruments[ch][row]
+                       << ", vel=" << (int)uge_velocities[ch][row] << " | ";
         }
-        std::cout << std::endl;
+        debugLog() << std::endl;
     }
     // --- Debug: print first non-empty row for each mapped UGE channel ---
     for (int ch = 0; ch < 3; ++ch) {
         int first_row = -1;
         for (int row = 0; row < total_rows; ++row) {
-            if (uge_notes[ch][row] != UGE_EMPTY_NOTE) {
+            if (grid.notes[ch][row] != UGE_EMPTY_NOTE) {
                 first_row = row;
                 break;
             }
         }
         if (first_row != -1) {
-            std::cout << "[UGE DEBUG] First non-empty row for UGE channel " << ch << " (MIDI " << midi_to_uge[ch] << "): row " << first_row
-                      << ", note=" << (int)uge_notes[ch][first_row]
-                      << ", inst=" << uge_instruments[ch][first_row]
-                      << ", vel=" << (int)uge_velocities[ch][first_row] << std::endl;
+            debugLog() << "[UGE DEBUG] First non-empty row for UGE channel " << ch << " (MIDI " << midi_to_uge[ch] << "): row " << first_row
+                       << ", note=" << (int)grid.notes[ch][first_row]
+                       << ", inst=" << grid.instruments[ch][first_row]
+                       << ", vel=" << (int)uge_velocities[ch][first_row] << std::endl;
         } else {
-            std::cout << "[UGE DEBUG] No notes found for UGE channel " << ch << " (MIDI " << midi_to_uge[ch] << ")" << std::endl;
+            debugLog() << "[UGE DEBUG] No notes found for UGE channel " << ch << " (MIDI " << midi_to_uge[ch] << ")" << std::endl;
+        }
+    }
+    if (parts.size() == 1) parts[0].song = std::move(song);
+    // Each part leads into the next; the last one back to the part holding
+    // the loop start, unless it jumps back by itself
+    for (size_t p = 0; p < parts.size(); ++p) {
+        parts[p].next = p + 1 < parts.size() ? (int)p + 1 : loop_part;
+        if (songLoops(parts[p].song)) parts[p].next = -1;
+    }
+    return true;
+}
+
+static bool convertInContext(const std::string& midiPath, std::istream* in, std::vector<SongPart>& parts, ConversionContext& context) {
+    ConversionLogScope log(context.log);
+    ProfileFileScope profile_file(midiPath);
+    context.stats = ConversionStats{};
+    bool converted = convertParts(midiPath, in, parts, context.options, context.arena.resource(), context.stats);
+    context.arena.reset();
+    if (!converted) return false;
+    ConversionStats& stats = context.stats;
+    stats.parts = parts.size();
+    for (const SongPart& part : parts) {
+        stats.patterns += part.song.patterns.size();
+        stats.orders += part.song.orders[0].size();
+        stats.driver_bytes += estimateHugeDriverSize(part.song.header, part.song.patterns, part.song.orders).total();
+    }
+    return true;
+}
+
+bool convertMidiToUgeParts(const std::string& midiPath, std::vector<SongPart>& parts, ConversionContext& context) {
+    return convertInContext(midiPath, nullptr, parts, context);
+}
+
+bool convertMidiToUgeParts(std::istream& in, const std::string& name, std::vector<SongPart>& parts, ConversionContext& context) {
+    return convertInContext(name, &in, parts, context);
+}
+
+bool convertMidiToUgeParts(const std::string& midiPath, std::vector<SongPart>& parts, const ConversionOptions& options) {
+    ConversionContext context(options);
+    return convertMidiToUgeParts(midiPath, parts, context);
+}
+
+bool convertMidiToUgeSong(const std::string& midiPath, UgeSong& song, ConversionContext& context) {
+    bool split = context.options.split_to_fit;
+    context.options.split_to_fit = false;
+    std::vector<SongPart> parts;
+    bool converted = convertMidiToUgeParts(midiPath, parts, context);
+    context.options.split_to_fit = split;
+    if (!converted) return false;
+    song = std::move(parts[0].song);
+    return true;
+}
+
+bool convertMidiToUgeSong(const std::string& midiPath, UgeSong& song, const ConversionOptions& options) {
+    ConversionContext context(options);
+    return convertMidiToUgeSong(midiPath, song, context);
+}
+
+bool convertMidiToUge(const std::string& midiPath, const std::string& ugePath, ConversionContext& context) {
+    std::vector<SongPart> parts;
+    if (!convertMidiToUgeParts(midiPath, parts, context)) return false;
+    return writeSongParts(midiPath, ugePath, parts, context);
+}
+
+bool writeSongParts(const std::string& midiPath, const std::string& ugePath, const std::vector<SongPart>& parts, ConversionContext& context) {
+    const ConversionOptions& options = context.options;
+    ConversionLogScope log(context.log);
+    ProfileFileScope profile_file(midiPath);
+    PROFILE_SCOPE("write");
+    if (parts.size() == 1) {
+        if (!writeUgeFile(ugePath, parts[0].song)) {
+            warningLog() << "Failed to write UGE file: " << ugePath << std::endl;
+            return false;
+        }
+        if (options.split_to_fit) debugLog() << "Wrote " << ugePath << std::endl;
+        return true;
+    }
+    SplitManifestSong manifest{midiPath, &parts, {}};
+    for (size_t p = 0; p < parts.size(); ++p) {
+        std::string path = splitPartPath(ugePath, p);
+        if (!writeUgeFile(path, parts[p].song)) {
+            warningLog() << "Failed to write UGE file: " << path << std::endl;
+            return false;
         }
+        manifest.names.push_back(path);
+        debugLog() << "Wrote " << path << std::endl;
     }
+    std::string manifest_path = splitManifestPath(ugePath);
+    if (!writeSplitManifest(manifest_path, {manifest}, "file", options.rom_budget_bytes)) {
+        warningLog() << "Failed to write split manifest: " << manifest_path << std::endl;
+        return false;
+    }
+    debugLog() << "Wrote " << manifest_path << std::endl;
     return true;
-} 
\ No newline at end of file
+}
+
+bool convertMidiToUge(const std::string& midiPath, const std::string& ugePath, const ConversionOptions& options) {
+    ConversionContext context(options);
+    return convertMidiToUge(midiPath, ugePath, context);
+}
@@ -1,7 +1,89 @@
 #pragma once
+#include <istream>
 #include <string>
 #include <optional>
 #include <array>
+#include <cstddef>
+#include "arena.h"
+#include "conversion_log.h"
+#include "uge_writer.h"
+#include "song_split.h"
+#include <vector>
 
-// Converts a MIDI file to a UGE file. Returns true on success.
-bool convertMidiToUge(const std::string& midiPath, const std::string& ugePath, std::optional<std::array<int, 4>> user_channel_map = std::nullopt); 
\ No newline at end of file
+struct ConversionOptions {
+    // MIDI channel for Duty1, Duty2, Wave, Noise (-1 = empty); auto-selected when unset
+    std::optional<std::array<int, 4>> channel_map = std::nullopt;
+    // hUGEDriver data budget for the whole song (one 16 KB ROM bank by default)
+    size_t rom_budget_bytes = 0x4000;
+    // Degrade oversized songs to fit the budget instead of truncating them
+    bool fit_to_budget = true;
+    // Controller changes (pitch bend, CC1, CC7) within this many effect-parameter
+    // steps of the previous one are dropped; 0 keeps every distinct change
+    int effect_tolerance = 1;
+    // Rows per pattern (16, 32, 48 or 64; shorter ones end with a D00 break),
+    // or 0 to pick the length that stores the song in the fewest bytes
+    int pattern_rows = UGE_PATTERN_ROWS;
+    // Rows per quarter note, or 0 to use the coarsest one that keeps every
+    // note onset within onset_tolerance_ms of its row
+    int rows_per_quarter = 0;
+    double onset_tolerance_ms = 10.0;
+    // Largest distance of a note start from its row when onsets are snapped
+    // to the row of their repeats; 0 allows half a row plus the clustering
+    // distance (onset_tolerance_ms, at least a quarter row)
+    double max_timing_error_ms = 0.0;
+    // Play sparse sections at fewer, longer rows with Fxx speed changes
+    bool speed_sections = true;
+    // Split a song that does not fit the budget into parts that each do,
+    // instead of reducing or truncating it (see convertMidiToUgeParts)
+    bool split_to_fit = false;
+};
+
+// Figures of a finished conversion; patterns, orders and bytes are summed
+// over the parts of a split song
+struct ConversionStats {
+    int ticks_per_quarter = 0; // of the MIDI file
+    int rows_per_quarter = 0;
+    int ticks_per_row = 0;
+    int rows = 0;              // before speed sections merge any
+    double seconds = 0.0;
+    int parts = 0;
+    int patterns = 0;
+    int orders = 0;            // per channel
+    size_t driver_bytes = 0;   // hUGEDriver data, as estimated for the budget
+};
+
+// Everything a conversion works with besides its input: the options, where
+// it logs, the arena for its scratch data and the stats it leaves behind.
+// One context serves one conversion at a time and can be reused for the
+// next; conversions on different contexts share no mutable state, so they
+// can run on as many threads at once.
+struct ConversionContext {
+    ConversionOptions options;
+    ConversionLog log;
+    ConversionArena arena;
+    ConversionStats stats;
+
+    ConversionContext() = default;
+    explicit ConversionContext(const ConversionOptions& options) : options(options) {}
+};
+
+// Converts a MIDI file to a UGE file. Returns true on success. A song split
+// by options.split_to_fit is written as <name>_part1.uge, <name>_part2.uge, ...
+// with a <name>_parts.json manifest that describes how to chain them.
+bool convertMidiToUge(const std::string& midiPath, const std::string& ugePath, ConversionContext& context);
+bool convertMidiToUge(const std::string& midiPath, const std::string& ugePath, const ConversionOptions& options = ConversionOptions());
+
+// The writing half of convertMidiToUge, for parts already converted from midiPath
+bool writeSongParts(const std::string& midiPath, const std::string& ugePath, const std::vector<SongPart>& parts, ConversionContext& context);
+
+// Converts a MIDI file into an in-memory song (header, patterns, orders) without writing it.
+bool convertMidiToUgeSong(const std::string& midiPath, UgeSong& song, ConversionContext& context);
+bool convertMidiToUgeSong(const std::string& midiPath, UgeSong& song, const ConversionOptions& options = ConversionOptions());
+
+// Converts a MIDI file into one part, or with options.split_to_fit into as
+// many parts as it takes for each to fit options.rom_budget_bytes and 256
+// orders, split on bar lines. context.stats is replaced and the arena reset.
+bool convertMidiToUgeParts(const std::string& midiPath, std::vector<SongPart>& parts, ConversionContext& context);
+// The same, reading the MIDI data from in; name stands for the file in the log
+bool convertMidiToUgeParts(std::istream& in, const std::string& name, std::vector<SongPart>& parts, ConversionContext& context);
+bool convertMidiToUgeParts(const std::string& midiPath, std::vector<SongPart>& parts, const ConversionOptions& options = ConversionOptions());
@@ -0,0 +1,329 @@
+#include "patterns.h"
+#include "hugedriver.h"
+#include "conversion_log.h"
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+UgeRowGrid::UgeRowGrid(std::pmr::memory_resource* resource)
+    : notes(makeChannelRows<uint8_t>(resource)),
+      instruments(makeChannelRows<int>(resource)),
+      effects(makeChannelRows<uint8_t>(resource)),
+      effect_params(makeChannelRows<uint8_t>(resource)) {}
+
+UgeRowGrid::UgeRowGrid(const UgeRowGrid& other) : UgeRowGrid(other.resource()) { *this = other; }
+
+void UgeRowGrid::resize(int rows) {
+    total_rows = rows;
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        notes[ch].assign(rows, UGE_EMPTY_NOTE);
+        instruments[ch].assign(rows, 0);
+        effects[ch].assign(rows, 0);
+        effect_params[ch].assign(rows, 0);
+    }
+}
+
+int pageRowsAt(const std::vector<int>& section_starts, int page_start, int page_rows) {
+    auto next = std::upper_bound(section_starts.begin(), section_starts.end(), page_start);
+    return next == section_starts.end() ? page_rows : std::min(page_rows, *next - page_start);
+}
+
+// --- Note-start encoding ---
+
+static constexpr uint8_t EFFECT_NOTE_CUT = 0xE;
+
+NoteEncodingReport encodeNoteStarts(UgeRowGrid& grid, const ChannelRows<uint8_t>& onsets) {
+    NoteEncodingReport report;
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        std::pmr::vector<uint8_t> held(grid.notes[ch], grid.resource());
+        for (int row = 0; row < grid.total_rows; ++row) {
+            bool sounding = held[row] != UGE_EMPTY_NOTE;
+            bool was_sounding = row > 0 && held[row - 1] != UGE_EMPTY_NOTE;
+            if (sounding) ++report.held_cells;
+            bool struck = sounding && (onsets[ch][row] || !was_sounding || held[row - 1] != held[row]);
+            if (struck) {
+                ++report.note_cells;
+                continue;
+            }
+            grid.notes[ch][row] = UGE_EMPTY_NOTE;
+            grid.instruments[ch][row] = 0;
+            // A one-row gap before the next note is articulation the row grid
+            // cannot resolve reliably, so the next note ends this one instead
+            bool next_struck = row + 1 < grid.total_rows && held[row + 1] != UGE_EMPTY_NOTE;
+            // An effect already on that row (tempo, panning, ...) is kept and
+            // the note rings on instead
+            if (!sounding && was_sounding && !next_struck && ch != 3) {
+                if (grid.effects[ch][row] != 0 || grid.effect_params[ch][row] != 0) {
+                    ++report.cuts_skipped;
+                    continue;
+                }
+                grid.effects[ch][row] = EFFECT_NOTE_CUT;
+                grid.effect_params[ch][row] = 0;
+                ++report.cut_cells;
+            }
+        }
+    }
+    return report;
+}
+
+// --- Rolling page hashes ---
+// Row hashes are combined with a polynomial over 2^64; the grid is padded with
+// one page of empty rows on each side so pages may start before row 0 or run
+// past the end of the song.
+static constexpr uint64_t PAGE_HASH_BASE = 0x100000001b3ULL;
+
+static uint64_t hashRow(uint8_t note, int inst, uint8_t eff, uint8_t eff_param) {
+    uint64_t h = (uint64_t(note) << 24) | (uint64_t(uint8_t(inst)) << 16) | (uint64_t(eff) << 8) | eff_param;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h + 1;
+}
+
+PageHasher::PageHasher(const UgeRowGrid& grid)
+    : total_rows(grid.total_rows), prefix(makeChannelRows<uint64_t>(grid.resource())), powers(grid.resource()), hash_buffer(grid.resource()) {
+    const int padded = total_rows + 2 * UGE_PATTERN_ROWS;
+    const uint64_t empty = hashRow(UGE_EMPTY_NOTE, 0, 0, 0);
+    powers.resize(padded + 1);
+    powers[0] = 1;
+    for (int i = 1; i <= padded; ++i) powers[i] = powers[i - 1] * PAGE_HASH_BASE;
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        prefix[ch].resize(padded + 1);
+        prefix[ch][0] = 0;
+        for (int i = 0; i < padded; ++i) {
+            int row = i - UGE_PATTERN_ROWS;
+            uint64_t h = (row >= 0 && row < total_rows)
+                ? hashRow(grid.notes[ch][row], grid.instruments[ch][row], grid.effects[ch][row], grid.effect_params[ch][row])
+                : empty;
+            prefix[ch][i + 1] = prefix[ch][i] * PAGE_HASH_BASE + h;
+        }
+    }
+}
+
+uint64_t PageHasher::pageHash(int ch, int start_row, int rows) const {
+    // Clamp into the padded range; everything outside it is empty anyway
+    int lo = std::max(0, std::min(start_row + UGE_PATTERN_ROWS, (int)prefix[ch].size() - 1 - rows));
+    int hi = lo + rows;
+    return prefix[ch][hi] - prefix[ch][lo] * powers[rows];
+}
+
+int countUniquePages(const PageHasher& hasher, int start_row, int end_row, const std::vector<int>& section_starts) {
+    int unique = 0;
+    std::pmr::vector<uint64_t>& hashes = hasher.hashBuffer();
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        hashes.clear();
+        for (int row = start_row, rows; row < end_row; row += rows) {
+            rows = pageRowsAt(section_starts, row, UGE_PATTERN_ROWS);
+            hashes.push_back(hasher.pageHash(ch, row, rows));
+        }
+        std::sort(hashes.begin(), hashes.end());
+        unique += std::unique(hashes.begin(), hashes.end()) - hashes.begin();
+    }
+    return unique;
+}
+
+// Floor division that also rounds negative numerators down
+static int floorDiv(int a, int b) {
+    return a / b - ((a % b != 0) && ((a < 0) != (b < 0)));
+}
+
+int firstNonEmptyRow(const UgeRowGrid& grid) {
+    for (int row = 0; row < grid.total_rows; ++row) {
+        for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+            if (grid.notes[ch][row] != UGE_EMPTY_NOTE) return row;
+        }
+    }
+    return grid.total_rows;
+}
+
+int findBestPatternPhase(const UgeRowGrid& grid, const BarGrid& bars) {
+    int first_nonempty_row = firstNonEmptyRow(grid);
+    int legacy_start = (first_nonempty_row / UGE_PATTERN_ROWS) * UGE_PATTERN_ROWS;
+    if (first_nonempty_row >= grid.total_rows) return legacy_start;
+
+    // Candidate page starts, in order of preference when scores tie:
+    // the page-aligned start, then bar lines, then beat lines
+    std::vector<int> candidates = {legacy_start};
+    auto addLines = [&](int spacing) {
+        if (spacing <= 0) return;
+        int lowest = first_nonempty_row - UGE_PATTERN_ROWS + 1;
+        int k = floorDiv(lowest - bars.origin_row + spacing - 1, spacing);
+        for (int row = bars.origin_row + k * spacing; row <= first_nonempty_row; row += spacing) {
+            if (std::find(candidates.begin(), candidates.end(), row) == candidates.end()) candidates.push_back(row);
+        }
+    };
+    addLines(bars.rows_per_bar);
+    addLines(bars.rows_per_beat);
+
+    PageHasher hasher(grid);
+    int best_start = legacy_start;
+    int best_unique = countUniquePages(hasher, legacy_start, grid.total_rows, grid.section_starts);
+    int legacy_unique = best_unique;
+    for (int start : candidates) {
+        int unique = countUniquePages(hasher, start, grid.total_rows, grid.section_starts);
+        if (unique < best_unique) {
+            best_unique = unique;
+            best_start = start;
+        }
+    }
+    debugLog() << "[UGE DEBUG] Pattern phase: tried " << candidates.size() << " start rows, picked row " << best_start
+               << " (" << best_unique << " unique patterns; page-aligned start " << legacy_start << " gives " << legacy_unique << ")" << std::endl;
+    return best_start;
+}
+
+int freeEffectChannel(const UgeRowGrid& grid, int row) {
+    if (row < 0 || row >= grid.total_rows) return 0;
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        if (grid.effects[ch][row] == 0 && grid.effect_params[ch][row] == 0) return ch;
+    }
+    return -1;
+}
+
+int buildPatterns(const UgeRowGrid& grid, int start_row, std::vector<UgePattern>& patterns, UgeOrderMatrix& orders, const SongLoop* loop, int page_rows) {
+    auto inGrid = [&](int song_row) { return song_row >= 0 && song_row < grid.total_rows; };
+    // --- Page layout, shared by all channels ---
+    // Pages of page_rows from start_row to the end of the song; pages shorter
+    // than a pattern end with a D00. With a loop, the page running into
+    // loop->start_row is cut short the same way, and the page holding
+    // loop->end_row - 1 ends there with a jump.
+    struct Page { int start, rows, break_channel; };
+    std::pmr::vector<Page> pages(grid.resource());
+    int song_end = loop ? loop->end_row : grid.total_rows;
+    int loop_order = -1;
+    int overwritten = 0;
+    for (int page_start = start_row; page_start < song_end;) {
+        int rows = pageRowsAt(grid.section_starts, page_start, page_rows);
+        if (loop) rows = std::min(rows, song_end - page_start);
+        if (loop && page_start < loop->start_row && page_start + rows > loop->start_row) rows = loop->start_row - page_start;
+        if (loop && page_start == loop->start_row) loop_order = pages.size();
+        int break_channel = -1;
+        if (loop && page_start + rows == loop->end_row) {
+            break_channel = -1; // the jump ends it
+        } else if (loop && page_start + rows == loop->start_row && loop->break_channel >= 0) {
+            break_channel = loop->break_channel;
+        } else if (rows < UGE_PATTERN_ROWS) {
+            break_channel = freeEffectChannel(grid, page_start + rows - 1);
+            if (break_channel < 0) {
+                break_channel = 0; // every channel busy: the break wins over that effect
+                ++overwritten;
+            }
+        }
+        pages.push_back({page_start, rows, break_channel});
+        page_start += rows;
+    }
+    std::hash<std::string_view> hasher;
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        // Map: pattern hash -> pattern index, per channel
+        std::pmr::unordered_map<size_t, int> pattern_hash_to_index(grid.resource());
+        orders[ch].clear();
+        for (const Page& page : pages) {
+            UgePattern p{};
+            for (int row = 0; row < UGE_PATTERN_ROWS; ++row) {
+                int song_row = page.start + row;
+                bool in = row < page.rows && inGrid(song_row);
+                p.rows[row].note = in ? grid.notes[ch][song_row] : UGE_EMPTY_NOTE;
+                p.rows[row].instrument = in ? grid.instruments[ch][song_row] : 0;
+                p.rows[row].effect = in ? grid.effects[ch][song_row] : 0;
+                p.rows[row].effect_param = in ? grid.effect_params[ch][song_row] : 0;
+                p.rows[row].unused1 = 0;
+                if (ch == page.break_channel && row == page.rows - 1) {
+                    p.rows[row].effect = EFFECT_PATTERN_BREAK;
+                    p.rows[row].effect_param = 0;
+                }
+                if (loop && in && ch == loop->speed_channel && song_row == loop->start_row) {
+                    p.rows[row].effect = EFFECT_SET_SPEED;
+                    p.rows[row].effect_param = loop->speed;
+                }
+                if (loop && in && ch == loop->jump_channel && song_row == loop->end_row - 1) {
+                    p.rows[row].effect = EFFECT_POSITION_JUMP;
+                    p.rows[row].effect_param = std::max(0, loop_order);
+                }
+            }
+            // Pattern data for hashing, on the stack: this runs for every page
+            std::array<char, UGE_PATTERN_ROWS * 4> pat_data;
+            for (int row = 0; row < UGE_PATTERN_ROWS; ++row) {
+                const auto& r = p.rows[row];
+                pat_data[row * 4] = r.note;
+                pat_data[row * 4 + 1] = r.instrument;
+                pat_data[row * 4 + 2] = r.effect;
+                pat_data[row * 4 + 3] = r.effect_param;
+            }
+            size_t hash = hasher(std::string_view(pat_data.data(), pat_data.size()));
+            auto it = pattern_hash_to_index.find(hash);
+            int pat_idx;
+            if (it != pattern_hash_to_index.end()) {
+                pat_idx = it->second; // Reuse existing pattern
+            } else {
+                p.index = patterns.size();
+                pat_idx = p.index;
+                pattern_hash_to_index[hash] = pat_idx;
+                patterns.push_back(p);
+            }
+            orders[ch].push_back(pat_idx);
+        }
+    }
+    return overwritten;
+}
+
+int choosePatternRows(const UgeRowGrid& grid, int start_row, int max_orders) {
+    PageHasher hasher(grid);
+    int best_rows = UGE_PATTERN_ROWS;
+    size_t best_bytes = SIZE_MAX;
+    std::ostringstream summary;
+    for (int rows : PATTERN_ROW_CHOICES) {
+        // A page that holds the D00 differs from the same rows without it
+        constexpr uint64_t BREAK_SALT = 0x9e3779b97f4a7c15ULL;
+        std::array<std::unordered_set<uint64_t>, UGE_NUM_CHANNELS> unique;
+        size_t pages = 0;
+        bool feasible = true;
+        for (int page_start = start_row, page; page_start < grid.total_rows && feasible; page_start += page, ++pages) {
+            page = pageRowsAt(grid.section_starts, page_start, rows);
+            int break_channel = page < UGE_PATTERN_ROWS ? freeEffectChannel(grid, page_start + page - 1) : -1;
+            feasible = page == UGE_PATTERN_ROWS || break_channel >= 0 || page < rows;
+            for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+                unique[ch].insert(hasher.pageHash(ch, page_start, page) ^ (ch == break_channel ? BREAK_SALT : 0));
+            }
+        }
+        if (!feasible) {
+            summary << " " << rows << ": no free break cell;";
+            continue;
+        }
+        if ((int)pages > max_orders && rows < UGE_PATTERN_ROWS) {
+            summary << " " << rows << ": " << pages << " orders;";
+            continue;
+        }
+        size_t unique_pages = 0;
+        for (const auto& u : unique) unique_pages += u.size();
+        // Rows after a break are never read, so the export leaves them out
+        size_t bytes = unique_pages * rows * HUGE_ROW_BYTES + pages * UGE_NUM_CHANNELS * HUGE_ORDER_ENTRY_BYTES;
+        summary << " " << rows << ": " << bytes << " bytes;";
+        if (bytes < best_bytes || (bytes == best_bytes && rows > best_rows)) {
+            best_bytes = bytes;
+            best_rows = rows;
+        }
+    }
+    debugLog() << "[UGE DEBUG] Pattern length:" << summary.str() << " picked " << best_rows << " rows" << std::endl;
+    return best_rows;
+}
+
+void truncateOrders(std::vector<UgePattern>& patterns, UgeOrderMatrix& orders, int keep_orders) {
+    std::vector<int> remap(patterns.size(), -1);
+    std::vector<UgePattern> kept;
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        if ((int)orders[ch].size() > keep_orders) orders[ch].resize(std::max(0, keep_orders));
+        for (auto& idx : orders[ch]) {
+            if (remap[idx] < 0) {
+                remap[idx] = kept.size();
+                kept.push_back(patterns[idx]);
+                kept.back().index = remap[idx];
+            }
+            idx = remap[idx];
+        }
+    }
+    patterns.swap(kept);
+}
@@ -0,0 +1,141 @@
+#pragma once
+#include "arena.h"
+#include "uge_writer.h"
+#include <cstdint>
+#include <array>
+#include <memory_resource>
+#include <vector>
+
+constexpr int UGE_EMPTY_NOTE = 90;
+
+constexpr uint8_t EFFECT_POSITION_JUMP = 0xB; // Bxx: continue at order xx
+constexpr uint8_t EFFECT_PATTERN_BREAK = 0xD; // Dxx: continue at row xx of the next order
+constexpr uint8_t EFFECT_SET_SPEED = 0xF;     // Fxx: xx ticks per row from this row on
+
+// One row vector per channel, allocated from a memory resource (the
+// conversion's arena, see arena.h)
+template <typename T>
+using ChannelRows = std::array<std::pmr::vector<T>, UGE_NUM_CHANNELS>;
+
+template <typename T>
+ChannelRows<T> makeChannelRows(std::pmr::memory_resource* resource) {
+    return arenaArray<std::pmr::vector<T>, UGE_NUM_CHANNELS>(resource);
+}
+
+// Per-channel row grid built by convertMidiToUge (one entry per song row)
+struct UgeRowGrid {
+    explicit UgeRowGrid(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+    // A copy allocates from the same resource as the grid it copies
+    UgeRowGrid(const UgeRowGrid& other);
+    UgeRowGrid(UgeRowGrid&&) = default;
+    UgeRowGrid& operator=(const UgeRowGrid&) = default;
+    UgeRowGrid& operator=(UgeRowGrid&&) = default;
+
+    std::pmr::memory_resource* resource() const { return notes[0].get_allocator().resource(); }
+
+    int total_rows = 0;
+    ChannelRows<uint8_t> notes;
+    ChannelRows<int> instruments;
+    ChannelRows<uint8_t> effects;
+    ChannelRows<uint8_t> effect_params;
+    std::vector<int> section_starts; // ascending rows that always start a new page (speed sections)
+    int loop_start_row = -1;         // from the MIDI loop markers: after the last row the song jumps back here
+    bool chained = false;            // a part of a split song that another part follows: it must not loop
+
+    void resize(int rows);
+};
+
+struct NoteEncodingReport {
+    int held_cells = 0; // note cells before, one per sounding row
+    int note_cells = 0;
+    int cut_cells = 0;
+    int cuts_skipped = 0; // rows that already held an effect, so the note rings on
+};
+
+// Converts a grid holding a note on every row it sounds into the form
+// hUGEDriver plays: note and instrument only where a note is struck
+// (onsets[ch][row] != 0, or the pitch changes), empty rows while it is
+// held, and an E00 note cut on the row after it ends unless another note
+// starts there or the row already has an effect. The noise channel gets no
+// cuts; its hits end with their envelope and length.
+NoteEncodingReport encodeNoteStarts(UgeRowGrid& grid, const ChannelRows<uint8_t>& onsets);
+
+// Polynomial prefix hashes over each channel's rows, so the hash of any
+// page can be taken in O(1) regardless of where the page starts.
+// Rows outside [0, total_rows) hash as empty rows. The prefix tables come
+// from the grid's memory resource.
+class PageHasher {
+public:
+    explicit PageHasher(const UgeRowGrid& grid);
+    uint64_t pageHash(int ch, int start_row, int rows = UGE_PATTERN_ROWS) const;
+    std::pmr::memory_resource* resource() const { return powers.get_allocator().resource(); }
+    // Reused by every countUniquePages over this hasher, so trying many
+    // page phases does not pile up sets in the conversion arena
+    std::pmr::vector<uint64_t>& hashBuffer() const { return hash_buffer; }
+private:
+    int total_rows;
+    ChannelRows<uint64_t> prefix;
+    std::pmr::vector<uint64_t> powers;
+    mutable std::pmr::vector<uint64_t> hash_buffer;
+};
+
+// Rows of the page from page_start: page_rows, or fewer when one of
+// section_starts comes sooner
+int pageRowsAt(const std::vector<int>& section_starts, int page_start, int page_rows);
+
+// Number of unique pages per channel (summed) when the song is cut into
+// UGE_PATTERN_ROWS pages starting at start_row (and at each of section_starts).
+int countUniquePages(const PageHasher& hasher, int start_row, int end_row, const std::vector<int>& section_starts = {});
+
+// Bar lines of the song in rows, from the MIDI time signature
+struct BarGrid {
+    int origin_row = 0;
+    int rows_per_bar = 0;
+    int rows_per_beat = 0;
+};
+
+// First row with a note on any channel (total_rows if the grid is empty)
+int firstNonEmptyRow(const UgeRowGrid& grid);
+
+// Tries every bar/beat line within one page of the first note as a page
+// start and returns the one with the fewest unique patterns. Falls back to
+// the page-aligned start when nothing beats it.
+int findBestPatternPhase(const UgeRowGrid& grid, const BarGrid& bars);
+
+// Song loop in grid rows: playback runs up to end_row, then jumps back to
+// start_row (rows from end_row on are not written)
+struct SongLoop {
+    int start_row = 0;
+    int end_row = 0;
+    int jump_channel = 0;   // channel that gets the Bxx on row end_row - 1
+    int break_channel = -1; // channel that gets a D00 on row start_row - 1 when start_row is not on a page line
+    int speed_channel = -1; // channel that gets an Fxx on row start_row when the speed after the jump would differ
+    uint8_t speed = 0;
+};
+
+// First channel with no effect on row (0 outside the grid), or -1 when all
+// four hold one. Jumps and breaks go there.
+int freeEffectChannel(const UgeRowGrid& grid, int row);
+
+// Cuts the grid into pages of page_rows from start_row (and from each of
+// grid.section_starts), dedups identical pages per channel and appends them
+// to patterns/orders. Pages shorter than UGE_PATTERN_ROWS end with a D00 and
+// leave the rest of the pattern empty.
+// With a loop, a page boundary is forced at loop->start_row and the song
+// ends with a jump back to it.
+// Returns how many effects a D00 replaced, on page ends where every
+// channel already holds an effect.
+int buildPatterns(const UgeRowGrid& grid, int start_row, std::vector<UgePattern>& patterns, UgeOrderMatrix& orders, const SongLoop* loop = nullptr, int page_rows = UGE_PATTERN_ROWS);
+
+// Pattern lengths tried by choosePatternRows
+constexpr int PATTERN_ROW_CHOICES[] = {16, 32, 48, 64};
+
+// Picks the page length from PATTERN_ROW_CHOICES that gives the fewest
+// exported pattern and order bytes from start_row, using the rolling page
+// hashes (no patterns are built). Lengths whose breaks would find no free
+// effect cell, or that need more than max_orders order rows, are skipped.
+int choosePatternRows(const UgeRowGrid& grid, int start_row, int max_orders);
+
+// Keeps the first keep_orders order rows, drops patterns that are no longer
+// referenced and renumbers the rest.
+void truncateOrders(std::vector<UgePattern>& patterns, UgeOrderMatrix& orders, int keep_orders);
@@ -0,0 +1,171 @@
+#include "profiler.h"
+#include <iostream>
+#include <string>
+
+bool parseProfileFlag(int argc, char* argv[], int& i, ProfileOutput& output) {
+    std::string arg = argv[i];
+    if (arg == "--profile") {
+        output.summary = true;
+    } else if (arg == "--profile-trace" && i + 1 < argc) {
+        output.trace_path = argv[++i];
+    } else {
+        return false;
+    }
+#if MIDI2UGE_PROFILING
+    setProfilingEnabled(true);
+#else
+    std::cerr << "Profiling is not built in (configure with -DMIDI2UGE_PROFILING=ON)" << std::endl;
+#endif
+    return true;
+}
+
+#if MIDI2UGE_PROFILING
+
+#include "nlohmann_json.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+std::atomic<bool> g_profiling_enabled{false};
+
+namespace {
+
+struct ProfileSpan {
+    const char* name;
+    std::string file;
+    int thread;
+    int64_t start_us;
+    int64_t duration_us;
+    uint64_t allocs;
+    uint64_t alloc_bytes;
+    int64_t peak_bytes;
+};
+
+std::mutex g_spans_mutex;
+std::vector<ProfileSpan> g_spans;
+int g_next_thread = 0;
+
+thread_local const std::string* t_file = nullptr;
+thread_local int t_thread = -1;
+
+const std::chrono::steady_clock::time_point g_epoch = std::chrono::steady_clock::now();
+
+int64_t nowUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - g_epoch).count();
+}
+
+} // namespace
+
+void setProfilingEnabled(bool enabled) { g_profiling_enabled.store(enabled, std::memory_order_relaxed); }
+
+void ProfileStage::begin(const char* name) {
+    name_ = name;
+#if MIDI2UGE_ALLOC_TRACKING
+    beginAllocStage(alloc_);
+#endif
+    start_us_ = nowUs();
+}
+
+void ProfileStage::end() {
+    int64_t duration = nowUs() - start_us_;
+#if MIDI2UGE_ALLOC_TRACKING
+    endAllocStage(alloc_); // before the span record allocates
+    ProfileSpan span{name_, t_file ? *t_file : std::string(), 0, start_us_, duration, alloc_.count, alloc_.bytes, alloc_.peak};
+#else
+    ProfileSpan span{name_, t_file ? *t_file : std::string(), 0, start_us_, duration, 0, 0, 0};
+#endif
+    name_ = nullptr;
+    std::lock_guard<std::mutex> lock(g_spans_mutex);
+    if (t_thread < 0) t_thread = g_next_thread++;
+    span.thread = t_thread;
+    g_spans.push_back(std::move(span));
+}
+
+ProfileFileScope::ProfileFileScope(const std::string& path) : previous_(t_file) { t_file = &path; }
+
+ProfileFileScope::~ProfileFileScope() { t_file = previous_; }
+
+void printProfileSummary(std::ostream& out) {
+    struct StageTotal {
+        int calls = 0;
+        int64_t total_us = 0;
+        int64_t max_us = 0;
+        int64_t first_us = 0;
+        uint64_t allocs = 0;
+        uint64_t alloc_bytes = 0;
+        int64_t peak_bytes = 0;
+    };
+    std::map<std::string, StageTotal> totals;
+    {
+        std::lock_guard<std::mutex> lock(g_spans_mutex);
+        for (const ProfileSpan& span : g_spans) {
+            auto inserted = totals.emplace(span.name, StageTotal{});
+            StageTotal& t = inserted.first->second;
+            if (inserted.second) t.first_us = span.start_us;
+            t.calls++;
+            t.total_us += span.duration_us;
+            t.max_us = std::max(t.max_us, span.duration_us);
+            t.allocs += span.allocs;
+            t.alloc_bytes += span.alloc_bytes;
+            t.peak_bytes = std::max(t.peak_bytes, span.peak_bytes);
+        }
+    }
+    // Stages in the order they first ran
+    std::vector<std::pair<std::string, StageTotal>> rows(totals.begin(), totals.end());
+    std::stable_sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) { return a.second.first_us < b.second.first_us; });
+    out << "[UGE PROFILE] " << std::left << std::setw(20) << "stage" << std::right << std::setw(8) << "calls"
+        << std::setw(12) << "total ms" << std::setw(12) << "mean ms" << std::setw(12) << "max ms";
+#if MIDI2UGE_ALLOC_TRACKING
+    out << std::setw(10) << "allocs" << std::setw(14) << "alloc KiB" << std::setw(12) << "peak KiB";
+#endif
+    out << "\n";
+    out << std::fixed << std::setprecision(3);
+    for (const auto& row : rows) {
+        const StageTotal& t = row.second;
+        out << "[UGE PROFILE] " << std::left << std::setw(20) << row.first << std::right << std::setw(8) << t.calls
+            << std::setw(12) << t.total_us / 1000.0 << std::setw(12) << t.total_us / 1000.0 / t.calls
+            << std::setw(12) << t.max_us / 1000.0;
+#if MIDI2UGE_ALLOC_TRACKING
+        out << std::setw(10) << t.allocs << std::setw(14) << t.alloc_bytes / 1024.0 << std::setw(12) << t.peak_bytes / 1024.0;
+#endif
+        out << "\n";
+    }
+#if MIDI2UGE_ALLOC_TRACKING
+    AllocTotals process = allocTotals();
+    out << "[UGE PROFILE] process: " << process.count << " allocations, " << process.bytes / 1024.0 << " KiB allocated, peak "
+        << process.peak / 1024.0 << " KiB live\n";
+#endif
+    out << std::defaultfloat << std::flush;
+}
+
+bool writeProfileTrace(const std::string& path) {
+    nlohmann::json events = nlohmann::json::array();
+    {
+        std::lock_guard<std::mutex> lock(g_spans_mutex);
+        for (const ProfileSpan& span : g_spans) {
+            nlohmann::json event = {
+                {"name", span.name}, {"cat", "midi2uge"}, {"ph", "X"},
+                {"ts", span.start_us}, {"dur", span.duration_us},
+                {"pid", 1}, {"tid", span.thread},
+            };
+            if (!span.file.empty()) event["args"]["file"] = span.file;
+#if MIDI2UGE_ALLOC_TRACKING
+            event["args"]["allocs"] = span.allocs;
+            event["args"]["alloc_bytes"] = span.alloc_bytes;
+            event["args"]["peak_bytes"] = span.peak_bytes;
+#endif
+            events.push_back(std::move(event));
+        }
+    }
+    std::ofstream out(path, std::ios::trunc);
+    if (!out) return false;
+    out << nlohmann::json{{"traceEvents", events}, {"displayTimeUnit", "ms"}}.dump() << std::endl;
+    return bool(out);
+}
+
+#endif
@@ -0,0 +1,120 @@
+#pragma once
+#include "alloc_tracking.h"
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <ostream>
+#include <string>
+
+// Stage timers for --profile. Configure with -DMIDI2UGE_PROFILING=OFF to
+// compile them out entirely; when built in but not enabled, a timer is one
+// relaxed atomic load and never reads the clock.
+#ifndef MIDI2UGE_PROFILING
+#define MIDI2UGE_PROFILING 1
+#endif
+
+#if MIDI2UGE_PROFILING
+
+extern std::atomic<bool> g_profiling_enabled;
+
+inline bool profilingEnabled() { return g_profiling_enabled.load(std::memory_order_relaxed); }
+void setProfilingEnabled(bool enabled);
+
+// Times one stage from construction to destruction, or a run of stages:
+// next() ends the current span and starts the following one, so a long
+// function can be split into stages without adding scopes around its code.
+// Names must be string literals (they are stored by pointer).
+class ProfileStage {
+public:
+    explicit ProfileStage(const char* name) { if (profilingEnabled()) begin(name); }
+    ~ProfileStage() { stop(); }
+    ProfileStage(const ProfileStage&) = delete;
+    ProfileStage& operator=(const ProfileStage&) = delete;
+
+    void next(const char* name) {
+        stop();
+        if (profilingEnabled()) begin(name);
+    }
+    void stop() {
+        if (name_) end();
+    }
+
+private:
+    void begin(const char* name);
+    void end();
+    const char* name_ = nullptr;
+    int64_t start_us_ = 0;
+#if MIDI2UGE_ALLOC_TRACKING
+    AllocCounters alloc_;
+#endif
+};
+
+// Tags the spans recorded on this thread with the file being converted,
+// until the scope ends. Only a pointer to path is kept (it is copied into
+// the spans recorded), so path must outlive the scope.
+class ProfileFileScope {
+public:
+    explicit ProfileFileScope(const std::string& path);
+    explicit ProfileFileScope(std::string&&) = delete;
+    ~ProfileFileScope();
+    ProfileFileScope(const ProfileFileScope&) = delete;
+    ProfileFileScope& operator=(const ProfileFileScope&) = delete;
+
+private:
+    const std::string* previous_;
+};
+
+// Per-stage table: calls, total, mean and longest span. Nested stages are
+// counted in their parent's total as well. In an allocation-tracking build
+// the table also lists each stage's allocations and its largest peak.
+void printProfileSummary(std::ostream& out);
+
+// All spans as Chrome trace-event JSON (chrome://tracing, Perfetto), one
+// complete event per span with the file in its arguments and one track per thread
+bool writeProfileTrace(const std::string& path);
+
+#else
+
+inline bool profilingEnabled() { return false; }
+inline void setProfilingEnabled(bool) {}
+
+class ProfileStage {
+public:
+    explicit ProfileStage(const char*) {}
+    void next(const char*) {}
+    void stop() {}
+};
+
+class ProfileFileScope {
+public:
+    explicit ProfileFileScope(const std::string&) {}
+    explicit ProfileFileScope(std::string&&) = delete;
+};
+
+inline void printProfileSummary(std::ostream&) {}
+inline bool writeProfileTrace(const std::string&) { return true; }
+
+#endif
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+// Times the rest of the enclosing scope as one stage
+#define PROFILE_SCOPE(name) ProfileStage PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+
+// Output requested on the command line, produced when main returns
+struct ProfileOutput {
+    bool summary = false;
+    std::string trace_path;
+
+    ~ProfileOutput() {
+        if (summary) printProfileSummary(std::cerr);
+        if (!trace_path.empty()) {
+            if (writeProfileTrace(trace_path)) std::cerr << "Wrote " << trace_path << std::endl;
+            else std::cerr << "Failed to write " << trace_path << std::endl;
+        }
+    }
+};
+
+// Handles --profile and --profile-trace <file.json> at argv[i]; returns
+// false for any other argument
+bool parseProfileFlag(int argc, char* argv[], int& i, ProfileOutput& output);
@@ -0,0 +1,240 @@
+#include "rom_budget.h"
+#include "hugedriver.h"
+#include "song_loop.h"
+#include "conversion_log.h"
+#include <algorithm>
+#include <iterator>
+
+namespace {
+
+// One point on the degradation ladder; each level includes all the ones before it
+struct Reduction {
+    int effect_level = 0;      // 0 = untouched, 1 = quantized params, 2 = effects on note rows only
+    int merge_cells = 0;       // patterns differing in at most this many rows are merged
+    int row_factor = 1;        // rows merged into one
+    int dropped_voices = 0;    // taken from VOICE_DROP_ORDER
+};
+
+constexpr int VOICE_DROP_ORDER[] = {2, 1, 3}; // Wave, Duty 2, Noise; Duty 1 is always kept
+const char* const VOICE_NAMES[] = {"Duty 1", "Duty 2", "Wave", "Noise"};
+
+std::vector<std::string> describe(const Reduction& step) {
+    std::vector<std::string> out;
+    if (step.effect_level >= 1) out.push_back("quantized effect parameters");
+    if (step.effect_level >= 2) out.push_back("dropped effects on rows without a note");
+    if (step.merge_cells > 0) out.push_back("merged patterns differing in up to " + std::to_string(step.merge_cells) + (step.merge_cells == 1 ? " row" : " rows"));
+    if (step.row_factor > 1) out.push_back("reduced row resolution " + std::to_string(step.row_factor) + "x");
+    for (int i = 0; i < step.dropped_voices; ++i) out.push_back(std::string("dropped ") + VOICE_NAMES[VOICE_DROP_ORDER[i]] + " voice");
+    return out;
+}
+
+bool isStructuralEffect(uint8_t eff) {
+    return eff == EFFECT_POSITION_JUMP || eff == EFFECT_PATTERN_BREAK || eff == 0xE || eff == EFFECT_SET_SPEED; // jump, break, note cut, speed
+}
+
+void coarsenEffects(UgeRowGrid& grid, int level) {
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        for (int row = 0; row < grid.total_rows; ++row) {
+            uint8_t& eff = grid.effects[ch][row];
+            uint8_t& param = grid.effect_params[ch][row];
+            if (eff == 0 && param == 0) continue;
+            if (isStructuralEffect(eff)) continue;
+            if (level >= 2 && grid.notes[ch][row] == UGE_EMPTY_NOTE) {
+                eff = 0;
+                param = 0;
+                continue;
+            }
+            // Drop the lowest bit of each nibble (depth/speed, volume)
+            param &= 0xEE;
+        }
+    }
+}
+
+void reduceRowResolution(UgeRowGrid& grid, UgeSongHeader& header, BarGrid& bars, int factor) {
+    if (factor <= 1) return;
+    UgeRowGrid coarse(grid.resource());
+    coarse.resize((grid.total_rows + factor - 1) / factor);
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        for (int row = 0; row < coarse.total_rows; ++row) {
+            // Keep the first note and the first effect found in the merged rows;
+            // a note cut is dropped when a note lands in the same merged row
+            bool has_note = false, has_effect = false;
+            for (int k = 0; k < factor; ++k) {
+                int src = row * factor + k;
+                if (src >= grid.total_rows) break;
+                if (!has_note && grid.notes[ch][src] != UGE_EMPTY_NOTE) {
+                    coarse.notes[ch][row] = grid.notes[ch][src];
+                    coarse.instruments[ch][row] = grid.instruments[ch][src];
+                    has_note = true;
+                }
+            }
+            // A speed change wins over any other effect and keeps its row
+            // length in ticks, now spread over factor times fewer rows
+            for (int k = 0; k < factor && !has_effect; ++k) {
+                int src = row * factor + k;
+                if (src >= grid.total_rows) break;
+                if (grid.effects[ch][src] == EFFECT_SET_SPEED) {
+                    coarse.effects[ch][row] = EFFECT_SET_SPEED;
+                    coarse.effect_params[ch][row] = std::min(0xFF, grid.effect_params[ch][src] * factor);
+                    has_effect = true;
+                }
+            }
+            for (int k = 0; k < factor; ++k) {
+                int src = row * factor + k;
+                if (src >= grid.total_rows) break;
+                if (has_note && grid.effects[ch][src] == 0xE) continue;
+                if (!has_effect && (grid.effects[ch][src] != 0 || grid.effect_params[ch][src] != 0)) {
+                    coarse.effects[ch][row] = grid.effects[ch][src];
+                    coarse.effect_params[ch][row] = grid.effect_params[ch][src];
+                    has_effect = true;
+                }
+            }
+        }
+    }
+    for (int start : grid.section_starts) {
+        if (coarse.section_starts.empty() || coarse.section_starts.back() != start / factor) coarse.section_starts.push_back(start / factor);
+    }
+    if (grid.loop_start_row >= 0) coarse.loop_start_row = grid.loop_start_row / factor;
+    coarse.chained = grid.chained;
+    grid = std::move(coarse);
+    header.ticks_per_row *= factor; // same playback time per merged row
+    bars.origin_row /= factor;
+    bars.rows_per_bar /= factor;
+    bars.rows_per_beat /= factor;
+}
+
+void dropVoices(UgeRowGrid& grid, int count) {
+    for (int i = 0; i < count; ++i) {
+        int ch = VOICE_DROP_ORDER[i];
+        std::fill(grid.notes[ch].begin(), grid.notes[ch].end(), UGE_EMPTY_NOTE);
+        std::fill(grid.instruments[ch].begin(), grid.instruments[ch].end(), 0);
+        for (int row = 0; row < grid.total_rows; ++row) {
+            if (grid.effects[ch][row] == EFFECT_SET_SPEED) continue; // the speed applies to every channel
+            grid.effects[ch][row] = 0;
+            grid.effect_params[ch][row] = 0;
+        }
+    }
+}
+
+// Jumps, breaks and speed changes shape the playback flow, so patterns are
+// only merged when they hold the same ones on the same rows
+bool sameOrderFlow(const UgePattern& a, const UgePattern& b) {
+    for (int row = 0; row < UGE_PATTERN_ROWS; ++row) {
+        const auto& ra = a.rows[row];
+        const auto& rb = b.rows[row];
+        bool flow_a = ra.effect == EFFECT_POSITION_JUMP || ra.effect == EFFECT_PATTERN_BREAK || ra.effect == EFFECT_SET_SPEED;
+        bool flow_b = rb.effect == EFFECT_POSITION_JUMP || rb.effect == EFFECT_PATTERN_BREAK || rb.effect == EFFECT_SET_SPEED;
+        if ((flow_a || flow_b) && (ra.effect != rb.effect || ra.effect_param != rb.effect_param)) return false;
+    }
+    return true;
+}
+
+int rowDistance(const UgePattern& a, const UgePattern& b) {
+    int diff = 0;
+    for (int row = 0; row < UGE_PATTERN_ROWS; ++row) {
+        const auto& ra = a.rows[row];
+        const auto& rb = b.rows[row];
+        if (ra.note != rb.note || ra.instrument != rb.instrument || ra.effect != rb.effect || ra.effect_param != rb.effect_param) ++diff;
+    }
+    return diff;
+}
+
+// Points each order entry at the most used pattern of its channel that is
+// within max_cells differing rows, then drops the patterns no longer used
+void mergeNearIdenticalPatterns(std::vector<UgePattern>& patterns, UgeOrderMatrix& orders, int max_cells) {
+    if (max_cells <= 0) return;
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        std::vector<int> uses(patterns.size(), 0);
+        for (uint32_t idx : orders[ch]) ++uses[idx];
+        std::vector<int> by_use;
+        for (size_t i = 0; i < uses.size(); ++i) if (uses[i] > 0) by_use.push_back(i);
+        std::stable_sort(by_use.begin(), by_use.end(), [&](int a, int b) { return uses[a] > uses[b]; });
+        std::vector<int> target(patterns.size());
+        for (size_t i = 0; i < target.size(); ++i) target[i] = i;
+        std::vector<int> representatives;
+        for (int idx : by_use) {
+            for (int rep : representatives) {
+                if (!sameOrderFlow(patterns[idx], patterns[rep])) continue;
+                if (rowDistance(patterns[idx], patterns[rep]) <= max_cells) {
+                    target[idx] = rep;
+                    break;
+                }
+            }
+            if (target[idx] == idx) representatives.push_back(idx);
+        }
+        for (auto& idx : orders[ch]) idx = target[idx];
+    }
+    truncateOrders(patterns, orders, orders[0].size());
+}
+
+} // namespace
+
+BudgetReport optimizeForBudget(
+    UgeRowGrid& grid,
+    UgeSongHeader& header,
+    BarGrid& bars,
+    size_t budget_bytes,
+    int max_orders,
+    int pattern_rows,
+    std::vector<UgePattern>& patterns,
+    UgeOrderMatrix& orders
+) {
+    BudgetReport report;
+    report.initial_bytes = estimateHugeDriverSize(header, patterns, orders).total();
+    report.final_bytes = report.initial_bytes;
+    auto fits = [&](size_t bytes, const UgeOrderMatrix& o) { return bytes <= budget_bytes && (int)o[0].size() <= max_orders; };
+    if (fits(report.initial_bytes, orders)) {
+        report.fits = true;
+        return report;
+    }
+
+    const Reduction ladder[] = {
+        {1, 0, 1, 0},
+        {2, 0, 1, 0},
+        {2, 1, 1, 0},
+        {2, 2, 1, 0},
+        {2, 4, 1, 0},
+        {2, 4, 2, 0},
+        {2, 4, 4, 0},
+        {2, 4, 4, 1},
+        {2, 4, 4, 2},
+        {2, 4, 4, 3},
+    };
+
+    const UgeRowGrid original_grid = grid;
+    const UgeSongHeader original_header = header;
+    const BarGrid original_bars = bars;
+    for (const Reduction& step : ladder) {
+        // The trial grid and the page tables built from it go back to the
+        // heap after the step; only the step kept is copied into grid
+        IterationScratch scratch(size_t(original_grid.total_rows) * 128);
+        UgeRowGrid g(scratch.resource());
+        g = original_grid;
+        UgeSongHeader h = original_header;
+        BarGrid b = original_bars;
+        coarsenEffects(g, step.effect_level);
+        reduceRowResolution(g, h, b, step.row_factor);
+        dropVoices(g, step.dropped_voices);
+        std::vector<UgePattern> p;
+        UgeOrderMatrix o;
+        int start_row = findBestPatternPhase(g, b);
+        int overwritten = buildLoopedPatterns(g, h, start_row, p, o, pattern_rows ? pattern_rows : choosePatternRows(g, start_row, max_orders));
+        mergeNearIdenticalPatterns(p, o, step.merge_cells);
+        size_t bytes = estimateHugeDriverSize(h, p, o).total();
+        report.sacrifices = describe(step);
+        debugLog() << "[UGE DEBUG] ROM budget: " << report.sacrifices.back() << " -> " << bytes << " bytes, " << o[0].size() << " orders" << std::endl;
+
+        // The steps are cumulative: keep the first that fits, else the last
+        report.fits = fits(bytes, o);
+        if (!report.fits && &step != &ladder[std::size(ladder) - 1]) continue;
+        grid = g;
+        header = h;
+        bars = b;
+        patterns = std::move(p);
+        orders = std::move(o);
+        report.final_bytes = bytes;
+        report.overwritten_effects = overwritten;
+        break;
+    }
+    return report;
+}
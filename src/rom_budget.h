@@ -0,0 +1,34 @@
+#pragma once
+#include "patterns.h"
+#include <cstddef>
+#include <string>
+#include <vector>
+
+struct BudgetReport {
+    size_t initial_bytes = 0;
+    size_t final_bytes = 0;
+    bool fits = false;
+    std::vector<std::string> sacrifices; // human-readable, in the order applied
+    int overwritten_effects = 0; // effects replaced by a D00 in the patterns of the chosen reduction
+};
+
+// Reduces a song until its hUGEDriver export fits budget_bytes and its order
+// matrix has at most max_orders rows. Reductions are applied cumulatively in
+// order of least audible impact:
+//   1. coarser effect parameters, then effects only on note rows
+//   2. merging patterns that differ in a few rows
+//   3. halving (then quartering) the row resolution
+//   4. dropping the Wave, Duty 2 and Noise voices, in that order
+// pattern_rows is the page length (0 = choosePatternRows for each step).
+// On return grid, header, bars, patterns and orders describe the chosen
+// reduction (or the strongest one tried when nothing fits).
+BudgetReport optimizeForBudget(
+    UgeRowGrid& grid,
+    UgeSongHeader& header,
+    BarGrid& bars,
+    size_t budget_bytes,
+    int max_orders,
+    int pattern_rows,
+    std::vector<UgePattern>& patterns,
+    UgeOrderMatrix& orders
+);
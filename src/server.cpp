@@ -0,0 +1,309 @@
+#include "server.h"
+#include "json_io.h"
+#include "profiler.h"
+#include <iostream>
+
+#ifdef _WIN32
+
+int runServer(const ServerOptions&) {
+    std::cerr << "--serve is not supported on this platform" << std::endl;
+    return 1;
+}
+
+#else
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using json = nlohmann::json;
+
+namespace {
+
+// --- Requests ---
+
+std::string songBytes(const UgeSong& song) {
+    PROFILE_SCOPE("write");
+    return ugeBytes(song);
+}
+
+// Converts one request line with the worker's context; never throws. With
+// "binary" the UGE data goes to payload, to follow the reply line raw.
+json handleRequest(const std::string& line, ConversionContext& context, const ConversionOptions& defaults, std::string& payload) {
+    auto started = std::chrono::steady_clock::now();
+    json reply = {{"id", nullptr}};
+    try {
+        json request = json::parse(line);
+        if (request.contains("id")) reply["id"] = request["id"];
+        context.options = defaults;
+        if (request.contains("options")) applyOptionsJson(request["options"], context.options);
+
+        std::ostringstream warnings;
+        context.log.debug = nullptr;
+        context.log.warning = &warnings;
+        ConversionLogScope log(context.log); // for writing the replies' UGE data too
+        std::vector<SongPart> parts;
+        std::string name;
+        bool converted;
+        if (request.contains("midi")) {
+            std::string bytes;
+            if (!base64Decode(request["midi"].get<std::string>(), bytes)) throw std::invalid_argument("midi is not valid base64");
+            std::istringstream in(bytes, std::ios::binary);
+            name = request.value("name", std::string("<inline>"));
+            converted = convertMidiToUgeParts(in, name, parts, context);
+        } else if (request.contains("input")) {
+            name = request["input"].get<std::string>();
+            converted = convertMidiToUgeParts(name, parts, context);
+        } else {
+            throw std::invalid_argument("request needs \"input\" or \"midi\"");
+        }
+
+        std::string output = request.value("output", std::string());
+        bool binary = request.value("binary", false);
+        // Inline UGE data: raw after the reply line, or base64 inside it
+        auto attach = [&](json& into, const UgeSong& song) {
+            std::string bytes = songBytes(song);
+            if (binary) {
+                into["uge_size"] = bytes.size();
+                payload += bytes;
+            } else {
+                into["uge"] = base64Encode(bytes);
+            }
+        };
+        if (converted && !output.empty()) {
+            converted = writeSongParts(name, output, parts, context);
+            json files = json::array();
+            if (parts.size() == 1) files.push_back(output);
+            for (size_t p = 0; parts.size() > 1 && p < parts.size(); ++p) files.push_back(splitPartPath(output, p));
+            if (parts.size() > 1) files.push_back(splitManifestPath(output));
+            reply["files"] = files;
+        } else if (converted && parts.size() == 1) {
+            attach(reply, parts[0].song);
+        } else if (converted) {
+            reply["parts"] = json::array();
+            for (const SongPart& part : parts) {
+                json entry = {
+                    {"first_row", part.first_row}, {"rows", part.rows},
+                    {"seconds", part.seconds}, {"next", part.next >= 0 ? json(part.next) : json(nullptr)},
+                };
+                attach(entry, part.song);
+                reply["parts"].push_back(std::move(entry));
+            }
+        }
+
+        std::vector<std::string> lines;
+        std::istringstream warning_lines(warnings.str());
+        for (std::string w; std::getline(warning_lines, w);) lines.push_back(w);
+        reply["ok"] = converted;
+        if (converted) reply["stats"] = statsJson(context.stats);
+        else reply["error"] = lines.empty() ? "conversion failed" : lines.back();
+        reply["warnings"] = lines;
+    } catch (const std::exception& e) {
+        reply = {{"id", reply["id"]}, {"ok", false}, {"error", e.what()}};
+        payload.clear();
+    }
+    reply["ms"] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+    return reply;
+}
+
+// --- Connections and the worker pool ---
+
+// Where replies go: stdout, or one client of the socket. Writes of whole
+// lines are serialized so replies from different workers do not interleave.
+class Connection {
+public:
+    Connection(int in_fd, int out_fd, bool owned) : in_fd_(in_fd), out_fd_(out_fd), owned_(owned) {}
+    ~Connection() {
+        if (owned_) close(in_fd_);
+    }
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    // Next line from the client, false once it hangs up
+    bool readLine(std::string& line) {
+        for (;;) {
+            size_t end = buffer_.find('\n');
+            if (end != std::string::npos) {
+                line = buffer_.substr(0, end);
+                buffer_.erase(0, end + 1);
+                return true;
+            }
+            char chunk[65536];
+            ssize_t n = read(in_fd_, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                if (buffer_.empty()) return false;
+                line.swap(buffer_);
+                buffer_.clear();
+                return true;
+            }
+            buffer_.append(chunk, n);
+        }
+    }
+
+    // Ends the client's requests early; replies still due are dropped
+    void hangUp() { shutdown(in_fd_, SHUT_RDWR); }
+
+    // A reply line and the raw bytes that follow it, if any
+    void send(const std::string& line, const std::string& payload) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string data;
+        data.reserve(line.size() + 1 + payload.size());
+        data.append(line).append(1, '\n').append(payload);
+        for (size_t sent = 0; sent < data.size();) {
+            ssize_t n = write(out_fd_, data.data() + sent, data.size() - sent);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return; // client gone; its reply is dropped
+            sent += n;
+        }
+    }
+
+private:
+    int in_fd_;
+    int out_fd_;
+    bool owned_;
+    std::string buffer_;
+    std::mutex mutex_;
+};
+
+struct Job {
+    std::string line;
+    std::shared_ptr<Connection> connection;
+};
+
+class WorkerPool {
+public:
+    WorkerPool(int workers, const ConversionOptions& defaults) : defaults_(defaults) {
+        for (int i = 0; i < workers; ++i) threads_.emplace_back([this] { work(); });
+    }
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        ready_.notify_all();
+        for (auto& t : threads_) t.join();
+    }
+
+    void submit(Job job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            jobs_.push_back(std::move(job));
+        }
+        ready_.notify_one();
+    }
+
+private:
+    // Each worker keeps its context, and with it a warm arena, for good
+    void work() {
+        ConversionContext context;
+        for (;;) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                ready_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+                if (jobs_.empty()) return;
+                job = std::move(jobs_.front());
+                jobs_.pop_front();
+            }
+            std::string payload;
+            std::string reply = handleRequest(job.line, context, defaults_, payload).dump();
+            job.connection->send(reply, payload);
+        }
+    }
+
+    const ConversionOptions defaults_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<Job> jobs_;
+    bool stopping_ = false;
+    std::vector<std::thread> threads_;
+};
+
+void serveConnection(const std::shared_ptr<Connection>& connection, WorkerPool& pool) {
+    std::string line;
+    while (connection->readLine(line)) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+        pool.submit({line, connection});
+    }
+}
+
+int serveSocket(const std::string& path, WorkerPool& pool) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Socket path too long: " << path << std::endl;
+        return 1;
+    }
+    std::copy(path.begin(), path.end(), addr.sun_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listener, 64) < 0) {
+        std::cerr << "Failed to listen on " << path << ": " << std::strerror(errno) << std::endl;
+        if (listener >= 0) close(listener);
+        return 1;
+    }
+    std::cerr << "Listening on " << path << std::endl;
+    // One reader thread per client; the connection closes once its reader
+    // and its last pending reply are done
+    std::mutex readers_mutex;
+    std::condition_variable readers_done;
+    int readers = 0;
+    std::vector<std::weak_ptr<Connection>> clients;
+    for (;;) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            std::cerr << "accept failed: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        auto connection = std::make_shared<Connection>(client, client, true);
+        {
+            std::lock_guard<std::mutex> lock(readers_mutex);
+            ++readers;
+            clients.erase(std::remove_if(clients.begin(), clients.end(), [](const auto& c) { return c.expired(); }), clients.end());
+            clients.push_back(connection);
+        }
+        std::thread([connection, &pool, &readers_mutex, &readers_done, &readers] {
+            serveConnection(connection, pool);
+            std::lock_guard<std::mutex> lock(readers_mutex);
+            --readers;
+            readers_done.notify_all();
+        }).detach();
+    }
+    close(listener);
+    unlink(path.c_str());
+    // Readers must not outlive the pool they submit to
+    std::unique_lock<std::mutex> lock(readers_mutex);
+    for (const auto& c : clients) {
+        if (auto connection = c.lock()) connection->hangUp();
+    }
+    readers_done.wait(lock, [&] { return readers == 0; });
+    return 1;
+}
+
+} // namespace
+
+int runServer(const ServerOptions& options) {
+    std::signal(SIGPIPE, SIG_IGN); // a client that hangs up must not end the server
+    int workers = options.workers > 0 ? options.workers : std::max(1u, std::thread::hardware_concurrency());
+    WorkerPool pool(workers, options.defaults);
+    if (!options.socket_path.empty()) return serveSocket(options.socket_path, pool);
+    serveConnection(std::make_shared<Connection>(STDIN_FILENO, STDOUT_FILENO, false), pool);
+    return 0; // the pool finishes the queued requests before it is destroyed
+}
+
+#endif
@@ -0,0 +1,27 @@
+#pragma once
+#include "midi2uge.h"
+#include <string>
+
+// Conversion daemon: one request per line of JSON, one reply line per
+// request, so a long-running process serves many conversions without
+// paying process startup for each. Requests are converted on a pool of
+// worker threads, each with a ConversionContext of its own; replies may
+// come back out of order and carry the request's "id".
+//
+// Request:  {"id": ..., "input": "song.mid" | "midi": "<base64>",
+//            "output": "song.uge" (optional), "options": {...}}
+// Reply:    {"id": ..., "ok": true, "uge": "<base64>" | "files": [...],
+//            "stats": {...}, "warnings": [...], "ms": ...}
+//           {"id": ..., "ok": false, "error": "..."}
+// A split song without "output" replies with "parts" instead of "uge".
+// With "binary": true the reply has "uge_size": <bytes> in place of each
+// "uge", and the UGE files follow the reply line raw, in order.
+struct ServerOptions {
+    std::string socket_path; // Unix domain socket to listen on; empty reads stdin and replies on stdout
+    int workers = 0;         // conversion threads, 0 for one per hardware thread
+    ConversionOptions defaults; // the command line's; a request's "options" override them
+};
+
+// Serves until stdin ends (waiting for the replies still due) or, on a
+// socket, until it can no longer accept connections. Returns the exit code.
+int runServer(const ServerOptions& options);
@@ -0,0 +1,259 @@
+#include "song_loop.h"
+#include "hugedriver.h"
+#include "timing.h"
+#include "conversion_log.h"
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <map>
+#include <numeric>
+
+// --- Suffix array and LCP ---
+
+std::vector<int> suffixArray(const std::vector<uint32_t>& seq) {
+    const int n = seq.size();
+    std::vector<int> sa(n), rank(n), tmp(n);
+    if (n == 0) return sa;
+    // Initial ranks: the values themselves, compacted to 0..n-1
+    std::vector<uint32_t> values(seq);
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+    for (int i = 0; i < n; ++i) rank[i] = std::lower_bound(values.begin(), values.end(), seq[i]) - values.begin();
+    std::iota(sa.begin(), sa.end(), 0);
+    std::stable_sort(sa.begin(), sa.end(), [&](int a, int b) { return rank[a] < rank[b]; });
+    if ((int)values.size() == n) return sa;
+
+    std::vector<int> count(n + 1);
+    for (int k = 1; k < n; k <<= 1) {
+        // Order by the second half first: suffixes shorter than k have an
+        // empty second half and come first, the rest follow sa shifted by k
+        int p = 0;
+        for (int i = n - k; i < n; ++i) tmp[p++] = i;
+        for (int j = 0; j < n; ++j) {
+            if (sa[j] >= k) tmp[p++] = sa[j] - k;
+        }
+        // Stable counting sort by the first half
+        std::fill(count.begin(), count.end(), 0);
+        for (int i = 0; i < n; ++i) ++count[rank[i]];
+        for (int i = 1; i <= n; ++i) count[i] += count[i - 1];
+        for (int j = n - 1; j >= 0; --j) sa[--count[rank[tmp[j]]]] = tmp[j];
+        // Re-rank by (first half, second half)
+        auto second = [&](int i) { return i + k < n ? rank[i + k] : -1; };
+        tmp[sa[0]] = 0;
+        for (int j = 1; j < n; ++j) {
+            int a = sa[j - 1], b = sa[j];
+            tmp[b] = tmp[a] + ((rank[a] == rank[b] && second(a) == second(b)) ? 0 : 1);
+        }
+        rank.swap(tmp);
+        if (rank[sa[n - 1]] == n - 1) break;
+    }
+    return sa;
+}
+
+std::vector<int> lcpArray(const std::vector<uint32_t>& seq, const std::vector<int>& sa) {
+    const int n = seq.size();
+    std::vector<int> rank(n), lcp(n, 0);
+    for (int i = 0; i < n; ++i) rank[sa[i]] = i;
+    int h = 0;
+    for (int i = 0; i < n; ++i) {
+        if (rank[i] == 0) {
+            h = 0;
+            continue;
+        }
+        int j = sa[rank[i] - 1];
+        while (i + h < n && j + h < n && seq[i + h] == seq[j + h]) ++h;
+        lcp[rank[i]] = h;
+        if (h > 0) --h;
+    }
+    return lcp;
+}
+
+RepeatedSpan longestRepeatedSpan(const std::vector<uint32_t>& seq) {
+    RepeatedSpan span;
+    std::vector<int> sa = suffixArray(seq);
+    std::vector<int> lcp = lcpArray(seq, sa);
+    for (size_t i = 1; i < sa.size(); ++i) {
+        if (lcp[i] > span.length) {
+            span.length = lcp[i];
+            span.first = std::min(sa[i - 1], sa[i]);
+            span.second = std::max(sa[i - 1], sa[i]);
+        }
+    }
+    return span;
+}
+
+// --- Song loop ---
+
+// Shortest tail repeat worth a jump: anything under a page saves fewer order
+// rows than the jump pattern costs
+static constexpr int MIN_LOOP_ROWS = UGE_PATTERN_ROWS;
+static constexpr int MAX_JUMP_ORDER = 255; // Bxx parameter
+
+// One id per distinct row across all four channels
+static std::vector<uint32_t> rowIds(const UgeRowGrid& grid) {
+    std::map<std::array<uint8_t, 4 * UGE_NUM_CHANNELS>, uint32_t> ids;
+    std::vector<uint32_t> seq(grid.total_rows);
+    for (int row = 0; row < grid.total_rows; ++row) {
+        std::array<uint8_t, 4 * UGE_NUM_CHANNELS> key;
+        for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+            key[ch * 4 + 0] = grid.notes[ch][row];
+            key[ch * 4 + 1] = grid.instruments[ch][row];
+            key[ch * 4 + 2] = grid.effects[ch][row];
+            key[ch * 4 + 3] = grid.effect_params[ch][row];
+        }
+        seq[row] = ids.emplace(key, ids.size()).first->second;
+    }
+    return seq;
+}
+
+// Finds effect cells for the loop's jump, its D00 when it does not start on
+// a page line, and an Fxx when the speed after the jump would differ
+static bool placeLoopEffects(const UgeRowGrid& grid, SongLoop& loop, int start_row, int initial_speed, int page_rows) {
+    loop.jump_channel = freeEffectChannel(grid, loop.end_row - 1);
+    if (loop.jump_channel < 0) return false;
+    if ((loop.start_row - start_row) % page_rows != 0) {
+        loop.break_channel = freeEffectChannel(grid, loop.start_row - 1);
+        if (loop.break_channel < 0) return false;
+    }
+    bool sets_speed = false;
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) sets_speed = sets_speed || grid.effects[ch][loop.start_row] == EFFECT_SET_SPEED;
+    int speed = speedAtRow(grid, loop.start_row, initial_speed);
+    if (!sets_speed && speed != speedAtRow(grid, loop.end_row - 1, initial_speed)) {
+        loop.speed_channel = freeEffectChannel(grid, loop.start_row);
+        if (loop.speed_channel < 0) return false;
+        loop.speed = speed;
+    }
+    return true;
+}
+
+std::optional<SongLoop> markedSongLoop(const UgeRowGrid& grid, int start_row, int initial_speed, int page_rows) {
+    if (grid.loop_start_row < 0) return std::nullopt;
+    SongLoop loop;
+    loop.start_row = std::max(grid.loop_start_row, start_row); // rows before start_row are silent
+    loop.end_row = grid.total_rows;
+    if (loop.start_row >= loop.end_row) return std::nullopt;
+    if (loop.start_row == start_row) return std::nullopt; // the song already wraps there
+    if ((loop.start_row - start_row + page_rows - 1) / page_rows > MAX_JUMP_ORDER) {
+        warningLog() << "[UGE WARNING] Loop start (row " << loop.start_row << ") is past the last order a jump can reach; the song loops from the start" << std::endl;
+        return std::nullopt;
+    }
+    if (!placeLoopEffects(grid, loop, start_row, initial_speed, page_rows)) {
+        warningLog() << "[UGE WARNING] No free effect cell for the jump back to the loop start; the song loops from the start" << std::endl;
+        return std::nullopt;
+    }
+    return loop;
+}
+
+std::optional<SongLoop> findSongLoop(const UgeRowGrid& grid, int start_row, int initial_speed, int page_rows) {
+    // Rows with a note on any channel, as a prefix count
+    std::vector<int> notes_before(grid.total_rows + 1, 0);
+    for (int row = 0; row < grid.total_rows; ++row) {
+        bool note = false;
+        for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) note = note || grid.notes[ch][row] != UGE_EMPTY_NOTE;
+        notes_before[row + 1] = notes_before[row] + (note ? 1 : 0);
+    }
+    // The release after the last note (cuts, silence) only ends the song and
+    // never matches the middle of a repeat, so the search stops at that note
+    int n = grid.total_rows;
+    while (n > 0 && notes_before[n] == notes_before[n - 1]) --n;
+    if (n < 2 * MIN_LOOP_ROWS) return std::nullopt;
+
+    // Tail repeats are common prefixes of the reversed song: for a shift p,
+    // the reversed suffix at p matches the reversed song for as many rows as
+    // the song's tail matches the rows ending p earlier. One sweep out from
+    // the reversed song's own rank in the suffix array gives that length for
+    // every p.
+    std::vector<uint32_t> reversed = rowIds(grid);
+    reversed.resize(n);
+    std::reverse(reversed.begin(), reversed.end());
+    std::vector<int> sa = suffixArray(reversed);
+    std::vector<int> lcp = lcpArray(reversed, sa);
+    std::vector<int> common(n, 0);
+    int home = std::find(sa.begin(), sa.end(), 0) - sa.begin();
+    common[0] = n;
+    for (int i = home + 1, m = INT_MAX; i < n; ++i) {
+        m = std::min(m, lcp[i]);
+        common[sa[i]] = m;
+    }
+    for (int i = home, m = INT_MAX; i > 0; --i) {
+        m = std::min(m, lcp[i]);
+        common[sa[i - 1]] = m;
+    }
+
+    // Longest tail that repeats the p rows before it at least once in full
+    int best_tail = 0, best_period = 0;
+    for (int p = 1; p < n; ++p) {
+        int tail = common[p];
+        if (tail < p || tail < MIN_LOOP_ROWS || tail <= best_tail) continue;
+        int end = n - tail;
+        if (end - p < 0 || notes_before[end] == notes_before[end - p]) continue;
+        best_tail = tail;
+        best_period = p;
+    }
+    if (best_tail == 0) return std::nullopt;
+
+    // Any shift of the loop within the repeated tail plays the same; prefer
+    // the one that starts it on a page line, then the unshifted one with a D00
+    int end = n - best_tail;
+    int start = end - best_period;
+    int align = ((start_row - start) % page_rows + page_rows) % page_rows;
+    for (int shift : {align, 0}) {
+        if (shift >= best_tail) continue;
+        SongLoop loop;
+        loop.start_row = start + shift;
+        loop.end_row = end + shift;
+        if (loop.start_row < start_row) continue;
+        if ((loop.start_row - start_row + page_rows - 1) / page_rows > MAX_JUMP_ORDER) continue;
+        if (loop.start_row == start_row && loop.end_row == grid.total_rows) return std::nullopt; // the song already wraps there
+        if (!placeLoopEffects(grid, loop, start_row, initial_speed, page_rows)) continue;
+        debugLog() << "[UGE DEBUG] Song loop: rows " << loop.start_row << "-" << (loop.end_row - 1) << " repeat in the last "
+                   << best_tail << " rows; jump back from row " << (loop.end_row - 1)
+                   << (loop.break_channel >= 0 ? " (D00 on the row before the loop)" : "") << std::endl;
+        return loop;
+    }
+    debugLog() << "[UGE DEBUG] Song loop: last " << best_tail << " rows repeat, but no free effect cell for the jump or speed" << std::endl;
+    return std::nullopt;
+}
+
+int buildLoopedPatterns(const UgeRowGrid& grid, const UgeSongHeader& header, int start_row, std::vector<UgePattern>& patterns, UgeOrderMatrix& orders, int page_rows) {
+    if (grid.chained) {
+        // Another part follows, so this one has to play to its end
+        return buildPatterns(grid, start_row, patterns, orders, nullptr, page_rows);
+    }
+    if (grid.loop_start_row >= 0) {
+        // The song was cut at its loop end, so it has to jump back
+        std::optional<SongLoop> marked = markedSongLoop(grid, start_row, header.ticks_per_row, page_rows);
+        int overwritten = buildPatterns(grid, start_row, patterns, orders, marked ? &*marked : nullptr, page_rows);
+        if (marked) {
+            debugLog() << "[UGE DEBUG] Song loop: from the loop markers, jump back from row " << (marked->end_row - 1) << " to row "
+                       << marked->start_row << ", " << orders[0].size() << " orders" << std::endl;
+        }
+        return overwritten;
+    }
+    int overwritten = buildPatterns(grid, start_row, patterns, orders, nullptr, page_rows);
+    std::optional<SongLoop> loop = findSongLoop(grid, start_row, header.ticks_per_row, page_rows);
+    if (loop) {
+        std::vector<UgePattern> looped_patterns;
+        UgeOrderMatrix looped_orders;
+        int looped_overwritten = buildPatterns(grid, start_row, looped_patterns, looped_orders, &*loop, page_rows);
+        size_t plain = estimateHugeDriverSize(header, patterns, orders).total();
+        size_t looped = estimateHugeDriverSize(header, looped_patterns, looped_orders).total();
+        debugLog() << "[UGE DEBUG] Song loop: " << orders[0].size() << " orders, " << plain << " bytes -> "
+                   << looped_orders[0].size() << " orders, " << looped << " bytes" << (looped < plain ? "" : " (not used)") << std::endl;
+        if (looped < plain) {
+            patterns = std::move(looped_patterns);
+            orders = std::move(looped_orders);
+            overwritten = looped_overwritten;
+        }
+    }
+
+    // --- Report the longest repeated run of patterns per channel ---
+    debugLog() << "[UGE DEBUG] Order repeats: longest repeated run per channel";
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        RepeatedSpan span = longestRepeatedSpan(std::vector<uint32_t>(orders[ch].begin(), orders[ch].end()));
+        debugLog() << (ch == 0 ? " " : ", ") << span.length;
+        if (span.length > 0) debugLog() << " (orders " << span.first << " and " << span.second << ")";
+    }
+    debugLog() << std::endl;
+    return overwritten;
+}
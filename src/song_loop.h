@@ -0,0 +1,46 @@
+#pragma once
+#include "patterns.h"
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// Suffix array of seq (prefix doubling with counting sort, O(n log n)).
+// A suffix that is a prefix of another sorts first.
+std::vector<int> suffixArray(const std::vector<uint32_t>& seq);
+
+// Kasai LCP array: lcp[i] = common prefix length of suffixes sa[i - 1] and sa[i], lcp[0] = 0
+std::vector<int> lcpArray(const std::vector<uint32_t>& seq, const std::vector<int>& sa);
+
+struct RepeatedSpan {
+    int first = 0;  // start of the earlier occurrence
+    int second = 0; // start of the later one
+    int length = 0; // 0 when nothing repeats
+};
+
+// Longest span of seq that occurs at least twice (occurrences may overlap)
+RepeatedSpan longestRepeatedSpan(const std::vector<uint32_t>& seq);
+
+// Finds the song loop: the longest tail of the grid (all four channels row
+// by row) that repeats the section just before it, so the song can stop
+// after the first pass and jump back instead. The tail has to cover the
+// looped section at least once, hold a note and span at least one page.
+// The loop is moved so that it starts on a page line (every page_rows from
+// start_row) where possible, otherwise a D00 forces the page boundary.
+// When the grid changes speed (Fxx) inside the loop, the loop start gets an
+// Fxx of its own so the speed after the jump matches the first pass
+// (initial_speed is the song's speed before any Fxx).
+// Returns nullopt when there is no loop or no free effect cell for the
+// Bxx/D00/Fxx.
+std::optional<SongLoop> findSongLoop(const UgeRowGrid& grid, int start_row, int initial_speed, int page_rows = UGE_PATTERN_ROWS);
+
+// The loop set by the MIDI loop markers (grid.loop_start_row to the end of
+// the grid), with its effect cells placed like findSongLoop does. Returns
+// nullopt when there is none, when the song already wraps to the loop
+// start, or when the jump cannot be placed (with a warning).
+std::optional<SongLoop> markedSongLoop(const UgeRowGrid& grid, int start_row, int initial_speed, int page_rows = UGE_PATTERN_ROWS);
+
+// buildPatterns with the song loop: none for a chained part of a split
+// song, the marked loop when the MIDI has loop markers, otherwise the one
+// findSongLoop finds when it makes the hUGEDriver data smaller. Returns
+// buildPatterns' count of effects replaced by a D00 for the patterns kept.
+int buildLoopedPatterns(const UgeRowGrid& grid, const UgeSongHeader& header, int start_row, std::vector<UgePattern>& patterns, UgeOrderMatrix& orders, int page_rows = UGE_PATTERN_ROWS);
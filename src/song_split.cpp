@@ -0,0 +1,145 @@
+#include "song_split.h"
+#include "hugedriver.h"
+#include "nlohmann_json.hpp"
+#include "conversion_log.h"
+#include <algorithm>
+#include <fstream>
+
+UgeRowGrid sliceGrid(const UgeRowGrid& grid, int first_row, int end_row, std::pmr::memory_resource* resource) {
+    UgeRowGrid part(resource ? resource : grid.resource());
+    part.resize(end_row - first_row);
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        std::copy(grid.notes[ch].begin() + first_row, grid.notes[ch].begin() + end_row, part.notes[ch].begin());
+        std::copy(grid.instruments[ch].begin() + first_row, grid.instruments[ch].begin() + end_row, part.instruments[ch].begin());
+        std::copy(grid.effects[ch].begin() + first_row, grid.effects[ch].begin() + end_row, part.effects[ch].begin());
+        std::copy(grid.effect_params[ch].begin() + first_row, grid.effect_params[ch].begin() + end_row, part.effect_params[ch].begin());
+    }
+    for (int start : grid.section_starts) {
+        if (start > first_row && start < end_row) part.section_starts.push_back(start - first_row);
+    }
+    if (grid.loop_start_row >= first_row && grid.loop_start_row < end_row) part.loop_start_row = grid.loop_start_row - first_row;
+    part.chained = grid.chained || end_row < grid.total_rows;
+    return part;
+}
+
+std::vector<int> chooseSplitRows(const UgeRowGrid& grid, const UgeSongHeader& header, const BarGrid& bars, const std::pmr::vector<uint8_t>& silent, size_t budget_bytes, int max_orders) {
+    const int n = grid.total_rows;
+    auto fits = [&](int first, int end) {
+        // A probe's trial grid and pages go back to the heap once it is answered
+        IterationScratch scratch(size_t(end - first) * 64);
+        UgeRowGrid part = sliceGrid(grid, first, end, scratch.resource());
+        std::vector<UgePattern> patterns;
+        UgeOrderMatrix orders;
+        buildPatterns(part, 0, patterns, orders);
+        return (int)orders[0].size() <= max_orders && estimateHugeDriverSize(header, patterns, orders).total() <= budget_bytes;
+    };
+    std::vector<int> starts = {0};
+    if (n == 0 || fits(0, n)) return starts;
+
+    // --- Candidate part ends: bar lines, the loop start and the end of the song ---
+    std::vector<int> lines;
+    if (bars.rows_per_bar > 0) {
+        for (int row = ((bars.origin_row % bars.rows_per_bar) + bars.rows_per_bar) % bars.rows_per_bar; row < n; row += bars.rows_per_bar) {
+            if (row > 0) lines.push_back(row);
+        }
+    } else {
+        for (int row = UGE_PATTERN_ROWS; row < n; row += UGE_PATTERN_ROWS) lines.push_back(row);
+    }
+    if (grid.loop_start_row > 0) lines.push_back(grid.loop_start_row);
+    // The rows after the bar holding the last note start only end notes; they
+    // stay with the last part rather than becoming a part of their own
+    int last_note = firstNonEmptyRow(grid) < n ? n - 1 : 0;
+    while (last_note > 0 && std::all_of(grid.notes.begin(), grid.notes.end(), [&](const auto& ch) { return ch[last_note] == UGE_EMPTY_NOTE; })) --last_note;
+    auto after = std::upper_bound(lines.begin(), lines.end(), last_note);
+    const int song_end = after == lines.end() ? n : std::max(*after, grid.loop_start_row);
+    lines.push_back(song_end);
+    std::sort(lines.begin(), lines.end());
+    lines.erase(std::upper_bound(lines.begin(), lines.end(), song_end), lines.end());
+    lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+
+    for (int first = 0; first < song_end;) {
+        int limit = grid.loop_start_row > first ? grid.loop_start_row : song_end;
+        auto lo = std::upper_bound(lines.begin(), lines.end(), first);
+        auto hi = std::upper_bound(lines.begin(), lines.end(), limit);
+        // Furthest line that fits (the data grows with the part)
+        int count = hi - lo, best = -1;
+        for (int step = 1 << 20; step > 0; step >>= 1) {
+            if (best + step < count && fits(first, lo[best + step])) best += step;
+        }
+        int end;
+        if (best < 0) {
+            end = *lo; // not even one bar fits: take it anyway, the budget pass reduces it
+            warningLog() << "[UGE WARNING] Rows " << first << "-" << (end - 1) << " do not fit the budget on their own" << std::endl;
+        } else {
+            end = lo[best];
+            // An earlier line after a silent row cuts no note, if it is not too early
+            if (end < limit) {
+                for (int i = best; i >= 0 && lo[i] - first >= (end - first) / 2; --i) {
+                    if (silent[lo[i] - 1]) {
+                        end = lo[i];
+                        break;
+                    }
+                }
+            }
+        }
+        if (end >= song_end) break;
+        starts.push_back(end);
+        first = end;
+    }
+    return starts;
+}
+
+bool songLoops(const UgeSong& song) {
+    for (const auto& channel : song.orders) {
+        if (channel.empty()) continue;
+        for (const UgePattern& p : song.patterns) {
+            if (p.index != channel.back()) continue;
+            for (const auto& row : p.rows) {
+                if (row.effect == EFFECT_POSITION_JUMP) return true;
+            }
+        }
+    }
+    return false;
+}
+
+static std::string withSuffix(const std::string& path, const std::string& suffix, const std::string& extension) {
+    size_t slash = path.find_last_of("/\\");
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = path.size();
+    return path.substr(0, dot) + suffix + (extension.empty() ? path.substr(dot) : extension);
+}
+
+std::string splitPartPath(const std::string& path, int n) {
+    return withSuffix(path, "_part" + std::to_string(n + 1), "");
+}
+
+std::string splitManifestPath(const std::string& path) {
+    return withSuffix(path, "_parts", ".json");
+}
+
+bool writeSplitManifest(const std::string& path, const std::vector<SplitManifestSong>& songs, const std::string& name_key, size_t budget_bytes) {
+    nlohmann::json root;
+    root["budget_bytes"] = budget_bytes;
+    root["songs"] = nlohmann::json::array();
+    for (const SplitManifestSong& s : songs) {
+        nlohmann::json song;
+        song["source"] = s.source;
+        song["parts"] = nlohmann::json::array();
+        for (size_t i = 0; i < s.parts->size(); ++i) {
+            const SongPart& part = (*s.parts)[i];
+            nlohmann::json entry;
+            entry[name_key] = s.names[i];
+            entry["first_row"] = part.first_row;
+            entry["rows"] = part.rows;
+            entry["seconds"] = part.seconds;
+            entry["bytes"] = estimateHugeDriverSize(part.song.header, part.song.patterns, part.song.orders).total();
+            entry["next"] = part.next >= 0 ? nlohmann::json(part.next) : nlohmann::json(nullptr);
+            song["parts"].push_back(entry);
+        }
+        root["songs"].push_back(song);
+    }
+    std::ofstream out(path);
+    if (!out) return false;
+    out << root.dump(2) << std::endl;
+    return true;
+}
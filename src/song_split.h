@@ -0,0 +1,47 @@
+#pragma once
+#include "patterns.h"
+#include "uge_writer.h"
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// One part of a song split to fit the ROM budget. Rows are those of the
+// unsplit song before speed sections.
+struct SongPart {
+    UgeSong song;
+    int first_row = 0;
+    int rows = 0;
+    double seconds = 0.0;
+    int next = 0; // part to play when this one ends, -1 when it loops by itself and never ends
+};
+
+// Rows [first_row, end_row) of grid as a grid of its own, allocated from
+// resource (grid's when null)
+UgeRowGrid sliceGrid(const UgeRowGrid& grid, int first_row, int end_row, std::pmr::memory_resource* resource = nullptr);
+
+// Rows where the parts of the song start (always row 0 first; just that
+// when the whole song fits). Each part runs from its start to the furthest
+// bar line whose hUGEDriver data still fits budget_bytes and max_orders,
+// or to an earlier bar line after a silent row (silent[row] != 0) when one
+// lies in the second half of that stretch, so no note is cut mid-way. A
+// part also ends at the loop start so the last part can chain back to it.
+std::vector<int> chooseSplitRows(const UgeRowGrid& grid, const UgeSongHeader& header, const BarGrid& bars, const std::pmr::vector<uint8_t>& silent, size_t budget_bytes, int max_orders);
+
+// True when the song's last order row jumps back (Bxx), so it never ends
+bool songLoops(const UgeSong& song);
+
+// Output names of part n (0-based): "music/boss.uge" -> "music/boss_part1.uge"
+std::string splitPartPath(const std::string& path, int n);
+// Manifest next to the parts: "music/boss.uge" -> "music/boss_parts.json"
+std::string splitManifestPath(const std::string& path);
+
+struct SplitManifestSong {
+    std::string source;             // MIDI file
+    const std::vector<SongPart>* parts;
+    std::vector<std::string> names; // per part: UGE file or export symbol
+};
+
+// Writes the JSON manifest that tells the game how to chain the parts:
+// per part its file (name_key "file") or export symbol (name_key "symbol"),
+// the rows and seconds it covers, its data size and the part that follows it.
+bool writeSplitManifest(const std::string& path, const std::vector<SplitManifestSong>& songs, const std::string& name_key, size_t budget_bytes);
@@ -0,0 +1,57 @@
+#include "stream_io.h"
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+namespace {
+
+// MIDI and UGE data must pass through untranslated
+void setBinary(std::FILE* stream) {
+#ifdef _WIN32
+    _setmode(_fileno(stream), _O_BINARY);
+#else
+    (void)stream;
+#endif
+}
+
+} // namespace
+
+bool isStdStream(const std::string& path) { return path == "-"; }
+
+bool readInput(const std::string& path, std::string& data) {
+    data.clear();
+    if (isStdStream(path)) {
+        setBinary(stdin);
+        char buffer[1 << 16];
+        size_t n;
+        while ((n = std::fread(buffer, 1, sizeof(buffer), stdin)) > 0) data.append(buffer, n);
+        return !std::ferror(stdin);
+    }
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return !in.bad();
+}
+
+bool writeOutput(const std::string& path, const std::string& data) {
+    if (isStdStream(path)) {
+        std::fflush(stdout);
+        setBinary(stdout);
+        return std::fwrite(data.data(), 1, data.size(), stdout) == data.size() && std::fflush(stdout) == 0;
+    }
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), static_cast<std::streamsize>(data.size()));
+    return static_cast<bool>(out);
+}
+
+bool parseOutputFormat(const std::string& name, OutputFormat& format) {
+    if (name == "uge") format = OutputFormat::Uge;
+    else if (name == "json") format = OutputFormat::Json;
+    else if (name == "json-compact") format = OutputFormat::JsonCompact;
+    else return false;
+    return true;
+}
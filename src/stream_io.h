@@ -0,0 +1,24 @@
+#pragma once
+#include <string>
+
+// Input and output of the command-line tools, where "-" stands for stdin
+// as an input and for stdout as an output, so the tools work in pipelines
+// without temporary files.
+bool isStdStream(const std::string& path);
+
+// Reads the whole file at path, or stdin, as bytes. False when it cannot
+// be opened or read.
+bool readInput(const std::string& path, std::string& data);
+
+// Writes data to the file at path, or to stdout, as bytes. False when it
+// cannot be opened or written.
+bool writeOutput(const std::string& path, const std::string& data);
+
+// What a tool writes, chosen with --format instead of the output's extension
+enum class OutputFormat { Uge, Json, JsonCompact };
+
+// Parses a --format value (uge, json, json-compact); false for any other
+bool parseOutputFormat(const std::string& name, OutputFormat& format);
+
+// Indentation of the JSON formats for the library's JSON dumps
+inline int jsonIndent(OutputFormat format) { return format == OutputFormat::JsonCompact ? -1 : 2; }
@@ -0,0 +1,301 @@
+#include "timing.h"
+#include "conversion_log.h"
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <utility>
+
+RowResolution chooseRowsPerQuarter(const std::vector<int>& onset_ticks, int tpq, double tolerance_ticks) {
+    RowResolution result;
+    if (tpq <= 0 || onset_ticks.empty()) return result;
+
+    // --- Histogram of onset positions within the quarter note ---
+    std::map<int, int> histogram;
+    for (int tick : onset_ticks) ++histogram[tick % tpq];
+
+    // --- Cluster neighbouring positions ---
+    // Single linkage: positions no further apart than the tolerance (at least
+    // one tick) share a cluster, so a cloud of humanized onsets around a grid
+    // line becomes one centre however wide it spreads
+    struct Cluster {
+        int first, last;
+        double weighted; // sum of position * count
+        int count;
+    };
+    const double link = std::max(1.0, tolerance_ticks);
+    std::vector<Cluster> clusters;
+    for (const auto& kv : histogram) {
+        if (clusters.empty() || kv.first - clusters.back().last > link) clusters.push_back({kv.first, kv.first, 0.0, 0});
+        Cluster& c = clusters.back();
+        c.last = kv.first;
+        c.weighted += double(kv.first) * kv.second;
+        c.count += kv.second;
+    }
+    // Onsets just before a beat belong with the ones just after it
+    if (clusters.size() > 1 && clusters.front().first + tpq - clusters.back().last <= link) {
+        Cluster& wrap = clusters.back();
+        clusters.front().weighted += wrap.weighted - double(tpq) * wrap.count;
+        clusters.front().count += wrap.count;
+        clusters.pop_back();
+    }
+    std::vector<double> centres;
+    for (const Cluster& c : clusters) centres.push_back(c.weighted / c.count);
+    result.clusters = centres.size();
+
+    // --- Coarsest grid that hits every cluster ---
+    auto worstError = [&](int rows) {
+        double row_ticks = double(tpq) / rows;
+        double worst = 0.0;
+        for (double c : centres) {
+            double offset = c - std::round(c / row_ticks) * row_ticks;
+            worst = std::max(worst, std::abs(offset));
+        }
+        return worst;
+    };
+    for (int rows : ROWS_PER_QUARTER_CHOICES) {
+        if (rows > tpq) break;
+        result.rows_per_quarter = rows;
+        result.max_error_ticks = worstError(rows);
+        if (result.max_error_ticks <= tolerance_ticks) break;
+    }
+    return result;
+}
+
+// --- Playback timer ---
+
+TimerSetting chooseTimerSetting(double row_rate, int preferred_ticks_per_row, double max_error) {
+    auto settingFor = [&](int ticks_per_row) {
+        TimerSetting setting;
+        setting.ticks_per_row = ticks_per_row;
+        long divider = std::lround(TIMER_CLOCK_HZ / (row_rate * ticks_per_row));
+        setting.clamped = divider < 1 || divider > MAX_TIMER_DIVIDER;
+        setting.divider = (int)std::max(1L, std::min(divider, (long)MAX_TIMER_DIVIDER));
+        double played = TIMER_CLOCK_HZ / (setting.divider * ticks_per_row);
+        setting.error = std::abs(played - row_rate) / row_rate;
+        return setting;
+    };
+    int preferred = std::max(1, std::min(preferred_ticks_per_row, MAX_TIMER_TICKS_PER_ROW));
+    TimerSetting best = settingFor(preferred);
+    if (row_rate <= 0.0) return best;
+    // Nearest to the preferred ticks_per_row first
+    for (int distance = 0; distance < MAX_TIMER_TICKS_PER_ROW; ++distance) {
+        for (int sign : {-1, 1}) {
+            if (distance == 0 && sign > 0) break;
+            int ticks_per_row = preferred + sign * distance;
+            if (ticks_per_row < 1 || ticks_per_row > MAX_TIMER_TICKS_PER_ROW) continue;
+            TimerSetting setting = settingFor(ticks_per_row);
+            if (!setting.clamped && setting.error <= max_error) return setting;
+            if (best.clamped > setting.clamped || (best.clamped == setting.clamped && setting.error < best.error)) best = setting;
+        }
+    }
+    return best;
+}
+
+// --- Onset quantization ---
+
+OnsetQuantization quantizeOnsets(const std::pmr::vector<std::pair<int, int>>& onsets, int tpq, int rows_per_quarter, int bar_ticks, int origin_tick, double link_ticks, double max_error_ticks,
+                                 std::pmr::memory_resource* resource) {
+    OnsetQuantization result(resource);
+    result.onsets = onsets.size();
+    if (tpq <= 0 || rows_per_quarter <= 0 || bar_ticks <= 0) return result;
+    const double row_ticks = double(tpq) / rows_per_quarter;
+    auto nearestRow = [&](double tick) { return (int)std::floor(tick / row_ticks + 0.5); };
+    auto phaseOf = [&](int tick) { return ((tick - origin_tick) % bar_ticks + bar_ticks) % bar_ticks; };
+
+    std::pmr::map<int, std::pmr::map<int, int>> histograms(resource); // channel -> phase -> count
+    for (const auto& onset : onsets) ++histograms[onset.first][phaseOf(onset.second)];
+
+    // Cluster centre per (channel, phase), as a phase that may fall just
+    // outside [0, bar_ticks) when the cluster wraps around the bar line
+    std::pmr::map<std::pair<int, int>, double> centre_of(resource);
+    const double link = std::max(1.0, link_ticks);
+    for (const auto& channel : histograms) {
+        struct Cluster {
+            int last;
+            double weighted;
+            int count;
+            std::vector<int> phases;
+        };
+        std::vector<Cluster> clusters;
+        for (const auto& kv : channel.second) {
+            if (clusters.empty() || kv.first - clusters.back().last > link) clusters.push_back({kv.first, 0.0, 0, {}});
+            Cluster& c = clusters.back();
+            c.last = kv.first;
+            c.weighted += double(kv.first) * kv.second;
+            c.count += kv.second;
+            c.phases.push_back(kv.first);
+        }
+        if (clusters.size() > 1 && clusters.front().phases.front() + bar_ticks - clusters.back().last <= link) {
+            Cluster& wrap = clusters.back();
+            clusters.front().weighted += wrap.weighted - double(bar_ticks) * wrap.count;
+            clusters.front().count += wrap.count;
+            for (int phase : wrap.phases) clusters.front().phases.push_back(phase - bar_ticks);
+            clusters.pop_back();
+        }
+        result.clusters += clusters.size();
+        for (const Cluster& c : clusters) {
+            double centre = c.weighted / c.count;
+            // Stored relative to each member's own phase
+            for (int phase : c.phases) centre_of[{channel.first, (phase + bar_ticks) % bar_ticks}] = centre - phase;
+        }
+    }
+
+    // --- Snap each onset to its cluster's row ---
+    double total_error = 0.0;
+    for (const auto& onset : onsets) {
+        int tick = onset.second;
+        int nearest = nearestRow(tick);
+        int row = nearestRow(tick + centre_of[{onset.first, phaseOf(tick)}]);
+        double error = std::abs(row * row_ticks - tick);
+        if (row != nearest && error > max_error_ticks) {
+            row = nearest;
+            error = std::abs(row * row_ticks - tick);
+            ++result.over_limit;
+        } else if (row != nearest) {
+            ++result.moved;
+        }
+        result.rows[onset] = row;
+        result.max_error_ticks = std::max(result.max_error_ticks, error);
+        total_error += error;
+    }
+    if (!onsets.empty()) result.mean_error_ticks = total_error / onsets.size();
+    return result;
+}
+
+// --- Speed sections ---
+
+// Effects that act on every tick of their row: a longer row would stretch them
+static bool lastsWholeRow(uint8_t effect, uint8_t param) {
+    switch (effect) {
+        case 0x0: return param != 0; // arpeggio
+        case 0x1: case 0x2: case 0x3: case 0x4: case 0xA: return true; // slides, vibrato, volume slide
+        default: return false;
+    }
+}
+
+static bool rowEmpty(const UgeRowGrid& grid, int row) {
+    for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+        if (grid.notes[ch][row] != UGE_EMPTY_NOTE || grid.effects[ch][row] != 0 || grid.effect_params[ch][row] != 0) return false;
+    }
+    return true;
+}
+
+SpeedSectionReport applySpeedSections(UgeRowGrid& grid, int ticks_per_row, std::vector<int>& row_map) {
+    SpeedSectionReport report;
+    const int n = grid.total_rows;
+    report.rows_before = report.rows_after = n;
+    row_map.resize(n);
+    for (int row = 0; row < n; ++row) row_map[row] = row;
+    if (n == 0) return report;
+
+    // next_busy[row]: first non-empty row at or after row
+    std::vector<int> next_busy(n + 1, n);
+    for (int row = n - 1; row >= 0; --row) next_busy[row] = rowEmpty(grid, row) ? next_busy[row + 1] : row;
+    std::vector<uint8_t> stretchable(n, 1);
+    for (int row = 0; row < n; ++row) {
+        for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+            if (lastsWholeRow(grid.effects[ch][row], grid.effect_params[ch][row])) stretchable[row] = 0;
+        }
+    }
+    // A block of factor rows from row merges into its first row. Blocks
+    // never span the loop start, which the song jumps back to.
+    const int loop_start = grid.loop_start_row;
+    auto mergeable = [&](int row, int factor) {
+        if (loop_start > row && loop_start < row + factor) return false;
+        return row + factor <= n && stretchable[row] && next_busy[row + 1] >= row + factor;
+    };
+    auto blocksFrom = [&](int row, int factor, int limit) {
+        int blocks = 0;
+        while (blocks < limit && mergeable(row + blocks * factor, factor)) ++blocks;
+        return blocks;
+    };
+
+    // --- Segment greedily: the largest factor that covers a whole section ---
+    std::vector<SpeedSection> sections;
+    for (int row = 0; row < n;) {
+        int factor = 1, blocks = 1;
+        for (int f : SPEED_FACTOR_CHOICES) {
+            if (ticks_per_row * f > 0xFF) continue;
+            int min_blocks = (MIN_SPEED_SECTION_ROWS + f - 1) / f;
+            if (blocksFrom(row, f, min_blocks) < min_blocks) continue;
+            factor = f;
+            blocks = blocksFrom(row, f, n);
+            break;
+        }
+        if (sections.empty() || sections.back().factor != factor) {
+            SpeedSection s;
+            s.source_row = row;
+            s.factor = factor;
+            sections.push_back(s);
+        }
+        sections.back().rows += blocks;
+        row += blocks * factor;
+    }
+    if (sections.size() == 1 && sections[0].factor == 1) return report;
+
+    // --- Merge rows and mark each section with its speed ---
+    UgeRowGrid merged(grid.resource());
+    int total = 0;
+    for (SpeedSection& s : sections) {
+        s.start_row = total;
+        total += s.rows;
+    }
+    merged.resize(total);
+    std::vector<int> map(n);
+    for (const SpeedSection& s : sections) {
+        for (int i = 0; i < s.rows; ++i) {
+            int src = s.source_row + i * s.factor;
+            int dst = s.start_row + i;
+            for (int k = 0; k < s.factor; ++k) map[src + k] = dst;
+            for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+                merged.notes[ch][dst] = grid.notes[ch][src];
+                merged.instruments[ch][dst] = grid.instruments[ch][src];
+                merged.effects[ch][dst] = grid.effects[ch][src];
+                merged.effect_params[ch][dst] = grid.effect_params[ch][src];
+            }
+        }
+        int ch = freeEffectChannel(merged, s.start_row);
+        if (ch < 0) {
+            debugLog() << "[UGE DEBUG] Speed sections: no free effect cell on row " << s.source_row << " for the Fxx; not used" << std::endl;
+            return report;
+        }
+        merged.effects[ch][s.start_row] = EFFECT_SET_SPEED;
+        merged.effect_params[ch][s.start_row] = ticks_per_row * s.factor;
+        if (s.start_row > 0) merged.section_starts.push_back(s.start_row);
+    }
+
+    if (loop_start >= 0) merged.loop_start_row = map[loop_start];
+    merged.chained = grid.chained;
+
+    // --- Keep it only when it dedups better ---
+    report.pages_before = countUniquePages(PageHasher(grid), 0, n, grid.section_starts);
+    report.pages_after = countUniquePages(PageHasher(merged), 0, total, merged.section_starts);
+    report.rows_after = total;
+    debugLog() << "[UGE DEBUG] Speed sections: " << sections.size() << " sections, " << n << " -> " << total << " rows, "
+               << report.pages_before << " -> " << report.pages_after << " unique pages";
+    if (std::make_pair(report.pages_after, total) >= std::make_pair(report.pages_before, n)) {
+        debugLog() << " (not used)" << std::endl;
+        report.rows_after = n;
+        return report;
+    }
+    debugLog() << std::endl;
+    for (const SpeedSection& s : sections) {
+        if (s.factor > 1) {
+            debugLog() << "[UGE DEBUG]   rows " << s.source_row << "-" << (s.source_row + s.rows * s.factor - 1) << ": " << s.factor
+                       << "x longer rows (F" << hexString(ticks_per_row * s.factor, 0, true) << ")" << std::endl;
+        }
+    }
+    grid = std::move(merged);
+    row_map = std::move(map);
+    report.sections = std::move(sections);
+    return report;
+}
+
+int speedAtRow(const UgeRowGrid& grid, int row, int initial_speed) {
+    for (int r = std::min(row, grid.total_rows - 1); r >= 0; --r) {
+        for (int ch = 0; ch < UGE_NUM_CHANNELS; ++ch) {
+            if (grid.effects[ch][r] == EFFECT_SET_SPEED) return grid.effect_params[ch][r];
+        }
+    }
+    return initial_speed;
+}
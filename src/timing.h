@@ -0,0 +1,111 @@
+#pragma once
+#include "patterns.h"
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+
+// Row resolutions tried, coarsest first
+constexpr int ROWS_PER_QUARTER_CHOICES[] = {1, 2, 3, 4, 6, 8, 12, 16, 24, 32};
+
+struct RowResolution {
+    int rows_per_quarter = 4;
+    int clusters = 0;              // distinct onset positions within a quarter note
+    double max_error_ticks = 0.0;  // worst distance of a cluster from its nearest row
+};
+
+// Picks the coarsest rows per quarter note whose row lines fall within
+// tolerance_ticks of every onset position. Onsets are folded into one
+// quarter note and clustered first (chains of positions within the
+// tolerance of each other become their weighted mean), so humanized timing
+// around a grid line counts once. Falls back to the finest choice when none
+// fits.
+RowResolution chooseRowsPerQuarter(const std::vector<int>& onset_ticks, int tpq, double tolerance_ticks);
+
+// --- Playback timer ---
+
+// hUGEDriver in timer mode steps the player from the Game Boy timer,
+// TIMER_CLOCK_HZ / timer_divider times a second, one tick per step
+constexpr double TIMER_CLOCK_HZ = 4096.0;
+constexpr int MAX_TIMER_DIVIDER = 255;
+// Largest ticks_per_row picked for the timer: speed sections and the budget
+// multiply it by up to 8 and an Fxx holds at most 255
+constexpr int MAX_TIMER_TICKS_PER_ROW = 31;
+
+struct TimerSetting {
+    int ticks_per_row = 1;
+    int divider = 1;
+    double error = 0.0;  // relative error of the row rate
+    bool clamped = false; // no ticks_per_row brings the divider within 1..255
+};
+
+// Picks ticks_per_row and the timer divider that play row_rate rows a
+// second: the ticks_per_row nearest preferred_ticks_per_row whose rounded
+// divider is within 1..255 and off by at most max_error, or failing that the
+// most accurate one
+TimerSetting chooseTimerSetting(double row_rate, int preferred_ticks_per_row, double max_error = 0.005);
+
+// --- Onset quantization ---
+
+struct OnsetQuantization {
+    explicit OnsetQuantization(std::pmr::memory_resource* resource = std::pmr::get_default_resource()) : rows(resource) {}
+
+    std::pmr::map<std::pair<int, int>, int> rows; // (MIDI channel, tick) -> row, for every onset
+    int onsets = 0;
+    int clusters = 0;  // onset positions within the bar, over all channels
+    int moved = 0;     // onsets snapped to another row than their nearest one
+    int over_limit = 0; // onsets left on their nearest row: the cluster's row was too far
+    double max_error_ticks = 0.0;
+    double mean_error_ticks = 0.0;
+};
+
+// Places note onsets ((MIDI channel, tick) pairs) on rows so that repeats
+// of the same phrase land on the same rows. Each channel's onsets are
+// folded into one bar (bar_ticks long from origin_tick) and clustered like
+// chooseRowsPerQuarter does (link_ticks), and every onset goes to the row
+// nearest its cluster's centre rather than to its own nearest row: a note
+// played a little early in one repeat and a little late in the next no
+// longer straddles a row line. Onsets that would end up more than
+// max_error_ticks from their row keep their nearest row. The result and
+// the clustering tables come from resource.
+OnsetQuantization quantizeOnsets(const std::pmr::vector<std::pair<int, int>>& onsets, int tpq, int rows_per_quarter, int bar_ticks, int origin_tick, double link_ticks, double max_error_ticks,
+                                 std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+// --- Speed sections ---
+
+// Source rows merged into one row, largest first
+constexpr int SPEED_FACTOR_CHOICES[] = {8, 4, 2};
+// Shortest merged section in source rows; shorter ones are not worth an Fxx
+constexpr int MIN_SPEED_SECTION_ROWS = 16;
+
+struct SpeedSection {
+    int source_row = 0; // first row before merging
+    int start_row = 0;  // first row after merging
+    int rows = 0;       // rows after merging
+    int factor = 1;     // source rows per row
+};
+
+struct SpeedSectionReport {
+    std::vector<SpeedSection> sections; // empty when the grid was left alone
+    int rows_before = 0;
+    int rows_after = 0;
+    int pages_before = 0; // unique pages, all channels
+    int pages_after = 0;
+};
+
+// Merges the rows of sparse sections: where every onset and effect of a
+// stretch falls on every factor-th row (and none of them lasts the whole
+// row, like a slide or vibrato), the empty rows in between are dropped and
+// the section starts with an Fxx of ticks_per_row * factor, so each row lasts
+// factor times as long and the song plays in exactly the same time. Every
+// section, the first included, starts with its Fxx so the speed is right
+// after any jump, and starts a new page (grid.section_starts) so the pages
+// of the sections around it keep their phase. Sections cover at least
+// MIN_SPEED_SECTION_ROWS source rows.
+// The grid is only changed when that gives fewer unique pages (or as many
+// and fewer rows); row_map then
+// maps each source row to its merged row (identity otherwise).
+SpeedSectionReport applySpeedSections(UgeRowGrid& grid, int ticks_per_row, std::vector<int>& row_map);
+
+// Speed in ticks per row on row (after any Fxx there), initial_speed before the first Fxx
+int speedAtRow(const UgeRowGrid& grid, int row, int initial_speed);
@@ -1,19 +1,20 @@
 #include "uge_writer.h"
+#include "profiler.h"
+#include "conversion_log.h"
 #include <fstream>
 #include <cstring>
-#include <iostream>
 #include <algorithm>
-#include <iomanip> // Required for std::hex, std::setw, std::setfill
+#include <initializer_list>
 
 // Helper to write a value as little-endian
 // (for 1, 2, 4 byte types)
 template<typename T>
-void write_le(std::ofstream& out, T value) {
-    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+void write_le(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
 }
 
-template void write_le<uint32_t>(std::ofstream&, uint32_t);
-template void write_le<uint8_t>(std::ofstream&, uint8_t);
+template void write_le<uint32_t>(std::string&, uint32_t);
+template void write_le<uint8_t>(std::string&, uint8_t);
 
 UgeShortString make_shortstring(const std::string& s) {
     UgeShortString ss{};
@@ -23,23 +24,51 @@ UgeShortString make_shortstring(const std::string& s) {
     return ss;
 }
 
-void write_shortstring(std::ofstream& out, const UgeShortString& s) {
-    out.put(s.length);
-    out.write(s.data, 255);
+void write_shortstring(std::string& out, const UgeShortString& s) {
+    out += char(s.length);
+    out.append(s.data, 255);
 }
 
-bool writeUgeFile(
-    const std::string& ugePath,
+uint8_t ugeWaveOutputLevel(uint32_t volume) {
+    if (volume == 0) return 0;
+    if (volume >= 12) return 1;
+    return volume >= 6 ? 2 : 3;
+}
+
+// A pattern or subpattern cell as stored in the file: four 32-bit fields
+// and the effect parameter. Cells are gathered into a block per (sub)pattern
+// and appended at once.
+constexpr size_t UGE_CELL_BYTES = 4 * sizeof(uint32_t) + 1;
+
+static char* put_cell(char* at, uint32_t note, uint32_t instrument_or_unused, uint32_t unused_or_jump, uint32_t effect, uint8_t effect_param) {
+    for (uint32_t field : {note, instrument_or_unused, unused_or_jump, effect}) {
+        std::memcpy(at, &field, sizeof(field));
+        at += sizeof(field);
+    }
+    *at++ = char(effect_param);
+    return at;
+}
+
+static void write_subpattern(std::string& out, const UgeSubpattern& subpattern) {
+    char block[UGE_SUBPATTERN_ROWS * UGE_CELL_BYTES];
+    char* at = block;
+    for (const auto& row : subpattern) at = put_cell(at, row.note, row.unused, row.jump, row.effect, row.effect_param);
+    out.append(block, sizeof(block));
+}
+
+std::string ugeBytes(
     const UgeSongHeader& header,
     const std::vector<UgePattern>& patterns,
     const UgeOrderMatrix& orders,
     const UgeRoutineBank& routines
 ) {
-    std::ofstream out(ugePath, std::ios::binary | std::ios::trunc);
-    if (!out) return false;
+    // The file is assembled in memory and written with one call: the
+    // instruments alone are some 20000 fields of 1 to 4 bytes
+    std::string out;
+    out.reserve(UGE_MIN_FILE_SIZE);
 
     auto logSection = [&](const char* name) {
-        std::cout << "[midi2uge debug] Offset 0x" << std::hex << std::setw(6) << std::setfill('0') << out.tellp() << ": " << name << std::dec << std::endl;
+        debugLog() << "[midi2uge debug] Offset 0x" << hexString(out.size(), 6) << ": " << name << std::endl;
     };
 
     logSection("version");
@@ -52,61 +81,46 @@ bool writeUgeFile(
     write_shortstring(out, header.comment);
     logSection("duty instruments");
     // Duty instruments
-    std::streampos offset_before_instruments = out.tellp();
     // Write duty instruments (15)
     for (const auto& inst : header.instruments.duty) {
-        write_le(out, uint32_t(0)); // type
+        write_le(out, inst.type);
         write_shortstring(out, inst.name);
-        write_le(out, uint32_t(0)); // length
-        write_le(out, uint8_t(0)); // length_enabled
-        write_le(out, uint8_t(15)); // initial_volume
-        // QUESTION: Is 15 the best default for initial_volume, or should this be instrument-specific?
-        write_le(out, uint32_t(0)); // volume_sweep_direction
-        write_le(out, uint8_t(0)); // volume_sweep_amount
-        write_le(out, uint32_t(0)); // frequency_sweep_time
-        write_le(out, uint32_t(0)); // frequency_sweep_direction
-        write_le(out, uint32_t(0)); // frequency_sweep_shift
-        write_le(out, uint8_t(0)); // duty
-        write_le(out, uint32_t(0)); // wave_output_level
-        write_le(out, uint32_t(0)); // wave_waveform_index
-        write_le(out, uint32_t(0)); // noise_counter_step
-        write_le(out, uint8_t(0)); // subpattern_enabled
+        write_le(out, inst.length);
+        write_le(out, inst.length_enabled);
+        write_le(out, inst.initial_volume);
+        write_le(out, inst.volume_sweep_direction);
+        write_le(out, inst.volume_sweep_change);
+        write_le(out, inst.frequency_sweep_time);
+        write_le(out, inst.frequency_sweep_direction);
+        write_le(out, inst.frequency_sweep_shift);
+        write_le(out, inst.duty);
+        write_le(out, inst.unused1); // wave_output_level
+        write_le(out, inst.unused2); // wave_waveform_index
+        write_le(out, inst.unused3); // noise_counter_step
+        write_le(out, inst.subpattern_enabled);
         // Always write the full subpattern block (64 x 17 bytes)
         // QUESTION: Is 64 always the correct number of rows for every pattern/instrument? Is this a UGE v6 spec?
-        for (int i = 0; i < 64; ++i) {
-            write_le(out, uint32_t(90)); // note
-            // QUESTION: Is 90 always the correct value for unused note rows?
-            write_le(out, uint32_t(0));  // unused
-            write_le(out, uint32_t(0));  // jump
-            write_le(out, uint32_t(0));  // effectcode
-            write_le(out, uint8_t(0));   // effectparam
-        }
+        write_subpattern(out, inst.subpattern);
     }
     logSection("wave instruments");
     for (const auto& inst : header.instruments.wave) {
         write_le(out, uint32_t(1));
         write_shortstring(out, inst.name);
-        write_le(out, uint32_t(0));
-        write_le(out, uint8_t(0));
-        write_le(out, uint8_t(0));
-        write_le(out, uint32_t(0));
-        write_le(out, uint8_t(0));
-        write_le(out, uint32_t(0));
-        write_le(out, uint32_t(0));
-        write_le(out, uint32_t(0));
-        write_le(out, uint8_t(0));
-        write_le(out, uint32_t(0));
-        write_le(out, uint32_t(0));
-        write_le(out, uint32_t(0));
-        write_le(out, uint8_t(0));
+        write_le(out, inst.length);
+        write_le(out, inst.length_enabled);
+        write_le(out, uint8_t(0));  // initial_volume (unused)
+        write_le(out, uint32_t(0)); // volume_sweep_direction (unused)
+        write_le(out, uint8_t(0));  // volume_sweep_change (unused)
+        write_le(out, uint32_t(0)); // frequency_sweep_time (unused)
+        write_le(out, uint32_t(0)); // frequency_sweep_direction (unused)
+        write_le(out, uint32_t(0)); // frequency_sweep_shift (unused)
+        write_le(out, uint8_t(0));  // duty (unused)
+        write_le(out, uint32_t(ugeWaveOutputLevel(inst.volume)));
+        write_le(out, inst.wave_index);
+        write_le(out, uint32_t(0)); // noise_counter_step (unused)
+        write_le(out, inst.subpattern_enabled);
         // Always write the full subpattern block
-        for (int i = 0; i < 64; ++i) {
-            write_le(out, uint32_t(90));
-            write_le(out, uint32_t(0));
-            write_le(out, uint32_t(0));
-            write_le(out, uint32_t(0));
-            write_le(out, uint8_t(0));
-        }
+        write_subpattern(out, inst.subpattern);
     }
     logSection("noise instruments");
     for (const auto& inst : header.instruments.noise) {
@@ -126,44 +140,33 @@ bool writeUgeFile(
         write_le(out, inst.noise_mode);
         write_le(out, inst.subpattern_enabled);
         // Always write the full subpattern block
-        for (int i = 0; i < 64; ++i) {
-            write_le(out, uint32_t(90));
-            write_le(out, uint32_t(0));
-            write_le(out, uint32_t(0));
-            write_le(out, uint32_t(0));
-            write_le(out, uint8_t(0));
-        }
+        write_subpattern(out, inst.subpattern);
     }
     logSection("wavetable");
-    std::streampos offset_before_wavetable = out.tellp();
     for (const auto& wave : header.wavetable) {
-        out.write(reinterpret_cast<const char*>(wave.data()), UGE_WAVETABLE_SIZE);
+        out.append(reinterpret_cast<const char*>(wave.data()), UGE_WAVETABLE_SIZE);
     }
-    std::streampos offset_after_wavetable = out.tellp();
-    std::cout << "[UGE DEBUG] Offset after wavetable: 0x" << std::hex << offset_after_wavetable << std::dec << std::endl;
+    debugLog() << "[UGE DEBUG] Offset after wavetable: 0x" << hexString(out.size()) << std::endl;
     logSection("ticks_per_row");
-    std::streampos offset_before_tempo = out.tellp();
+    size_t offset_before_tempo = out.size();
     write_le(out, header.ticks_per_row);
     logSection("timer_enabled");
-    out.put(header.timer_enabled);
+    out += char(header.timer_enabled);
     logSection("timer_divider");
     write_le(out, header.timer_divider);
-    std::streampos offset_after_tempo = out.tellp();
-    std::cout << "[UGE DEBUG] Offset before tempo fields: 0x" << std::hex << offset_before_tempo << ", after: 0x" << offset_after_tempo << std::dec << std::endl;
+    debugLog() << "[UGE DEBUG] Offset before tempo fields: 0x" << hexString(offset_before_tempo)
+               << ", after: 0x" << hexString(out.size()) << std::endl;
     logSection("patterns");
     // Write pattern section from input
     uint32_t num_patterns = patterns.size();
-    std::cout << "[UGE DEBUG] Number of patterns: " << num_patterns << std::endl;
+    debugLog() << "[UGE DEBUG] Number of patterns: " << num_patterns << std::endl;
     write_le(out, num_patterns);
     for (const auto& pat : patterns) {
         write_le(out, pat.index);
-        for (const auto& row : pat.rows) {
-            write_le(out, uint32_t(row.note));
-            write_le(out, uint32_t(row.instrument));
-            write_le(out, uint32_t(0)); // unused
-            write_le(out, uint32_t(row.effect));
-            write_le(out, uint8_t(row.effect_param));
-        }
+        char block[UGE_PATTERN_ROWS * UGE_CELL_BYTES];
+        char* at = block;
+        for (const auto& row : pat.rows) at = put_cell(at, row.note, row.instrument, 0 /* unused */, row.effect, row.effect_param);
+        out.append(block, sizeof(block));
     }
     logSection("order matrix");
     // Write order matrix from input
@@ -181,20 +184,51 @@ bool writeUgeFile(
     // Write routines section from input
     for (int i = 0; i < UGE_NUM_ROUTINES; ++i) {
         uint32_t len = (i < routines.size()) ? routines[i].size() : 0;
-        std::cout << "[uge_writer] Routine " << i << " length: " << len << std::endl;
+        debugLog() << "[uge_writer] Routine " << i << " length: " << len << std::endl;
         write_le(out, len);
-        if (len > 0) out.write(routines[i].data(), len);
-        out.put(0x00); // Terminator
+        if (len > 0) out.append(routines[i].data(), len);
+        out += char(0x00); // Terminator
     }
-    out.flush();
     // Pad file to 81254 bytes (reference length)
-    std::streampos final_size = out.tellp();
-    const size_t REF_SIZE = 81254;
     // QUESTION: Is 81254 bytes the canonical file size for minimal UGE files, or should this be dynamically determined?
-    if (final_size < REF_SIZE) {
-        std::vector<char> padding(REF_SIZE - final_size, 0);
-        out.write(padding.data(), padding.size());
-    }
+    if (out.size() < UGE_MIN_FILE_SIZE) out.resize(UGE_MIN_FILE_SIZE, '\0');
+    return out;
+}
+
+std::string ugeBytes(const UgeSong& song) {
+    return ugeBytes(song.header, song.patterns, song.orders, song.routines);
+}
+
+bool writeUge(
+    std::ostream& out,
+    const UgeSongHeader& header,
+    const std::vector<UgePattern>& patterns,
+    const UgeOrderMatrix& orders,
+    const UgeRoutineBank& routines
+) {
+    std::string bytes = ugeBytes(header, patterns, orders, routines);
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
     out.flush();
-    return true;
-} 
\ No newline at end of file
+    return bool(out);
+}
+
+bool writeUge(std::ostream& out, const UgeSong& song) {
+    return writeUge(out, song.header, song.patterns, song.orders, song.routines);
+}
+
+bool writeUgeFile(
+    const std::string& ugePath,
+    const UgeSongHeader& header,
+    const std::vector<UgePattern>& patterns,
+    const UgeOrderMatrix& orders,
+    const UgeRoutineBank& routines
+) {
+    PROFILE_SCOPE("writeUgeFile");
+    std::ofstream out(ugePath, std::ios::binary | std::ios::trunc);
+    if (!out) return false;
+    return writeUge(out, header, patterns, orders, routines);
+}
+
+bool writeUgeFile(const std::string& ugePath, const UgeSong& song) {
+    return writeUgeFile(ugePath, song.header, song.patterns, song.orders, song.routines);
+}
@@ -15,6 +15,7 @@ constexpr int UGE_WAVETABLE_SIZE = 32;
 constexpr int UGE_NUM_CHANNELS = 4;
 constexpr int UGE_NUM_ROUTINES = 16;
 constexpr int UGE_PATTERN_ROWS = 64;
+constexpr int UGE_SUBPATTERN_ROWS = 64;
 
 #pragma pack(push, 1)
 
@@ -23,6 +24,17 @@ struct UgeShortString {
     char data[255];
 };
 
+// One subpattern row; subpatterns advance one row per tick
+struct UgeSubpatternRow {
+    uint32_t note;   // 90 = no pitch change
+    uint32_t unused;
+    uint32_t jump;   // 1-based row to continue at, 0 = next row
+    uint32_t effect;
+    uint8_t effect_param;
+};
+
+using UgeSubpattern = std::array<UgeSubpatternRow, UGE_SUBPATTERN_ROWS>;
+
 struct UgeDutyInstrument {
     uint32_t type; // 0
     UgeShortString name;
@@ -39,7 +51,7 @@ struct UgeDutyInstrument {
     uint32_t unused2;
     uint32_t unused3;
     uint8_t subpattern_enabled;
-    // ...subpattern block (not shown here)...
+    UgeSubpattern subpattern;
 };
 
 struct UgeWaveInstrument {
@@ -59,7 +71,7 @@ struct UgeWaveInstrument {
     uint32_t unused8;
     uint32_t unused9;
     uint8_t subpattern_enabled;
-    // ...subpattern block (not shown here)...
+    UgeSubpattern subpattern;
 };
 
 struct UgeNoiseInstrument {
@@ -78,7 +90,7 @@ struct UgeNoiseInstrument {
     uint32_t unused6;
     uint32_t noise_mode; // 0 = 15-bit, 1 = 7-bit
     uint8_t subpattern_enabled;
-    // ...subpattern block (not shown here)...
+    UgeSubpattern subpattern;
 };
 
 using UgeDutyBank = std::array<UgeDutyInstrument, UGE_NUM_DUTY>;
@@ -127,11 +139,44 @@ struct UgeSongHeader {
 
 #pragma pack(pop)
 
+// A converted song held in memory
+struct UgeSong {
+    UgeSongHeader header;
+    std::vector<UgePattern> patterns;
+    UgeOrderMatrix orders;
+    UgeRoutineBank routines;
+};
+
+// NR32 output level (0 = mute, 1 = 100%, 2 = 50%, 3 = 25%) for a 0-15 volume
+uint8_t ugeWaveOutputLevel(uint32_t volume);
+
 // Helper functions for writing
 UgeShortString make_shortstring(const std::string& s);
-void write_shortstring(std::ofstream& out, const UgeShortString& s);
+void write_shortstring(std::string& out, const UgeShortString& s);
 template<typename T>
-void write_le(std::ofstream& out, T value);
+void write_le(std::string& out, T value);
+
+// Size of the reference file; shorter songs are padded up to it
+constexpr size_t UGE_MIN_FILE_SIZE = 81254;
+
+// The song as the bytes of a UGE v6 file
+std::string ugeBytes(
+    const UgeSongHeader& header,
+    const std::vector<UgePattern>& patterns,
+    const UgeOrderMatrix& orders,
+    const UgeRoutineBank& routines
+);
+std::string ugeBytes(const UgeSong& song);
+
+// Writes the song as a UGE v6 file to out (opened in binary mode)
+bool writeUge(
+    std::ostream& out,
+    const UgeSongHeader& header,
+    const std::vector<UgePattern>& patterns,
+    const UgeOrderMatrix& orders,
+    const UgeRoutineBank& routines
+);
+bool writeUge(std::ostream& out, const UgeSong& song);
 
 // Main write function
 bool writeUgeFile(
@@ -140,4 +185,5 @@ bool writeUgeFile(
     const std::vector<UgePattern>& patterns,
     const UgeOrderMatrix& orders,
     const UgeRoutineBank& routines
-); 
\ No newline at end of file
+);
+bool writeUgeFile(const std::string& ugePath, const UgeSong& song);
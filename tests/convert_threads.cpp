@@ -0,0 +1,200 @@
+// Stress test of concurrent conversions: the same MIDI files are converted
+// on several threads at once, each thread with a context of its own, and
+// every UGE file and warning list must match a run on a single thread.
+//
+// Usage: convert_threads [threads] [file.mid ...]
+// Without files it converts a few songs generated here.
+#include "libmidi2uge.h"
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <initializer_list>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// --- Generated songs ---
+
+void put16(std::string& out, uint32_t value) {
+    out += char(value >> 8);
+    out += char(value);
+}
+
+void put32(std::string& out, uint32_t value) {
+    put16(out, value >> 16);
+    put16(out, value & 0xFFFF);
+}
+
+void putVarLen(std::string& out, uint32_t value) {
+    char bytes[4];
+    int n = 0;
+    do {
+        bytes[n++] = char(value & 0x7F);
+        value >>= 7;
+    } while (value);
+    while (n > 1) out += char(bytes[--n] | 0x80);
+    out += bytes[0];
+}
+
+struct Track {
+    std::string data;
+    uint32_t last_tick = 0;
+
+    void event(uint32_t tick, std::initializer_list<uint8_t> bytes) {
+        putVarLen(data, tick - last_tick);
+        last_tick = tick;
+        for (uint8_t b : bytes) data += char(b);
+    }
+};
+
+// A format 1 file of a tempo track and one track per channel, with notes,
+// pitch bends and volume changes picked by a fixed-seed generator so every
+// run converts the same songs
+std::string generateSong(uint32_t seed, int channels, int bars) {
+    uint32_t state = seed;
+    auto next = [&state](uint32_t range) {
+        state = state * 1664525u + 1013904223u;
+        return (state >> 8) % range;
+    };
+    const uint32_t division = 96;
+    std::vector<Track> tracks(channels + 1);
+    tracks[0].event(0, {0xFF, 0x51, 0x03, 0x07, 0xA1, 0x20}); // 120 BPM
+    tracks[0].event(division * 4 * bars / 2, {0xFF, 0x51, 0x03, 0x05, 0x16, 0x15}); // 170 BPM
+    for (int c = 0; c < channels; ++c) {
+        Track& track = tracks[c + 1];
+        uint8_t channel = uint8_t(c == channels - 1 && channels > 3 ? 9 : c); // last one drums
+        track.event(0, {uint8_t(0xC0 | channel), uint8_t(next(128))});
+        uint32_t tick = 0;
+        const uint32_t end = division * 4 * bars;
+        while (tick < end) {
+            uint32_t length = division / 4 * (1 + next(4));
+            uint8_t key = uint8_t(channel == 9 ? 35 + next(12) : 36 + 12 * c + next(24));
+            if (next(8) == 0) track.event(tick, {uint8_t(0xB0 | channel), 7, uint8_t(40 + next(88))});
+            track.event(tick, {uint8_t(0x90 | channel), key, uint8_t(60 + next(68))});
+            if (channel != 9 && next(6) == 0) {
+                uint32_t bend = 0x2000 + next(0x1000);
+                track.event(tick + length / 2, {uint8_t(0xE0 | channel), uint8_t(bend & 0x7F), uint8_t(bend >> 7)});
+                track.event(tick + length - 1, {uint8_t(0xE0 | channel), 0x00, 0x40});
+            }
+            track.event(tick + length, {uint8_t(0x80 | channel), key, 0});
+            tick += length + (next(4) == 0 ? division / 4 : 0);
+        }
+    }
+    std::string file = "MThd";
+    put32(file, 6);
+    put16(file, 1);
+    put16(file, uint16_t(tracks.size()));
+    put16(file, division);
+    for (Track& track : tracks) {
+        track.event(track.last_tick, {0xFF, 0x2F, 0x00});
+        file += "MTrk";
+        put32(file, uint32_t(track.data.size()));
+        file += track.data;
+    }
+    return file;
+}
+
+// --- Conversions ---
+
+struct Job {
+    std::string name;
+    std::string midi;
+    const char* options; // JSON for midi2uge_convert
+};
+
+struct Result {
+    bool ok = false;
+    std::string uge; // or the error
+    std::string warnings;
+
+    bool operator==(const Result& other) const {
+        return ok == other.ok && uge == other.uge && warnings == other.warnings;
+    }
+};
+
+Result convert(midi2uge_context* ctx, const Job& job) {
+    Result result;
+    void* uge = nullptr;
+    size_t size = 0;
+    result.ok = midi2uge_convert(ctx, job.midi.data(), job.midi.size(), job.options, &uge, &size) == 0;
+    result.uge = result.ok ? std::string(static_cast<const char*>(uge), size) : midi2uge_last_error(ctx);
+    result.warnings = midi2uge_warnings(ctx);
+    midi2uge_free(uge);
+    return result;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    int threads = argc > 1 ? std::stoi(argv[1]) : 8;
+    const int rounds = 2; // each thread converts every job this many times, reusing its context
+
+    std::vector<std::string> songs, names;
+    for (int i = 2; i < argc; ++i) {
+        std::ifstream in(argv[i], std::ios::binary);
+        if (!in) {
+            std::cerr << "Cannot open " << argv[i] << std::endl;
+            return 1;
+        }
+        songs.emplace_back(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        names.push_back(argv[i]);
+    }
+    if (songs.empty()) {
+        const int shapes[][2] = {{2, 8}, {4, 32}, {4, 96}}; // channels, bars
+        for (uint32_t seed = 0; seed < 3; ++seed) {
+            songs.push_back(generateSong(seed + 1, shapes[seed][0], shapes[seed][1]));
+            names.push_back("generated song " + std::to_string(seed + 1));
+        }
+    }
+
+    // Each song as it is, through the budget reduction, and with fixed settings
+    const char* option_sets[] = {nullptr, "{\"budget\": 8192}", "{\"pattern_rows\": 0, \"rows_per_quarter\": 4}"};
+    std::vector<Job> jobs;
+    for (size_t i = 0; i < songs.size(); ++i) {
+        for (const char* options : option_sets) jobs.push_back({names[i], songs[i], options});
+    }
+
+    std::vector<Result> expected;
+    midi2uge_context* ctx = midi2uge_context_new();
+    for (const Job& job : jobs) {
+        expected.push_back(convert(ctx, job));
+        if (!expected.back().ok) {
+            std::cerr << job.name << ": conversion failed: " << expected.back().uge << std::endl;
+            midi2uge_context_free(ctx);
+            return 1;
+        }
+    }
+    midi2uge_context_free(ctx);
+
+    std::atomic<int> mismatches{0};
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; ++t) {
+        pool.emplace_back([&, t] {
+            midi2uge_context* own = midi2uge_context_new();
+            for (int round = 0; round < rounds; ++round) {
+                for (size_t k = 0; k < jobs.size(); ++k) {
+                    size_t j = (k + t) % jobs.size(); // threads start on different jobs
+                    if (convert(own, jobs[j]) == expected[j]) continue;
+                    if (mismatches++ == 0) {
+                        std::cerr << jobs[j].name << " (" << (jobs[j].options ? jobs[j].options : "defaults")
+                                  << "): thread " << t << " differs from the single-threaded run" << std::endl;
+                    }
+                }
+            }
+            midi2uge_context_free(own);
+        });
+    }
+    for (std::thread& thread : pool) thread.join();
+
+    size_t conversions = size_t(threads) * rounds * jobs.size();
+    if (mismatches) {
+        std::cerr << mismatches << " of " << conversions << " conversions differ" << std::endl;
+        return 1;
+    }
+    std::cout << conversions << " conversions on " << threads << " threads match" << std::endl;
+    return 0;
+}
@@ -0,0 +1,67 @@
+// Instrument slot allocation: every slot stands for at least one instrument
+// of its own, also when the instruments are too close to tell apart by
+// their distance (lengths within a few frames of each other).
+#include "instruments.h"
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string& what) {
+    if (ok) return;
+    std::cerr << "FAILED: " << what << std::endl;
+    ++failures;
+}
+
+// Candidates that differ only in length, first_length, first_length + 1, ...
+std::vector<InstrumentParams> byLength(int count, int first_length) {
+    std::vector<InstrumentParams> candidates(count);
+    for (int i = 0; i < count; ++i) {
+        candidates[i].name = "length " + std::to_string(first_length + i);
+        candidates[i].length_enabled = 1;
+        candidates[i].length = first_length + i;
+    }
+    return candidates;
+}
+
+// Slots as the song's instrument table uses them: all filled, each by a
+// candidate it stands for
+void checkSlots(const std::string& name, const std::vector<InstrumentParams>& candidates, int max_slots, int expected_slots) {
+    std::vector<InstrumentParams> slots;
+    std::vector<int> slot_of = allocateInstrumentSlots(candidates, max_slots, slots);
+    check((int)slots.size() == expected_slots,
+          name + ": " + std::to_string(slots.size()) + " slots, expected " + std::to_string(expected_slots));
+    std::vector<int> members(slots.size(), 0);
+    std::vector<bool> has_source(slots.size(), false);
+    for (size_t c = 0; c < candidates.size(); ++c) {
+        if (slot_of[c] < 0 || slot_of[c] >= (int)slots.size()) {
+            check(false, name + ": candidate " + std::to_string(c) + " maps to no slot");
+            continue;
+        }
+        ++members[slot_of[c]];
+        if (candidates[c].sameSound(slots[slot_of[c]])) has_source[slot_of[c]] = true;
+    }
+    for (size_t k = 0; k < slots.size(); ++k) {
+        check(members[k] > 0, name + ": slot " + std::to_string(k) + " is empty");
+        check(has_source[k], name + ": slot " + std::to_string(k) + " stands for none of its members");
+    }
+}
+
+} // namespace
+
+int main() {
+    checkSlots("20 lengths 100..119 into 15 slots", byLength(20, 100), 15, 15);
+    checkSlots("40 lengths 60..99 into 15 slots", byLength(40, 60), 15, 15);
+    checkSlots("8 lengths 100..107 into 15 slots", byLength(8, 100), 15, 8);
+
+    std::vector<InstrumentParams> repeated = byLength(3, 100);
+    repeated.insert(repeated.end(), repeated.begin(), repeated.end());
+    checkSlots("3 instruments, each twice", repeated, 15, 3);
+
+    if (failures) return 1;
+    std::cout << "instrument slots ok" << std::endl;
+    return 0;
+}
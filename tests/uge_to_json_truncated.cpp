@@ -0,0 +1,63 @@
+// Damaged UGE files through midi2uge_uge_to_json: a file cut short or a
+// count larger than the rest of the file must fail with an error, not hang
+// or read past the end.
+#include "libmidi2uge.h"
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+namespace {
+
+int failures = 0;
+
+const size_t PATTERNS_OFFSET = 0xf882; // where parse_uge reads the pattern count
+
+void putU32(std::string& out, size_t at, uint32_t value) {
+    for (int i = 0; i < 4; ++i) out[at + i] = char(value >> (8 * i));
+}
+
+// A file of zeros: no patterns, empty orders and routines
+std::string emptySong() {
+    return std::string(PATTERNS_OFFSET + 4 + 4 * 4 + 16 * 4, '\0');
+}
+
+void expect(const std::string& name, const std::string& uge, bool ok) {
+    midi2uge_context* ctx = midi2uge_context_new();
+    char* json = nullptr;
+    bool converted = midi2uge_uge_to_json(ctx, uge.data(), uge.size(), -1, &json) == 0;
+    if (converted != ok) {
+        std::cerr << "FAILED: " << name << ": " << (converted ? "converted" : midi2uge_last_error(ctx)) << std::endl;
+        ++failures;
+    } else if (!ok && std::string(midi2uge_last_error(ctx)).empty()) {
+        std::cerr << "FAILED: " << name << ": no error message" << std::endl;
+        ++failures;
+    }
+    midi2uge_free(json);
+    midi2uge_context_free(ctx);
+}
+
+} // namespace
+
+int main() {
+    expect("empty song", emptySong(), true);
+    expect("100 bytes", emptySong().substr(0, 100), false);
+    expect("cut inside the instruments", emptySong().substr(0, 0x5000), false);
+    expect("cut before the pattern count", emptySong().substr(0, PATTERNS_OFFSET + 2), false);
+    expect("cut inside the routines", emptySong().substr(0, emptySong().size() - 2), false);
+
+    std::string song = emptySong();
+    putU32(song, PATTERNS_OFFSET, 0xFFFFFFFF);
+    expect("huge pattern count", song, false);
+
+    song = emptySong();
+    putU32(song, PATTERNS_OFFSET + 4, 0x40000000);
+    expect("huge order length", song, false);
+
+    song = emptySong();
+    putU32(song, PATTERNS_OFFSET + 4 + 4 * 4, 0x7FFFFFFF);
+    expect("huge routine length", song, false);
+
+    if (failures) return 1;
+    std::cout << "truncated UGE files rejected" << std::endl;
+    return 0;
+}